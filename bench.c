@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const size_t seed = 123;
+
+// Run command and append the JSON line it prints after --bench to results, tagged
+// with the commit it was measured at. Returns 0 if the demo printed no result.
+int run(const char *command, const char *commit, char **results, size_t *length) {
+    char output[4096];
+    int found = 0;
+
+    fprintf(stderr, "%s\n", command);
+    FILE *fp = popen(command, "r");
+    if (fp == NULL) {
+        perror("Failed to run command");
+        exit(EXIT_FAILURE);
+    }
+
+    // Everything but the result is the demo loading, pass it on so progress shows
+    while (fgets(output, sizeof(output), fp) != NULL) {
+        if (strncmp(output, "{\"backend\"", 10)) {
+            fputs(output, stderr);
+            continue;
+        }
+        output[strcspn(output, "\n")] = 0;
+        size_t extra = strlen(output) + strlen(commit) + 32;
+        *results = realloc(*results, *length + extra);
+        if (*results == NULL) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        *length += snprintf(*results + *length, extra, "%s  {\"commit\": \"%s\", %s",
+                            *length ? ",\n" : "", commit, output + 1);
+        found = 1;
+    }
+
+    pclose(fp);
+    return found;
+}
+
+// Every model at every sequence length, on the GPU demo at up to max_batch sequences
+// at once and, for checkpoints, the CPU demo at one. The binaries are built by make
+// bench beforehand so the build never lands in a timing. The results go to stdout
+// as one JSON array, everything else to stderr.
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s \"MODELS\" \"SEQ_LENS\" MAX_BATCH [FLAGS] [CPU_FLAGS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *flags = argc > 4 ? argv[4] : "";
+    const char *cpu_flags = argc > 5 ? argv[5] : "";
+    int max_batch = atoi(argv[3]);
+
+    // The commit the binaries were built from, so results can be compared over time
+    char commit[64] = "unknown";
+    FILE *fp = popen("git rev-parse --short HEAD 2>/dev/null", "r");
+    if (fp != NULL) {
+        if (fgets(commit, sizeof(commit), fp) == NULL) strcpy(commit, "unknown");
+        commit[strcspn(commit, "\n")] = 0;
+        pclose(fp);
+    }
+
+    char *results = NULL;
+    size_t length = 0;
+    int failed = 0;
+    char command[4096], model[256];
+    char *seq_lens = strdup(argv[2]), *save_seq;
+    for (char *seq_len = strtok_r(seq_lens, " ,", &save_seq); seq_len; seq_len = strtok_r(NULL, " ,", &save_seq)) {
+        char *models = strdup(argv[1]), *save_model;
+        for (char *m = strtok_r(models, " ,", &save_model); m; m = strtok_r(NULL, " ,", &save_model)) {
+            snprintf(model, sizeof(model), "%s", m);
+            snprintf(command, sizeof(command),
+                     "./bin/optimized_chat_gpt_2 %s vocab.bpe %s %zu --bench --max-batch=%d %s",
+                     model, seq_len, seed, max_batch, flags);
+            failed += !run(command, commit, &results, &length);
+
+            // The CPU demo only reads checkpoints
+            size_t n = strlen(model);
+            if (n > 5 && !strcmp(model + n - 5, ".ckpt")) {
+                snprintf(command, sizeof(command), "./bin/c_chat_gpt_2 %s vocab.bpe %s %zu --bench %s",
+                         model, seq_len, seed, cpu_flags);
+                failed += !run(command, commit, &results, &length);
+            }
+        }
+        free(models);
+    }
+    free(seq_lens);
+
+    printf("[\n%s\n]\n", results ? results : "");
+    free(results);
+    if (failed) fprintf(stderr, "%d runs printed no result\n", failed);
+    return failed ? EXIT_FAILURE : 0;
+}
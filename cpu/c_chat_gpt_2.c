@@ -21,28 +21,26 @@
 #include <time.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include "cpu_utils.h"
 
 int DIM, NLAYER, NHEAD;
 
 int token_processed_upto;
 int num_total_tokens;
 int tmp, zz;
+// The vocabulary, packed back to back: token i is the string at bpe + bpe_offset[i]
 char* bpe;
+int bpe_offset[50000];
 
 void *memory, *memory_top;
 FILE* fp;
 
-typedef struct {
-    float* dat;
-    int rows, cols;
-} Matrix;
-
 Matrix* layer_weights;
 
 // Standard stuff here. Let's save space with all our loops
 #define LOOP(i, j) for (int i = 0; i < j; i++)
 
-// A matrix is just a 2d vector of floats with rows and columns.
+// Allocate a matrix out of the arena, zeroed if reuse is set
 Matrix NewMatrix(int rows, int cols, int reuse) {
     float* a = memory;
     memory += tmp = 4 * rows * cols;
@@ -51,53 +49,31 @@ Matrix NewMatrix(int rows, int cols, int reuse) {
     return out;
 }
 
-// Unary matrix meta-function here.
-// Loop over every entry in a matrix and operate on it
-// (independent of any other entry, possibly using some constant k)
-#define UNARY(fn, opr)             \
-    Matrix fn(Matrix a, float k) { \
-        LOOP(i, a.rows* a.cols) {  \
-            float b = a.dat[i];    \
-            a.dat[i] = opr;        \
-        }                          \
-        return a;                  \
-    }
-
-UNARY(divide_const, b / k)                      // divide by a constant
-UNARY(add_const, b + k)                         // add a constant
-UNARY(mat_isqrt, 1. / sqrt(b))                  // square root each entry
-UNARY(mat_exp, exp(b))                          // exponetiate each entry
-UNARY(broadcast, a.dat[(i / a.cols) * a.cols])  // copy the first column to every column
-
-// Tril is the first of two special functions.
-//   a   b   c        exp(a/8) exp(b/8) exp(c/8)
-//   d   e   f   ->      0     exp(e/8) exp(f/8)
-//   g   h   i           0        0        0
-// it's use will be described later
-UNARY(tril, (i / k < i % (int)k) ? 0 : exp(b / 8))
-
-// GELU is the activation function used for transformers
-UNARY(GELU, b / 2 * (1 + tanh(.7978845 * (b + .044715 * b * b * b))))
+// With the fast flag the elementwise loops are spread over the threads too,
+// once the matrix is big enough to be worth it
+#ifdef GOFAST
+#define PARALLEL _Pragma("omp parallel for if (a.rows * a.cols >= 1 << 16)")
+#else
+#define PARALLEL
+#endif
 
 // Binary matrix meta-function here.
 // Loop over pairs of entries in two matricies and operate on them
 #define BINARY(fn, opr)                                               \
     Matrix fn(Matrix a, Matrix b) {                                   \
+        PARALLEL                                                      \
         LOOP(i, a.rows* a.cols) { a.dat[i] = a.dat[i] opr b.dat[i]; } \
         return a;                                                     \
     }
 
-BINARY(add, +)       // add two matrices together
-BINARY(multiply, *)  // multiply two matrices together
-BINARY(divide, /)    // divide the first matrix by the second
+BINARY(add, +)  // add two matrices together
 
-// We also have some ugly hacks here to implement "tiling"
-// that lets us add or multiply one matrix by the first column of a second
+// We also have an ugly hack here to implement "tiling"
+// that lets us add the first column of a second matrix to every row of one
 // To do this tiling, we don't want to operate on b.dat[i], so instead
 // we re-index with what we want and then just stick a ; there to
 // drop the actual b.dat[i]
 BINARY(add_tile, +b.dat[i % a.cols];)
-BINARY(multiply_tile, *b.dat[i % a.cols];)
 
 // Helper function for timing
 double get_wall_time() {
@@ -107,21 +83,10 @@ double get_wall_time() {
     return wall_time;
 }
 
-// Compute the sum of the rows in a matrix, populating each row with the same sum
-Matrix sum(Matrix a) {
-    Matrix out = NewMatrix(a.rows, a.cols, 1);
-
-    LOOP(i, a.rows * a.cols) {
-        out.dat[(i / a.cols) * a.cols] += a.dat[i];
-    }
-
-    broadcast(out, 0);
-    return out;
-}
-
 // Transpose a matrix flipping the rows and columns
 Matrix transpose(Matrix a) {
     Matrix out = NewMatrix(a.cols, a.rows, 1);
+    PARALLEL
     LOOP(i, a.rows * a.cols) {
         out.dat[i % a.cols * a.rows + i / a.cols] = a.dat[i];
     }
@@ -133,34 +98,19 @@ Matrix transpose(Matrix a) {
 // 1. Instead of multiplying A by B, we do A by transpose(B)
 //    This keeps the reads out of the B matrix in sequential order
 //    which helps cache efficiency
-// 2. Instaed of performing the product all at once, we block it
-//    into 4x4 inner computations which again is much more cache efficient
-// 3. If the fast flag is defined, we use OMP to parallelize across threads
+// 2. gemmCPU in cpu_utils.c blocks the product into tiles that stay in
+//    registers, with AVX2 or AVX-512 kernels where the processor has them
+// 3. If the fast flag is defined, the tiles are spread over the threads with OMP
 // 4. We re-use computation from prior runs, and only fill in the
 //    *new* rows that weren't populated the prior run through the model
 Matrix matmul_t_fast(Matrix a, Matrix b) {
     Matrix out = NewMatrix(a.rows, b.rows, !token_processed_upto);
-
-#ifdef GOFAST
-#pragma omp parallel
-#endif
-    {
-        for (int i = token_processed_upto; i < num_total_tokens; i++) {
-#ifdef GOFAST
-#pragma omp for
-#endif
-            for (int j = 0; j < b.rows; j += 4) {
-                for (int k = 0; k < a.cols; k += 4) {
-                    LOOP(k2, 4)
-                    LOOP(j2, 4)
-                    out.dat[i * b.rows + j + j2] += a.dat[i * a.cols + k + k2] * b.dat[(j + j2) * b.cols + k + k2];
-                }
-            }
-        }
-    }
+    gemmCPU(a, b, token_processed_upto, num_total_tokens, out);
 
     // Clone the matrix so that we don't clobber our prior computation
-    return add(NewMatrix(out.rows, out.cols, 1), out);
+    Matrix copy = NewMatrix(out.rows, out.cols, 0);
+    memcpy(copy.dat, out.dat, tmp);
+    return copy;
 }
 
 // Take a slice out of a larger matrix and return a new matrix with the given shape
@@ -170,15 +120,29 @@ Matrix slice(Matrix a, int b, int rows, int cols) {
 }
 
 // A somewhat weird unary operator that computes the "layernorm" operator.
-// Exactly what it does doesn't matter.
+// Exactly what it does doesn't matter. Like the other row operations below it
+// only computes the new rows, nothing reads the old ones again.
 Matrix LayerNorm(Matrix a, int i) {
-    Matrix b = add(a, divide_const(sum(a), -a.cols));
-    Matrix k = divide_const(sum(multiply(add(NewMatrix(b.rows, b.cols, 1), b), b)), b.cols - 1);
-    Matrix out = add_tile(multiply_tile(multiply(add(NewMatrix(b.rows, b.cols, 1), b), mat_isqrt(add_const(k, 1e-5), 0)), layer_weights[i + 1]), layer_weights[i]);
-
+    Matrix out = NewMatrix(a.rows, a.cols, 0);
+    layerNormCPU(a, layer_weights[i + 1], layer_weights[i], token_processed_upto, num_total_tokens, out);
     return out;
 }
 
+// The attention softmax, exp(a / 8) over row i up to column i, normalized
+//   a   b   c        exp(a/8)/s1      0        0
+//   d   e   f   ->   exp(d/8)/s2  exp(e/8)/s2  0
+//   g   h   i            ...
+Matrix CausalSoftmax(Matrix a) {
+    causalSoftmaxCPU(a, token_processed_upto, num_total_tokens);
+    return a;
+}
+
+// GELU is the activation function used for transformers
+Matrix GELU(Matrix a) {
+    geluCPU(a, token_processed_upto, num_total_tokens);
+    return a;
+}
+
 // Compute a linear matrix layer, x * W + b
 #define Linear(a, i) add_tile(matmul_t_fast(a, layer_weights[i + 1]), layer_weights[i])
 
@@ -202,57 +166,197 @@ Matrix read_matrix(int rows, int cols) {
     return transpose(a);
 }
 
-// And now for something completely different: byte pair encoding
-// This function takes a single word and produces the tokenization of that word
-// We do this with an exponential-time algorithm that's very short:
-// for every token we know about, see if it fits in the first position.
-// If it does, see what the cost of tokenizing the rest of the word would be.
-// Return the first token that has the lowest overall cost.
-int best_outi;
-int fix(char* out) {
-    if (!*out) return 0;
-    int result = 1e9;
-    int best_i;
-    LOOP(i, 5e4) {
-        if (bpe[999 * i] && strncmp(bpe + 999 * i, out, tmp = strlen(bpe + 999 * i)) == 0) {
-            int sub_cost = fix(out + tmp) + i + 1e7;
-            if (sub_cost < result) {
-                result = sub_cost;
-                best_i = i;
+// And now for something completely different: byte pair encoding.
+// The vocabulary is kept as a trie so that all the tokens starting at some position of
+// a word can be found in one walk. Its edges are in an open addressing hash table keyed
+// by (node, next character), node 0 is the root, and every node knows the smallest
+// token that spells it, or -1.
+#define TRIE_SIZE (1 << 20)
+unsigned trie_key[TRIE_SIZE];
+int trie_child[TRIE_SIZE], trie_token[TRIE_SIZE], trie_nodes = 1;
+
+// Follow the edge for c out of node, adding it if insert is set. Returns -1 if there is none.
+int trie_step(int node, unsigned char c, int insert) {
+    unsigned key = node * 256 + c + 1, h = key * 2654435761u % TRIE_SIZE;
+    while (trie_key[h] && trie_key[h] != key) {
+        h = (h + 1) % TRIE_SIZE;
+    }
+    if (!trie_key[h]) {
+        if (!insert) return -1;
+        trie_key[h] = key;
+        trie_token[trie_nodes] = -1;
+        trie_child[h] = trie_nodes++;
+    }
+    return trie_child[h];
+}
+
+void trie_insert(char* token, int i) {
+    int node = 0;
+    while (*token) {
+        node = trie_step(node, *token++, 1);
+    }
+    if (node && trie_token[node] < 0) trie_token[node] = i;
+}
+
+// This function takes a single word and produces the tokenization of that word.
+// It picks the tokenization with the fewest tokens, and among those the one whose
+// token ids sum to the least, preferring the smaller first token on a tie. Because
+// the best way to finish a word does not depend on how it was started, this is
+// computed backwards from the end of the word, in time linear in its length
+// (times the length of the longest token). A character no token spells is skipped.
+int* fix(char* word, int* result) {
+    int n = strlen(word);
+    long long cost[n + 1];
+    int best[n + 1];
+    cost[n] = 0;
+    for (int k = n - 1; k >= 0; k--) {
+        cost[k] = cost[k + 1] + (long long)1e12;
+        best[k] = -1;
+        for (int end = k, node = 0; word[end] && (node = trie_step(node, word[end], 0)) >= 0; end++) {
+            int i = trie_token[node];
+            long long sub_cost = cost[end + 1] + i + 1 + (long long)1e7;
+            if (i >= 0 && (sub_cost < cost[k] || (sub_cost == cost[k] && i < best[k]))) {
+                cost[k] = sub_cost;
+                best[k] = i;
             }
         }
     }
-    best_outi = best_i;
+    for (int k = 0; k < n; k += best[k] < 0 ? 1 : strlen(bpe + bpe_offset[best[k]])) {
+        if (best[k] >= 0) *result++ = best[k];
+    }
     return result;
 }
 
 // Given the ability to byte-pair encode a single word, this encodes a sentence
 // by splitting it into individual words, and tokenizing each word separately
 int* tokenize(char* seq, /*INT*/ int* result) {
-    char out[1000];
     int i = 0;
     while (seq[i]) {
         int j = i++;
         while (47 < seq[i] && seq[i] < 58 || 64 < seq[i]) {
-            fflush(stdout);
             i++;
         }
-        strcpy(out, seq + j);
+        // Only the word itself is copied, so words and prompts can be any length
+        char out[i - j + 1];
+        memcpy(out, seq + j, i - j);
         out[i - j] = 0;
-        fflush(stdout);
-        int k = 0;
-        while (out[k]) {
-            fix(out + k);
-            char* ntok = bpe + best_outi * 999;
-            k += strlen(ntok);
-            *result++ = best_outi;
-        }
+        result = fix(out, result);
     }
     return result;
 }
 
+// Sampling is the same as in the GPU demo, so that the two agree for the same seed.
+// The logits are divided by the temperature, then only the top_k most likely tokens
+// stay in (0 keeps them all), and of those the fewest whose probabilities add up to
+// top_p (1 keeps them all). Set with --temperature, --top-k and --top-p.
+float temperature = 0.7, top_p = 1;
+int top_k = 0, seed;
+
+// The widest instruction set the CPU kernels may use, set with --simd=off, avx2 or avx512
+int simd_limit = SIMD_AVX512;
+
+// --bench runs the same prompt for as many tokens as the GPU demo's --bench and prints
+// the same JSON for bench.c, for a batch of one. token_times is when each token came out.
+#define BENCH_PROMPT "The quick brown fox jumps over the lazy dog, and then"
+#define BENCH_TOKENS 64
+bool bench;
+double token_times[BENCH_TOKENS];
+
+// Philox4x32-10, the counter based generator of philoxUniform in gpu/cuda_utils.cu.
+// Returns draw number counter of random stream sequence, uniform in [0, 1).
+double philox_uniform(unsigned long long key, unsigned sequence, unsigned counter) {
+    unsigned c[4] = {counter, sequence, 0, 0};
+    unsigned k[2] = {(unsigned)key, (unsigned)(key >> 32)};
+    LOOP(r, 10) {
+        unsigned long long p0 = 0xD2511F53ull * c[0], p1 = 0xCD9E8D57ull * c[2];
+        unsigned next[4] = {(unsigned)(p1 >> 32) ^ c[1] ^ k[0], (unsigned)p1,
+                            (unsigned)(p0 >> 32) ^ c[3] ^ k[1], (unsigned)p0};
+        memcpy(c, next, sizeof(c));
+        k[0] += 0x9E3779B9;
+        k[1] += 0xBB67AE85;
+    }
+    return ((((unsigned long long)c[0] << 32) | c[1]) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int descending_floats(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x < y) - (x > y);
+}
+
+int descending_weights(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+    return (x < y) - (x > y);
+}
+
+// Probabilities are exp(logit - max) in fixed point, scaled by 2^40, exactly like the GPU
+#define SAMPLE_ONE (1ull << 40)
+
+int sample(float* result, int size, int sequence, int draw) {
+    float inv_temperature = 1 / temperature;
+    float* logits = malloc(size * sizeof(float));
+    unsigned long long* weights = malloc(size * sizeof(unsigned long long));
+    float max = -INFINITY, cutoff = -INFINITY;
+    LOOP(i, size) {
+        logits[i] = result[i] * inv_temperature;
+        max = fmaxf(max, logits[i]);
+    }
+
+    // Keep every token at least as likely as the top_k-th one
+    if (top_k > 0 && top_k < size) {
+        float* sorted = malloc(size * sizeof(float));
+        memcpy(sorted, logits, size * sizeof(float));
+        qsort(sorted, size, sizeof(float), descending_floats);
+        cutoff = sorted[top_k - 1];
+        free(sorted);
+    }
+
+    unsigned long long total = 0;
+    LOOP(i, size) {
+        weights[i] = logits[i] >= cutoff ? (unsigned long long)(expf(logits[i] - max) * SAMPLE_ONE) : 0;
+        total += weights[i];
+    }
+
+    // Keep every token at least as likely as the one that takes the sum to top_p
+    if (top_p < 1) {
+        unsigned long long target = top_p * (double)total, sum = 0;
+        target += !target;
+        unsigned long long* sorted = malloc(size * sizeof(unsigned long long));
+        memcpy(sorted, weights, size * sizeof(unsigned long long));
+        qsort(sorted, size, sizeof(unsigned long long), descending_weights);
+        int j = 0;
+        while (sum + sorted[j] < target) {
+            sum += sorted[j++];
+        }
+        total = 0;
+        LOOP(i, size) {
+            weights[i] *= weights[i] >= sorted[j];
+            total += weights[i];
+        }
+        free(sorted);
+    }
+
+    // Weighted random sampling
+    unsigned long long target = philox_uniform(seed, sequence, draw) * (double)total, sum = 0;
+    target = target < total ? target : total - 1;
+    int token = 0;
+    while (token < size) {
+        sum += weights[token];
+        if (sum > target) {
+            break;
+        }
+        token++;
+    }
+    free(logits);
+    free(weights);
+    return token;
+}
+
+// The k-th conversation of a run samples from the k-th random stream
+int num_conversations;
+
 void do_inference(double start, double end, double cpu_time_used, Matrix wpe, Matrix wte, Matrix *weights, int T, char *buf, int *output){
     start = get_wall_time();
+    int sequence = num_conversations++, draw = 0, generated = 0;
     num_total_tokens = tokenize(buf, output) - output;
     memory_top = memory;
     token_processed_upto = 0;
@@ -273,7 +377,7 @@ void do_inference(double start, double end, double cpu_time_used, Matrix wpe, Ma
         // Start by loading the embedding weights and adding the position encoding.
         LOOP(i, num_total_tokens) {
             LOOP(j, DIM) {
-                line.dat[i * DIM + j] = wte.dat[output[i] * DIM + j] + wpe.dat[j * 1024 + i];
+                line.dat[i * DIM + j] = elementCPU(wte, output[i], j) + wpe.dat[j * wpe.cols + i];
             }
         }
 
@@ -310,12 +414,11 @@ void do_inference(double start, double end, double cpu_time_used, Matrix wpe, Ma
             LOOP(k, NHEAD) {
                 // Split the qkv into each of the heads
                 Matrix merge = transpose(slice(qkv, k * 3, 64 * T, 3)),
-                    // perform the product of the queries and keys and then exponentiate
-                    a = tril(matmul_t_fast(transpose(slice(merge, 0, 64, T)),
-                                        transpose(slice(merge, T, 64, T))),
-                            T),
-                    // finally multiply the softmax output (a/sum(a)) with the values matrix
-                    out = transpose(matmul_t_fast(divide(a, sum(a)), slice(merge, T * 2, 64, T)));
+                    // perform the product of the queries and keys and then the softmax
+                    a = CausalSoftmax(matmul_t_fast(transpose(slice(merge, 0, 64, T)),
+                                                    transpose(slice(merge, T, 64, T)))),
+                    // finally multiply the softmax output with the values matrix
+                    out = transpose(matmul_t_fast(a, slice(merge, T * 2, 64, T)));
                 // and copy the output to the proper location in the result matrix
                 memcpy(result.dat + 64 * T * k, out.dat, 64 * T * 4);
             }
@@ -324,7 +427,7 @@ void do_inference(double start, double end, double cpu_time_used, Matrix wpe, Ma
             line = add(line, Linear(transpose(result), 2));
 
             // Activation function and residual connection
-            line = add(line, Linear(GELU(Linear(LayerNorm(line, 6), 8), 0), 10));
+            line = add(line, Linear(GELU(Linear(LayerNorm(line, 6), 8)), 10));
         }
 
         // Reset layer weights so we can do the last layer norm
@@ -338,51 +441,21 @@ void do_inference(double start, double end, double cpu_time_used, Matrix wpe, Ma
         Matrix result = matmul_t_fast(transpose(slice(line, tmp - 1, DIM, 1)), wte);
         token_processed_upto = num_total_tokens = tmp;
 
-        // Calculate softmax probabilities
-        int size = 5e4;
-        float temperature = 0.7;
-        float* logits = divide_const(result, temperature).dat;
-        double max = logits[0];
-        for (int i = 1; i < size; i++) {
-            if (logits[i] > max) {
-                max = logits[i];
-            }
-        }
-
-        double sum = 0.0;
-        double probs[size];
-        for (int i = 0; i < size; i++) {
-            probs[i] = exp(logits[i] - max);
-            sum += probs[i];
-        }
-
-        for (int i = 0; i < size; i++) {
-            probs[i] /= sum;
-        }
-        
-        // Weighted random sampling
-        tmp = 0;
-        sum = 0.0;
-        double r = ((double)rand() / RAND_MAX);
-        while(tmp < size) {
-            sum += probs[tmp];
-            if (sum >= r) {
-                break;
-            }
-            tmp++;
-        }
+        // Sample the next token from the softmax of the logits
+        tmp = sample(result.dat, 5e4, sequence, draw++);
+        if (bench) token_times[generated] = get_wall_time();
 
         // If the history is too long, then purge by half
         if (num_total_tokens == zz) {
-            memcpy(output, output + zz / 2, tmp * 2);
+            memmove(output, output + zz / 2, (zz - zz / 2) * sizeof(int));
             num_total_tokens -= zz / 2;
             token_processed_upto = 0;
         }
         // Write it to the history buffer
         output[num_total_tokens++] = tmp;
 
-        // If it's a newline this is the end of the converstaion
-        if (bpe[tmp * 999] == 10) {
+        // If it's a newline this is the end of the converstaion, a benchmark runs to BENCH_TOKENS
+        if (bench ? ++generated == BENCH_TOKENS : bpe[bpe_offset[tmp]] == 10) {
             end = get_wall_time();
             cpu_time_used = ((double)(end - start));
             printf("\n\n----Seconds to respond: %f----\n", cpu_time_used);
@@ -390,19 +463,95 @@ void do_inference(double start, double end, double cpu_time_used, Matrix wpe, Ma
         }
 
         // Otherwise print it and keep generating along
-        printf("%s", bpe + tmp * 999);
+        if (!bench) printf("%s", bpe + bpe_offset[tmp]);
         fflush(stdout);
     }
 }
 
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// The p-th percentile of the n sorted values, by nearest rank
+double percentile(double* sorted, int n, double p) {
+    int rank = (int)ceil(p * n);
+    return n ? sorted[rank > 0 ? rank - 1 : 0] : 0;
+}
+
+// Time the tokenizer and one response to BENCH_PROMPT, and print them as JSON. The
+// time to first token includes tokenizing the prompt, as it does on the GPU.
+void run_benchmark(char* model, double load_seconds, Matrix wpe, Matrix wte, Matrix* weights) {
+    char buf[1000] = BENCH_PROMPT "\n\n";
+    int output[2 * zz + 1000], T = 0;
+    double start = get_wall_time(), end = 0, gaps[BENCH_TOKENS];
+    LOOP(i, 100) {
+        tokenize(buf, output);
+    }
+    double tokenize_seconds = (get_wall_time() - start) / 100;
+
+    start = get_wall_time();
+    do_inference(start, end, 0, wpe, wte, weights, T, buf, output);
+    double seconds = get_wall_time() - start;
+    LOOP(i, BENCH_TOKENS - 1) {
+        gaps[i] = token_times[i + 1] - token_times[i];
+    }
+    qsort(gaps, BENCH_TOKENS - 1, sizeof(double), compare_doubles);
+    printf("{\"backend\": \"cpu\", \"model\": \"%s\", \"seq_len\": %d, \"load_seconds\": %f, "
+           "\"tokenize_seconds\": %g, \"batches\": [{\"batch\": 1, \"tokens\": %d, \"seconds\": %f, "
+           "\"tokens_per_second\": %f, \"ttft_seconds\": %f, \"itl_p50_seconds\": %f, \"itl_p99_seconds\": %f}]}\n",
+           model, zz, load_seconds, tokenize_seconds, BENCH_TOKENS, seconds, BENCH_TOKENS / seconds,
+           token_times[0] - start, percentile(gaps, BENCH_TOKENS - 1, 0.5),
+           percentile(gaps, BENCH_TOKENS - 1, 0.99));
+}
+
+// Options of the form --name=value may appear anywhere on the command line,
+// they are pulled out here so the positional arguments keep their meaning
+int parse_options(int argc, char** argv) {
+    int positional = 1;
+    LOOP(i, argc - 1) {
+        char* arg = argv[i + 1];
+        if (strncmp(arg, "--", 2)) {
+            argv[positional++] = arg;
+            continue;
+        }
+        if (!strncmp(arg, "--temperature=", 14)) {
+            temperature = atof(arg + 14);
+            if (temperature > 0) continue;
+        }
+        if (!strncmp(arg, "--top-k=", 8)) {
+            top_k = atoi(arg + 8);
+            if (top_k >= 0) continue;
+        }
+        if (!strncmp(arg, "--top-p=", 8)) {
+            top_p = atof(arg + 8);
+            if (top_p > 0 && top_p <= 1) continue;
+        }
+        if (!strcmp(arg, "--bench")) {
+            bench = true;
+            continue;
+        }
+        if (!strncmp(arg, "--simd=", 7)) {
+            simd_limit = !strcmp(arg + 7, "off") ? SIMD_SCALAR : !strcmp(arg + 7, "avx2") ? SIMD_AVX2
+                         : !strcmp(arg + 7, "avx512") ? SIMD_AVX512 : -1;
+            if (simd_limit >= 0) continue;
+        }
+        fprintf(stderr, "Unknown option %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    argv[positional] = NULL;
+    return positional;
+}
+
 // Now for the main function that does most of the useful work.
 int main(int tmp, char** argv) {
     double start, end;
     double cpu_time_used;
     start = get_wall_time();
+    tmp = parse_options(tmp, argv);
     bool is_set_prompt = false;
     char *set_prompt;
-    int seed = time(NULL);
+    seed = time(NULL);
 
     //  Set random seed, for testing purposes
     if (tmp >= 5) {
@@ -417,7 +566,7 @@ int main(int tmp, char** argv) {
     }
 
     printf("Random seed %d\n", seed);
-    srand(seed);
+    printf("CPU kernels: %s\n", simd_names[simdInitCPU(simd_limit)]);
 
     // Initially let's figure out the right hyperparameters for this model
     // argv[1] stores the name of the model we're loading
@@ -431,25 +580,32 @@ int main(int tmp, char** argv) {
 
     // Allocate space
     zz = atoi(argv[3]);
+    if (zz > 1024) {
+        fprintf(stderr, "SEQ_LEN can be at most 1024, GPT-2 has no position embeddings past that\n");
+        exit(EXIT_FAILURE);
+    }
     memory = malloc(2LL * DIM * DIM * NLAYER * zz);
 
     /////////////////////////////////////////////////////////////
     ////////////////LOAD BPE FUNCTION INLINED////////////////////
     /////////////////////////////////////////////////////////////
-    bpe = malloc(1e9);
-
     // load the bpe file from argv[2]
     fp = fopen(argv[2], "r");
 
+    // No token is longer than its line in the file, so the file size bounds the table
+    fseek(fp, 0, SEEK_END);
+    bpe = malloc(ftell(fp) + 1000);
+    rewind(fp);
+    int bpe_size = 0;
+
     // The BPE was not written in a c-friendly format.
     // So we need to do some ugly processing to load it.
     unsigned char a[tmp = 999], b[tmp];
     LOOP(i, 5e4) {
-        int k = i * tmp;
+        bpe_offset[i] = bpe_size;
         if (i < 93) {
             // The first 92 tokens are just the printable ascii characters
-            bpe[k] = i + 33;
-            bpe[k + 1] = 0;
+            bpe[bpe_size++] = i + 33;
         } else if (i > 254) {
             // Ones above 254 are from the BPE file. Load those
             int fscanf_result = fscanf(fp, "%s %s", a, b);
@@ -460,17 +616,17 @@ int main(int tmp, char** argv) {
             }
 
             strcat((char*)a, (char*)b);
-            int j = 0;
             LOOP(i, a[i]) {
                 // UTF8 encoding makes life hard so handle that here
-                bpe[k + j++] = a[i] ^ 196 ? a[i] : a[++i] - 128;
+                bpe[bpe_size++] = a[i] ^ 196 ? a[i] : a[++i] - 128;
             }
-            bpe[k + j++] = 0;
         } else if (i > 187) {
             // Tokens above 187 are the nonprintable asii character from 0-32
-            bpe[k] = i - 188;
-            bpe[k + 1] = 0;
+            bpe[bpe_size++] = i - 188;
         }
+        // The tokens from 93 to 187 are left empty
+        bpe[bpe_size++] = 0;
+        trie_insert(bpe + bpe_offset[i], i);
     }
 
     fp = fopen(argv[1], "r");
@@ -494,6 +650,13 @@ int main(int tmp, char** argv) {
     Matrix wpe = read_matrix(1024, DIM),
         wte = transpose(read_matrix(5e4, DIM));
 
+    // The weights of the four matrix products of every layer, and the embedding that
+    // doubles as the output layer, are rearranged once into panels for gemmCPU
+    LOOP(i, 12 * NLAYER) {
+        if (i % 12 == 1 || i % 12 == 3 || i % 12 == 9 || i % 12 == 11) packPanelsCPU(weights + i);
+    }
+    packPanelsCPU(&wte);
+
     end = get_wall_time();
     cpu_time_used = ((double)(end - start));
     printf("\n---- Seconds to load: %f ----\t\n", cpu_time_used);
@@ -502,7 +665,9 @@ int main(int tmp, char** argv) {
     ///////////////INFERENCE FUNCTION INLINED////////////////////
     /////////////////////////////////////////////////////////////
 
-    if(is_set_prompt) {    
+    if (bench) {
+        run_benchmark(argv[1], cpu_time_used, wpe, wte, weights);
+    } else if(is_set_prompt) {    
         char buf[1000] = {0};
         int T;
         printf("\nHuman: ");
@@ -0,0 +1,351 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu_utils.h"
+
+#define LOOP(i, j) for (int i = 0; i < j; i++)
+
+// The kernels are compiled for every instruction set with target attributes and
+// picked at runtime, so one binary built without -march runs anywhere and still
+// uses AVX-512 where there is one
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2,fma")))
+#define AVX512 __attribute__((target("avx512f,avx2,fma")))
+#define INLINE static inline __attribute__((always_inline))
+#endif
+
+const char* simd_names[] = {"scalar", "avx2", "avx512"};
+static int simd = SIMD_SCALAR;
+
+int simdInitCPU(int limit) {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) simd = SIMD_AVX2;
+    if (simd == SIMD_AVX2 && __builtin_cpu_supports("avx512f")) simd = SIMD_AVX512;
+#endif
+    if (simd > limit) simd = limit;
+    return simd;
+}
+
+// Panel p of b, zero past its last row
+static void pack_panel(Matrix b, int p, float* panel) {
+    LOOP(j, PANEL) {
+        int r = p * PANEL + j;
+        LOOP(k, b.cols) {
+            panel[(size_t)k * PANEL + j] = r < b.rows ? b.dat[(size_t)r * b.cols + k] : 0;
+        }
+    }
+}
+
+static void pack_all(Matrix b, float* panels) {
+#ifdef GOFAST
+#pragma omp parallel for
+#endif
+    for (int p = 0; p < (b.rows + PANEL - 1) / PANEL; p++) {
+        pack_panel(b, p, panels + (size_t)p * PANEL * b.cols);
+    }
+}
+
+int packPanelsCPU(Matrix* b) {
+    if (b->packed) return 1;
+    if (b->rows % PANEL) return 0;
+    size_t size = (size_t)b->rows * b->cols * sizeof(float);
+    float* panels = malloc(size);
+    pack_all(*b, panels);
+    memcpy(b->dat, panels, size);
+    free(panels);
+    b->packed = 1;
+    return 1;
+}
+
+// The micro-kernels compute a tile of R rows of a against one panel, R times PANEL
+// sums, all kept in registers for the whole of k. Every sum adds up its products in
+// order, like the blocked loop this replaced, so the scalar kernel gives the same
+// bits as before and the vector ones only differ by their fused multiply-adds.
+typedef void (*Kernel)(const float* a, size_t lda, const float* panel, int k, float* c, size_t ldc, int cols);
+
+static void kernel_scalar(int R, const float* a, size_t lda, const float* panel, int K, float* c, size_t ldc,
+                          int cols) {
+    float acc[4][PANEL] = {{0}};
+    LOOP(k, K) {
+        LOOP(r, R) {
+            LOOP(j, PANEL) {
+                acc[r][j] += a[r * lda + k] * panel[(size_t)k * PANEL + j];
+            }
+        }
+    }
+    LOOP(r, R) {
+        memcpy(c + r * ldc, acc[r], cols * sizeof(float));
+    }
+}
+
+#ifdef SIMD_X86
+// Up to 6 rows of two vectors of 8 each, 12 of the 16 registers
+AVX2 INLINE void kernel_avx2(int R, const float* a, size_t lda, const float* panel, int K, float* c, size_t ldc,
+                             int cols) {
+    __m256 lo[6], hi[6];
+    LOOP(r, R) {
+        lo[r] = hi[r] = _mm256_setzero_ps();
+    }
+    LOOP(k, K) {
+        __m256 b0 = _mm256_loadu_ps(panel + (size_t)k * PANEL), b1 = _mm256_loadu_ps(panel + (size_t)k * PANEL + 8);
+        LOOP(r, R) {
+            __m256 v = _mm256_broadcast_ss(a + r * lda + k);
+            lo[r] = _mm256_fmadd_ps(v, b0, lo[r]);
+            hi[r] = _mm256_fmadd_ps(v, b1, hi[r]);
+        }
+    }
+    LOOP(r, R) {
+        float tile[PANEL];
+        float* out = cols == PANEL ? c + r * ldc : tile;
+        _mm256_storeu_ps(out, lo[r]);
+        _mm256_storeu_ps(out + 8, hi[r]);
+        if (out == tile) memcpy(c + r * ldc, tile, cols * sizeof(float));
+    }
+}
+
+// Up to 12 rows of one vector of 16 each
+AVX512 INLINE void kernel_avx512(int R, const float* a, size_t lda, const float* panel, int K, float* c, size_t ldc,
+                                 int cols) {
+    __m512 acc[12];
+    LOOP(r, R) {
+        acc[r] = _mm512_setzero_ps();
+    }
+    LOOP(k, K) {
+        __m512 b = _mm512_loadu_ps(panel + (size_t)k * PANEL);
+        LOOP(r, R) {
+            acc[r] = _mm512_fmadd_ps(_mm512_set1_ps(a[r * lda + k]), b, acc[r]);
+        }
+    }
+    LOOP(r, R) {
+        _mm512_mask_storeu_ps(c + r * ldc, (__mmask16)((1u << cols) - 1), acc[r]);
+    }
+}
+
+// One function per number of rows, so the loops over them unroll into registers
+#define KERNEL(isa, target, R)                                                                            \
+    target static void isa##_##R(const float* a, size_t lda, const float* panel, int K, float* c, size_t ldc, \
+                                 int cols) {                                                              \
+        kernel_##isa(R, a, lda, panel, K, c, ldc, cols);                                                  \
+    }
+KERNEL(avx2, AVX2, 1) KERNEL(avx2, AVX2, 2) KERNEL(avx2, AVX2, 3)
+KERNEL(avx2, AVX2, 4) KERNEL(avx2, AVX2, 5) KERNEL(avx2, AVX2, 6)
+KERNEL(avx512, AVX512, 1) KERNEL(avx512, AVX512, 2) KERNEL(avx512, AVX512, 3)
+KERNEL(avx512, AVX512, 4) KERNEL(avx512, AVX512, 5) KERNEL(avx512, AVX512, 6)
+KERNEL(avx512, AVX512, 7) KERNEL(avx512, AVX512, 8) KERNEL(avx512, AVX512, 9)
+KERNEL(avx512, AVX512, 10) KERNEL(avx512, AVX512, 11) KERNEL(avx512, AVX512, 12)
+
+static const Kernel avx2_kernels[] = {NULL, avx2_1, avx2_2, avx2_3, avx2_4, avx2_5, avx2_6};
+static const Kernel avx512_kernels[] = {NULL, avx512_1, avx512_2, avx512_3, avx512_4, avx512_5, avx512_6,
+                                        avx512_7, avx512_8, avx512_9, avx512_10, avx512_11, avx512_12};
+#endif
+
+// The product is cut into tiles of a few rows by one panel, and the threads share
+// out the tiles panel by panel, so that each reuses its panels for every row tile
+// while they are in cache. A decode step has a single row and still keeps every
+// thread busy with its own panels.
+void gemmCPU(Matrix a, Matrix b, int begin, int end, Matrix out) {
+    if (begin >= end) return;
+    int K = a.cols, panels = (b.rows + PANEL - 1) / PANEL;
+    float* scratch = NULL;
+    const float* packed = b.dat;
+    if (!b.packed) {
+        scratch = malloc((size_t)panels * PANEL * K * sizeof(float));
+        pack_all(b, scratch);
+        packed = scratch;
+    }
+
+    int mr = simd == SIMD_AVX512 ? 12 : simd == SIMD_AVX2 ? 6 : 4;
+    int tiles = (end - begin + mr - 1) / mr;
+#ifdef GOFAST
+#pragma omp parallel for collapse(2) schedule(static)
+#endif
+    for (int p = 0; p < panels; p++) {
+        for (int t = 0; t < tiles; t++) {
+            int row = begin + t * mr;
+            int rows = end - row < mr ? end - row : mr;
+            int cols = b.rows - p * PANEL < PANEL ? b.rows - p * PANEL : PANEL;
+            const float* ap = a.dat + (size_t)row * K;
+            const float* panel = packed + (size_t)p * PANEL * K;
+            float* cp = out.dat + (size_t)row * out.cols + p * PANEL;
+#ifdef SIMD_X86
+            if (simd == SIMD_AVX512) {
+                avx512_kernels[rows](ap, K, panel, K, cp, out.cols, cols);
+                continue;
+            }
+            if (simd == SIMD_AVX2) {
+                avx2_kernels[rows](ap, K, panel, K, cp, out.cols, cols);
+                continue;
+            }
+#endif
+            kernel_scalar(rows, ap, K, panel, K, cp, out.cols, cols);
+        }
+    }
+    free(scratch);
+}
+
+// The row operations. The scalar versions do exactly the arithmetic of the chains of
+// matrix operations they replaced. The vector ones stop at AVX2, they are bound by
+// memory long before the width of the vectors matters.
+#ifdef SIMD_X86
+AVX2 INLINE float sum_avx2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+// exp as in Cephes: e^x = 2^n e^r with |r| <= ln(2) / 2 and a polynomial for e^r
+AVX2 INLINE __m256 exp_avx2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1)));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+AVX2 static void layer_norm_avx2(float* x, const float* gain, const float* bias, int n, float* out) {
+    __m256 s = _mm256_setzero_ps();
+    int j = 0;
+    for (; j + 8 <= n; j += 8) s = _mm256_add_ps(s, _mm256_loadu_ps(x + j));
+    float total = sum_avx2(s);
+    for (; j < n; j++) total += x[j];
+    float shift = total / -n;
+
+    __m256 vshift = _mm256_set1_ps(shift), q = _mm256_setzero_ps();
+    for (j = 0; j + 8 <= n; j += 8) {
+        __m256 b = _mm256_add_ps(_mm256_loadu_ps(x + j), vshift);
+        _mm256_storeu_ps(x + j, b);
+        q = _mm256_fmadd_ps(b, b, q);
+    }
+    float var = sum_avx2(q);
+    for (; j < n; j++) {
+        x[j] += shift;
+        var += x[j] * x[j];
+    }
+    float rstd = 1. / sqrt(var / (n - 1) + 1e-5f);
+
+    __m256 vrstd = _mm256_set1_ps(rstd);
+    for (j = 0; j + 8 <= n; j += 8) {
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(x + j), vrstd);
+        _mm256_storeu_ps(out + j, _mm256_fmadd_ps(b, _mm256_loadu_ps(gain + j), _mm256_loadu_ps(bias + j)));
+    }
+    for (; j < n; j++) out[j] = x[j] * rstd * gain[j] + bias[j];
+}
+
+AVX2 static void softmax_avx2(float* x, int n, int row) {
+    __m256 s = _mm256_setzero_ps(), eighth = _mm256_set1_ps(0.125f);
+    int j = 0;
+    for (; j + 8 <= row + 1; j += 8) {
+        __m256 e = exp_avx2(_mm256_mul_ps(_mm256_loadu_ps(x + j), eighth));
+        _mm256_storeu_ps(x + j, e);
+        s = _mm256_add_ps(s, e);
+    }
+    float total = sum_avx2(s);
+    for (; j <= row; j++) total += x[j] = expf(x[j] / 8);
+    memset(x + row + 1, 0, (n - row - 1) * sizeof(float));
+
+    __m256 vtotal = _mm256_set1_ps(total);
+    for (j = 0; j + 8 <= row + 1; j += 8) _mm256_storeu_ps(x + j, _mm256_div_ps(_mm256_loadu_ps(x + j), vtotal));
+    for (; j <= row; j++) x[j] /= total;
+}
+
+// tanh(y) = 1 - 2 / (e^2y + 1), which saturates cleanly as e^2y over- or underflows
+AVX2 static void gelu_avx2(float* x, int n) {
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m256 b = _mm256_loadu_ps(x + j);
+        __m256 y = _mm256_mul_ps(_mm256_set1_ps(.7978845f),
+                                 _mm256_fmadd_ps(_mm256_mul_ps(_mm256_set1_ps(.044715f), b), _mm256_mul_ps(b, b), b));
+        __m256 e = exp_avx2(_mm256_add_ps(y, y));
+        __m256 t = _mm256_sub_ps(_mm256_set1_ps(1),
+                                 _mm256_div_ps(_mm256_set1_ps(2), _mm256_add_ps(e, _mm256_set1_ps(1))));
+        _mm256_storeu_ps(x + j, _mm256_mul_ps(_mm256_mul_ps(b, _mm256_set1_ps(.5f)), _mm256_add_ps(t, _mm256_set1_ps(1))));
+    }
+    for (; j < n; j++) x[j] = x[j] / 2 * (1 + tanh(.7978845 * (x[j] + .044715 * x[j] * x[j] * x[j])));
+}
+#endif
+
+static void layer_norm_scalar(float* x, const float* gain, const float* bias, int n, float* out) {
+    float total = 0, var = 0;
+    LOOP(j, n) total += x[j];
+    float shift = total / -n;
+    LOOP(j, n) {
+        x[j] += shift;
+        var += x[j] * x[j];
+    }
+    float rstd = 1. / sqrt(var / (n - 1) + 1e-5f);
+    LOOP(j, n) out[j] = x[j] * rstd * gain[j] + bias[j];
+}
+
+static void softmax_scalar(float* x, int n, int row) {
+    float total = 0;
+    LOOP(j, n) {
+        x[j] = j > row ? 0 : exp(x[j] / 8);
+        total += x[j];
+    }
+    LOOP(j, n) x[j] = x[j] / total;
+}
+
+static void gelu_scalar(float* x, int n) {
+    LOOP(j, n) x[j] = x[j] / 2 * (1 + tanh(.7978845 * (x[j] + .044715 * x[j] * x[j] * x[j])));
+}
+
+// A prompt spreads its rows over the threads, a single new token is not worth it
+#ifdef GOFAST
+#define ROWS _Pragma("omp parallel for if (end - begin >= 16)")
+#else
+#define ROWS
+#endif
+
+void layerNormCPU(Matrix a, Matrix weight, Matrix bias, int begin, int end, Matrix out) {
+    ROWS
+    for (int i = begin; i < end; i++) {
+        float *x = a.dat + (size_t)i * a.cols, *y = out.dat + (size_t)i * a.cols;
+#ifdef SIMD_X86
+        if (simd) {
+            layer_norm_avx2(x, weight.dat, bias.dat, a.cols, y);
+            continue;
+        }
+#endif
+        layer_norm_scalar(x, weight.dat, bias.dat, a.cols, y);
+    }
+}
+
+void causalSoftmaxCPU(Matrix a, int begin, int end) {
+    ROWS
+    for (int i = begin; i < end; i++) {
+        float* x = a.dat + (size_t)i * a.cols;
+#ifdef SIMD_X86
+        if (simd) {
+            softmax_avx2(x, a.cols, i);
+            continue;
+        }
+#endif
+        softmax_scalar(x, a.cols, i);
+    }
+}
+
+void geluCPU(Matrix a, int begin, int end) {
+    ROWS
+    for (int i = begin; i < end; i++) {
+        float* x = a.dat + (size_t)i * a.cols;
+#ifdef SIMD_X86
+        if (simd) {
+            gelu_avx2(x, a.cols);
+            continue;
+        }
+#endif
+        gelu_scalar(x, a.cols);
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stddef.h>
+
+// A matrix is just a 2d vector of floats with rows and columns. Once a weight matrix
+// is packed into panels for gemmCPU, dat holds the panels instead of the rows.
+typedef struct {
+    float* dat;
+    int rows, cols;
+    int packed;
+} Matrix;
+
+// The instruction sets the kernels come in. simdInitCPU picks the widest one the
+// processor supports, but at most limit, and returns it.
+enum { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+extern const char* simd_names[];
+int simdInitCPU(int limit);
+
+// A panel is PANEL rows of a matrix stored column by column, so that a GEMM kernel
+// reads one vector of PANEL values for every column. packPanelsCPU rearranges b in
+// place, which needs b.rows to be a multiple of PANEL, and returns 0 if it is not.
+#define PANEL 16
+int packPanelsCPU(Matrix* b);
+
+// Row r, column c of b, packed or not
+static inline float elementCPU(Matrix b, int r, int c) {
+    return b.packed ? b.dat[((size_t)(r / PANEL) * b.cols + c) * PANEL + r % PANEL] : b.dat[(size_t)r * b.cols + c];
+}
+
+// Rows begin up to end of out = a * transpose(b). b is packed on the fly unless it is
+// already, and the tiles of the product are spread over the threads.
+void gemmCPU(Matrix a, Matrix b, int begin, int end, Matrix out);
+
+// The same operations as the GPU demo, over rows begin up to end: a LayerNorm into out,
+// which leaves a centered like the chain of operations it replaced did, the causal
+// softmax of the attention scores exp(a / 8) in place, and GELU in place
+void layerNormCPU(Matrix a, Matrix weight, Matrix bias, int begin, int end, Matrix out);
+void causalSoftmaxCPU(Matrix a, int begin, int end);
+void geluCPU(Matrix a, int begin, int end);
@@ -1,11 +1,218 @@
 #include <cuda_runtime.h>
 #include <iostream>
 #include <cublas_v2.h>
+#include <cublasLt.h>
+#include <cuda_fp16.h>
+#include <cuda_bf16.h>
+#include <mma.h>
 #include <float.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef USE_NCCL
+#include <nccl.h>
+#endif
+#ifdef USE_NVTX
+#include <nvtx3/nvToolsExt.h>
+#endif
 #include "cuda_utils.h"
 
 #define CEIL_DIV(a, b) (((a) + (b) - 1) / (b))
 
+// Every kernel and library call is issued into this stream, the legacy default
+// stream unless setStreamCUDA picked another. One made with cudaStreamCreate still
+// waits for, and is waited on by, the plain cudaMemcpy calls of the host.
+static cudaStream_t stream = 0;
+
+// Instrumentation, see profileInitCUDA. Every op and every range of the host gets an
+// entry the first time it comes up, and a pair of events for every call, which are
+// only read back in bulk, when the pool runs out and for the report. The pairs of
+// the ranges still open are kept, and nested ops only count towards the outermost.
+#define PROFILE_ENTRIES 128
+#define PROFILE_PAIRS 4096
+#define PROFILE_DEPTH 16
+
+struct ProfileEntry {
+    const char* name;
+    bool range;
+    long long calls;
+    double ms;
+};
+
+static int profile_flags;
+static ProfileEntry profile_entries[PROFILE_ENTRIES];
+static int num_profile_entries;
+static cudaEvent_t profile_events[2 * PROFILE_PAIRS];
+static int profile_owner[PROFILE_PAIRS];
+static bool profile_open[PROFILE_PAIRS];
+static int num_profile_pairs;
+static int open_ranges[PROFILE_DEPTH], num_open_ranges;
+static int profile_depth;
+
+static int profileEntry(const char* name, bool range) {
+    for (int i = 0; i < num_profile_entries; i++) {
+        if (profile_entries[i].range == range && !strcmp(profile_entries[i].name, name)) return i;
+    }
+    if (num_profile_entries == PROFILE_ENTRIES) {
+        std::cerr << "More than " << PROFILE_ENTRIES << " ops and ranges to profile" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    profile_entries[num_profile_entries] = {strdup(name), range, 0, 0};
+    return num_profile_entries++;
+}
+
+// Add up the time of every pair of events that has been closed, and move the open
+// ones to the front of the pool
+static void profileCollect() {
+    int kept = 0;
+    for (int i = 0; i < num_profile_pairs; i++) {
+        if (profile_open[i]) {
+            for (int r = 0; r < num_open_ranges; r++) {
+                if (open_ranges[r] == i) open_ranges[r] = kept;
+            }
+            std::swap(profile_events[2 * kept], profile_events[2 * i]);
+            std::swap(profile_events[2 * kept + 1], profile_events[2 * i + 1]);
+            profile_owner[kept] = profile_owner[i];
+            profile_open[kept++] = true;
+            continue;
+        }
+        float ms = 0;
+        cudaEventSynchronize(profile_events[2 * i + 1]);
+        cudaEventElapsedTime(&ms, profile_events[2 * i], profile_events[2 * i + 1]);
+        profile_entries[profile_owner[i]].ms += ms;
+    }
+    num_profile_pairs = kept;
+}
+
+static int profileStart(int entry) {
+    if (num_profile_pairs == PROFILE_PAIRS) profileCollect();
+    int pair = num_profile_pairs++;
+    profile_owner[pair] = entry;
+    profile_open[pair] = true;
+    cudaEventRecord(profile_events[2 * pair], stream);
+    return pair;
+}
+
+static void profileStop(int pair) {
+    cudaEventRecord(profile_events[2 * pair + 1], stream);
+    profile_open[pair] = false;
+    profile_entries[profile_owner[pair]].calls++;
+}
+
+// Wraps an entry point from the first line of its body to its return
+struct ProfileScope {
+    const char* name;
+    int pair = -1;
+
+    ProfileScope(const char* name) : name(name) {
+#ifdef USE_NVTX
+        nvtxRangePushA(name);
+#endif
+        if (profile_flags && !profile_depth++ && (profile_flags & PROFILE_TIMES)) {
+            pair = profileStart(profileEntry(name, false));
+        }
+    }
+    ~ProfileScope() {
+        if (profile_flags) {
+            if (pair >= 0) profileStop(pair);
+            if (!--profile_depth && (profile_flags & PROFILE_CHECK)) {
+                cudaError_t error = cudaGetLastError();
+                if (error == cudaSuccess) error = cudaStreamSynchronize(stream);
+                if (error != cudaSuccess) {
+                    std::cerr << name << " failed: " << cudaGetErrorString(error) << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+#ifdef USE_NVTX
+        nvtxRangePop();
+#endif
+    }
+};
+#define PROFILE ProfileScope profile_scope(__func__)
+
+extern "C" void profileInitCUDA(int flags) {
+    if ((flags & PROFILE_TIMES) && !(profile_flags & PROFILE_TIMES)) {
+        for (int i = 0; i < 2 * PROFILE_PAIRS; i++) {
+            cudaEventCreate(&profile_events[i]);
+        }
+    }
+    profile_flags = flags;
+}
+
+extern "C" void rangePushCUDA(const char* name) {
+#ifdef USE_NVTX
+    nvtxRangePushA(name);
+#endif
+    if (!(profile_flags & PROFILE_TIMES)) return;
+    if (num_open_ranges == PROFILE_DEPTH) {
+        std::cerr << "More than " << PROFILE_DEPTH << " ranges open at once" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    open_ranges[num_open_ranges++] = profileStart(profileEntry(name, true));
+}
+
+extern "C" void rangePopCUDA(void) {
+#ifdef USE_NVTX
+    nvtxRangePop();
+#endif
+    if (profile_flags & PROFILE_TIMES) profileStop(open_ranges[--num_open_ranges]);
+}
+
+extern "C" void profileReportCUDA(void) {
+    profileCollect();
+    double total = 0;
+    long long calls = 0;
+    int order[PROFILE_ENTRIES], n = 0;
+    for (int i = 0; i < num_profile_entries; i++) {
+        if (profile_entries[i].range) continue;
+        total += profile_entries[i].ms;
+        calls += profile_entries[i].calls;
+        // Insertion sort, the most expensive first
+        int j = n++;
+        for (; j && profile_entries[order[j - 1]].ms < profile_entries[i].ms; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    printf("\n----GPU time per range----\n%12s %10s  %s\n", "ms", "calls", "range");
+    for (int i = 0; i < num_profile_entries; i++) {
+        ProfileEntry* e = profile_entries + i;
+        if (e->range) printf("%12.3f %10lld  %s\n", e->ms, e->calls, e->name);
+    }
+    printf("----GPU time per op, %.3f ms in %lld calls----\n%12s %10s %6s  %s\n", total, calls, "ms", "calls",
+           "share", "op");
+    for (int i = 0; i < n; i++) {
+        ProfileEntry* e = profile_entries + order[i];
+        printf("%12.3f %10lld %5.1f%%  %s\n", e->ms, e->calls, total ? 100 * e->ms / total : 0, e->name);
+    }
+}
+
+// GELU is the activation function used for transformers
+__device__ __forceinline__ float gelu(float b) {
+    return b / 2 * (1 + tanh(.7978845 * (b + .044715 * b * b * b)));
+}
+
+// What a GEMM does with each element of the product on its way out. The GEMM kernels
+// are instantiated per epilogue, so the bias, the GELU and the residual are applied
+// in registers as the tile is written and the product never makes a round trip
+// through memory. With the residual, c already holds the residual stream.
+template <int EPILOGUE>
+struct Epilogue {
+    const float* bias;
+
+    __device__ __forceinline__ float apply(float v, int col) const {
+        if (EPILOGUE != EPILOGUE_NONE) v += bias[col];
+        if (EPILOGUE == EPILOGUE_BIAS_GELU) v = gelu(v);
+        return v;
+    }
+    __device__ __forceinline__ void store(float* c, float v, int col) const {
+        v = apply(v, col);
+        *c = EPILOGUE == EPILOGUE_BIAS_RESIDUAL ? *c + v : v;
+    }
+};
+
 // CUDA kernel for matrix multiplication with A and transpose(B)
 __global__ void matMulCudaKernelNaive(float* A, float* B, float* C, int aRows, int aCols, int bRows) {
     int row = blockIdx.y * blockDim.y + threadIdx.y;
@@ -22,6 +229,7 @@ __global__ void matMulCudaKernelNaive(float* A, float* B, float* C, int aRows, i
 }
 
 extern "C" void matMulCUDANaive(float* a, int aRows, int aCols, float* b, int bRows, int bCols, float* out) {
+    PROFILE;
     float *d_A, *d_B, *d_C;
     size_t sizeA = aRows * aCols * sizeof(float);
     size_t sizeB = bRows * bCols * sizeof(float);
@@ -38,7 +246,7 @@ extern "C" void matMulCUDANaive(float* a, int aRows, int aCols, float* b, int bR
     dim3 dimBlock(32, 32);
     dim3 dimGrid(CEIL_DIV(bRows, 32), CEIL_DIV(aRows, 32));
 
-    matMulCudaKernelNaive<<<dimGrid, dimBlock>>>(d_A, d_B, d_C, aRows, aCols, bRows);
+    matMulCudaKernelNaive<<<dimGrid, dimBlock, 0, stream>>>(d_A, d_B, d_C, aRows, aCols, bRows);
 
     cudaMemcpy(out, d_C, sizeC, cudaMemcpyDeviceToHost);
     cudaFree(d_A);
@@ -47,7 +255,9 @@ extern "C" void matMulCUDANaive(float* a, int aRows, int aCols, float* b, int bR
 }
 
 // CUDA kernel for matrix multiplication with A and transpose(B)
-__global__ void matMulCudaKernelOptimized(float* A, float* B, float* C, int aRows, int aCols, int bRows) {
+template <int EPILOGUE>
+__global__ void matMulCudaKernelOptimized(float* A, float* B, float* C, int aRows, int aCols, int bRows,
+                                          Epilogue<EPILOGUE> epi) {
     const int TILE_SIZE = 32;
 
     int row = blockIdx.y * blockDim.y + threadIdx.y;
@@ -82,22 +292,489 @@ __global__ void matMulCudaKernelOptimized(float* A, float* B, float* C, int aRow
     }
 
     if (row < aRows && col < bRows) {
-        C[row * bRows + col] = value;
+        epi.store(&C[row * bRows + col], value, col);
+    }
+}
+
+// Second generation kernel for C = A * B.T. A block computes a BM x BN tile of C
+// and each thread a TM x TN sub-tile held in registers, so every value read from
+// shared memory is reused TM or TN times. Both operands are contiguous along K,
+// so tiles are fetched with float4 loads along K and stored transposed as
+// As[k][m] and Bs[k][n]. The next K slice is prefetched into registers while the
+// current one is consumed, and the two shared buffers alternate, which leaves a
+// single barrier per K step. Needs K % 4 == 0 and 16 byte aligned A and B.
+template <int BM, int BN, int BK, int TM, int TN, int EPILOGUE>
+__global__ void __launch_bounds__((BM / TM) * (BN / TN))
+sgemmKernel(const float* A, const float* B, float* C, int M, int N, int K, Epilogue<EPILOGUE> epi) {
+    constexpr int THREADS = (BM / TM) * (BN / TN);
+    constexpr int A_LOADS = BM * BK / 4 / THREADS;
+    constexpr int B_LOADS = BN * BK / 4 / THREADS;
+    static_assert(A_LOADS >= 1 && B_LOADS >= 1, "every thread loads at least one float4 per tile");
+
+    __shared__ __align__(16) float As[2][BK][BM];
+    __shared__ __align__(16) float Bs[2][BK][BN];
+
+    int tid = threadIdx.x;
+    int tx = tid % (BN / TN);
+    int ty = tid / (BN / TN);
+    int rowBase = blockIdx.y * BM;
+    int colBase = blockIdx.x * BN;
+
+    float4 aReg[A_LOADS], bReg[B_LOADS];
+    float acc[TM][TN] = {};
+    const float4 zero = make_float4(0, 0, 0, 0);
+
+    // Element idx of a tile is row idx / (BK / 4), columns (idx % (BK / 4)) * 4 .. + 3
+    auto fetch = [&](int k0) {
+        #pragma unroll
+        for (int l = 0; l < A_LOADS; l++) {
+            int idx = tid + l * THREADS;
+            int row = rowBase + idx / (BK / 4), k = k0 + idx % (BK / 4) * 4;
+            aReg[l] = row < M && k < K ? *(const float4*)(A + (size_t)row * K + k) : zero;
+        }
+        #pragma unroll
+        for (int l = 0; l < B_LOADS; l++) {
+            int idx = tid + l * THREADS;
+            int col = colBase + idx / (BK / 4), k = k0 + idx % (BK / 4) * 4;
+            bReg[l] = col < N && k < K ? *(const float4*)(B + (size_t)col * K + k) : zero;
+        }
+    };
+    auto stash = [&](int buf) {
+        #pragma unroll
+        for (int l = 0; l < A_LOADS; l++) {
+            int idx = tid + l * THREADS;
+            int m = idx / (BK / 4), k = idx % (BK / 4) * 4;
+            As[buf][k + 0][m] = aReg[l].x;
+            As[buf][k + 1][m] = aReg[l].y;
+            As[buf][k + 2][m] = aReg[l].z;
+            As[buf][k + 3][m] = aReg[l].w;
+        }
+        #pragma unroll
+        for (int l = 0; l < B_LOADS; l++) {
+            int idx = tid + l * THREADS;
+            int n = idx / (BK / 4), k = idx % (BK / 4) * 4;
+            Bs[buf][k + 0][n] = bReg[l].x;
+            Bs[buf][k + 1][n] = bReg[l].y;
+            Bs[buf][k + 2][n] = bReg[l].z;
+            Bs[buf][k + 3][n] = bReg[l].w;
+        }
+    };
+
+    fetch(0);
+    stash(0);
+    __syncthreads();
+
+    for (int k0 = 0; k0 < K; k0 += BK) {
+        int buf = (k0 / BK) & 1;
+        bool more = k0 + BK < K;
+        if (more) fetch(k0 + BK);
+
+        #pragma unroll
+        for (int k = 0; k < BK; k++) {
+            float a[TM], b[TN];
+            #pragma unroll
+            for (int i = 0; i < TM; i += 4) {
+                float4 v = *(const float4*)&As[buf][k][ty * TM + i];
+                a[i] = v.x; a[i + 1] = v.y; a[i + 2] = v.z; a[i + 3] = v.w;
+            }
+            #pragma unroll
+            for (int j = 0; j < TN; j += 4) {
+                float4 v = *(const float4*)&Bs[buf][k][tx * TN + j];
+                b[j] = v.x; b[j + 1] = v.y; b[j + 2] = v.z; b[j + 3] = v.w;
+            }
+            #pragma unroll
+            for (int i = 0; i < TM; i++)
+                #pragma unroll
+                for (int j = 0; j < TN; j++)
+                    acc[i][j] += a[i] * b[j];
+        }
+
+        if (more) stash(buf ^ 1);
+        __syncthreads();
+    }
+
+    #pragma unroll
+    for (int i = 0; i < TM; i++) {
+        int row = rowBase + ty * TM + i;
+        #pragma unroll
+        for (int j = 0; j < TN; j++) {
+            int col = colBase + tx * TN + j;
+            if (row < M && col < N) {
+                epi.store(&C[(size_t)row * N + col], acc[i][j], col);
+            }
+        }
+    }
+}
+
+// Conversions between fp32 and the types weights can be stored in
+__device__ __forceinline__ float toFloat(float v) { return v; }
+__device__ __forceinline__ float toFloat(__half v) { return __half2float(v); }
+__device__ __forceinline__ float toFloat(__nv_bfloat16 v) { return __bfloat162float(v); }
+
+template <typename T> __device__ __forceinline__ T fromFloat(float v);
+template <> __device__ __forceinline__ float fromFloat<float>(float v) { return v; }
+template <> __device__ __forceinline__ __half fromFloat<__half>(float v) { return __float2half_rn(v); }
+template <> __device__ __forceinline__ __nv_bfloat16 fromFloat<__nv_bfloat16>(float v) { return __float2bfloat16_rn(v); }
+
+// Four consecutive elements widened to fp32, p must be aligned to four elements
+__device__ __forceinline__ float4 load4(const float* p) { return *(const float4*)p; }
+
+__device__ __forceinline__ float4 load4(const __half* p) {
+    uint2 raw = *(const uint2*)p;
+    float2 lo = __half22float2(*(const __half2*)&raw.x);
+    float2 hi = __half22float2(*(const __half2*)&raw.y);
+    return make_float4(lo.x, lo.y, hi.x, hi.y);
+}
+
+__device__ __forceinline__ float4 load4(const __nv_bfloat16* p) {
+    uint2 raw = *(const uint2*)p;
+    float2 lo = __bfloat1622float2(*(const __nv_bfloat162*)&raw.x);
+    float2 hi = __bfloat1622float2(*(const __nv_bfloat162*)&raw.y);
+    return make_float4(lo.x, lo.y, hi.x, hi.y);
+}
+
+// Decode-sized products, where A has at most a few dozen rows. Each warp owns one
+// column of C, that is one row of B, and streams it exactly once with vector loads
+// while accumulating SKINNY_ROWS rows of A against it. The lane partials are then
+// combined with warp shuffles. This is a batched GEMV, bound by reading B, which
+// is why B may be stored in 16 bits: it halves the bytes each decode step reads.
+#define SKINNY_ROWS 8
+
+template <typename T, int EPILOGUE>
+__global__ void sgemmSkinnyKernel(const float* A, const T* B, float* C, int M, int N, int K, Epilogue<EPILOGUE> epi) {
+    int col = (blockIdx.x * blockDim.x + threadIdx.x) / 32;
+    int lane = threadIdx.x % 32;
+    int rowBase = blockIdx.y * SKINNY_ROWS;
+    if (col >= N) return;
+
+    const T* b = B + (size_t)col * K;
+    float acc[SKINNY_ROWS] = {};
+    for (int k = lane; k < K / 4; k += 32) {
+        float4 w = load4(b + 4 * k);
+        #pragma unroll
+        for (int r = 0; r < SKINNY_ROWS; r++) {
+            if (rowBase + r < M) {
+                float4 x = ((const float4*)(A + (size_t)(rowBase + r) * K))[k];
+                acc[r] += w.x * x.x + w.y * x.y + w.z * x.z + w.w * x.w;
+            }
+        }
+    }
+
+    #pragma unroll
+    for (int r = 0; r < SKINNY_ROWS; r++) {
+        for (int offset = 16; offset > 0; offset >>= 1) {
+            acc[r] += __shfl_down_sync(0xffffffff, acc[r], offset);
+        }
+        if (lane == 0 && rowBase + r < M) {
+            epi.store(&C[(size_t)(rowBase + r) * N + col], acc[r], col);
+        }
+    }
+}
+
+template <int EPILOGUE>
+static void matMul(float* a, int aRows, int aCols, float* b, int bRows, float* out, Epilogue<EPILOGUE> epi) {
+    // The vectorized kernels read whole float4s along K
+    bool vectorized = aCols % 4 == 0 && ((uintptr_t)a | (uintptr_t)b) % 16 == 0;
+
+    if (vectorized && aRows <= 32) {
+        dim3 dimBlock(256);
+        dim3 dimGrid(CEIL_DIV(bRows, 8), CEIL_DIV(aRows, SKINNY_ROWS));
+        sgemmSkinnyKernel<float, EPILOGUE><<<dimGrid, dimBlock, 0, stream>>>(a, b, out, aRows, bRows, aCols, epi);
+    } else if (vectorized && CEIL_DIV(aRows, 128) * CEIL_DIV(bRows, 128) >= 80) {
+        // Big tiles only pay off once there are enough of them to fill the device
+        dim3 dimGrid(CEIL_DIV(bRows, 128), CEIL_DIV(aRows, 128));
+        sgemmKernel<128, 128, 8, 8, 8, EPILOGUE><<<dimGrid, 256, 0, stream>>>(a, b, out, aRows, bRows, aCols, epi);
+    } else if (vectorized) {
+        dim3 dimGrid(CEIL_DIV(bRows, 64), CEIL_DIV(aRows, 64));
+        sgemmKernel<64, 64, 16, 4, 4, EPILOGUE><<<dimGrid, 256, 0, stream>>>(a, b, out, aRows, bRows, aCols, epi);
+    } else {
+        // Cuda Kernel
+        dim3 dimBlock(32, 32);
+        dim3 dimGrid(CEIL_DIV(bRows, 32), CEIL_DIV(aRows, 32));
+        matMulCudaKernelOptimized<EPILOGUE><<<dimGrid, dimBlock, 0, stream>>>(a, b, out, aRows, aCols, bRows, epi);
     }
 }
 
 extern "C" void matMulCUDA(float* a, int aRows, int aCols, float* b, int bRows, int bCols, float* out) {
-    // Cuda Kernel
-    dim3 dimBlock(32, 32);
-    dim3 dimGrid(CEIL_DIV(bRows, 32), CEIL_DIV(aRows, 32));
-    matMulCudaKernelOptimized<<<dimGrid, dimBlock>>>(a, b, out, aRows, aCols, bRows);
+    PROFILE;
+    matMul(a, aRows, aCols, b, bRows, out, Epilogue<EPILOGUE_NONE>{});
 }
 
-// Cublas for matrix multiplication with A and transpose(B)
-extern "C" void matMulCublas(float* a, int aRows, int aCols, float* b, int bRows, int bCols, float* out) {
-    cublasHandle_t handle;
-    cublasCreate(&handle);
+// Products with 16 bit weights. A block computes a 64 x 64 tile of C = A * W.T with
+// four warps, each owning a 32 x 32 quarter. A is rounded to the weight type as it is
+// staged in shared memory and the products are accumulated in fp32.
+#define HGEMM_TILE 64
+#define HGEMM_BK 32
+#define HGEMM_LD (HGEMM_BK + 8)  // WMMA wants 16 byte aligned rows, the pad breaks bank conflicts
+
+// A warp's 32 x 32 quarter. This generic version has each lane accumulate one
+// column with FMAs, for architectures without tensor cores for T.
+template <typename T>
+struct HgemmWarpTile {
+    float acc[32];
+
+    __device__ void zero() {
+        for (int i = 0; i < 32; i++) acc[i] = 0;
+    }
+    __device__ void mma(const T (*As)[HGEMM_LD], const T (*Ws)[HGEMM_LD], int wm, int wn) {
+        int lane = threadIdx.x % 32;
+        for (int k = 0; k < HGEMM_BK; k++) {
+            float w = toFloat(Ws[wn + lane][k]);
+            #pragma unroll
+            for (int i = 0; i < 32; i++) acc[i] += toFloat(As[wm + i][k]) * w;
+        }
+    }
+    __device__ void store(float (*Cs)[HGEMM_TILE + 4], int wm, int wn) {
+        int lane = threadIdx.x % 32;
+        for (int i = 0; i < 32; i++) Cs[wm + i][wn + lane] = acc[i];
+    }
+};
+
+// WMMA needs sm_70 for fp16 and sm_80 for bf16
+#if __CUDA_ARCH__ >= 700
+template <typename T>
+struct HgemmWarpTileWmma {
+    nvcuda::wmma::fragment<nvcuda::wmma::accumulator, 16, 16, 16, float> acc[2][2];
+
+    __device__ void zero() {
+        for (int i = 0; i < 2; i++)
+            for (int j = 0; j < 2; j++) nvcuda::wmma::fill_fragment(acc[i][j], 0.0f);
+    }
+    __device__ void mma(const T (*As)[HGEMM_LD], const T (*Ws)[HGEMM_LD], int wm, int wn) {
+        using namespace nvcuda;
+        #pragma unroll
+        for (int k = 0; k < HGEMM_BK; k += 16) {
+            // W is stored N x K, which is W.T in column major
+            wmma::fragment<wmma::matrix_a, 16, 16, 16, T, wmma::row_major> a[2];
+            wmma::fragment<wmma::matrix_b, 16, 16, 16, T, wmma::col_major> b[2];
+            for (int i = 0; i < 2; i++) wmma::load_matrix_sync(a[i], &As[wm + 16 * i][k], HGEMM_LD);
+            for (int j = 0; j < 2; j++) wmma::load_matrix_sync(b[j], &Ws[wn + 16 * j][k], HGEMM_LD);
+            for (int i = 0; i < 2; i++)
+                for (int j = 0; j < 2; j++) wmma::mma_sync(acc[i][j], a[i], b[j], acc[i][j]);
+        }
+    }
+    __device__ void store(float (*Cs)[HGEMM_TILE + 4], int wm, int wn) {
+        for (int i = 0; i < 2; i++)
+            for (int j = 0; j < 2; j++)
+                nvcuda::wmma::store_matrix_sync(&Cs[wm + 16 * i][wn + 16 * j], acc[i][j],
+                                                HGEMM_TILE + 4, nvcuda::wmma::mem_row_major);
+    }
+};
+
+template <> struct HgemmWarpTile<__half> : HgemmWarpTileWmma<__half> {};
+#endif
+#if __CUDA_ARCH__ >= 800
+template <> struct HgemmWarpTile<__nv_bfloat16> : HgemmWarpTileWmma<__nv_bfloat16> {};
+#endif
+
+// How hgemmKernel reads W. 16 bit weights are used as they are, quantized ones are
+// dequantized to fp16 as they are staged, so prefill still runs on tensor cores.
+template <typename T>
+struct DenseWeights {
+    const T* w;
+    int K;
+    __device__ T at(int n, int k) const { return w[(size_t)n * K + k]; }
+};
+
+// The integer value of element i of a quantized matrix, before scaling
+template <int BITS> __device__ __forceinline__ int quantValue(const int8_t* q, size_t i);
+template <> __device__ __forceinline__ int quantValue<8>(const int8_t* q, size_t i) { return q[i]; }
+template <> __device__ __forceinline__ int quantValue<4>(const int8_t* q, size_t i) {
+    int byte = q[i / 2];
+    return i % 2 ? byte >> 4 : (int8_t)(byte << 4) >> 4;
+}
+
+template <int BITS>
+struct QuantWeights {
+    const int8_t* q;
+    const float* scales;
+    int K, group;
+    __device__ __half at(int n, int k) const {
+        float scale = scales[(size_t)n * (K / group) + k / group];
+        return fromFloat<__half>(quantValue<BITS>(q, (size_t)n * K + k) * scale);
+    }
+};
+
+template <typename T, typename Weights, int EPILOGUE>
+__global__ void __launch_bounds__(128) hgemmKernel(const float* A, Weights W, float* C, int M, int N, int K,
+                                                   Epilogue<EPILOGUE> epi) {
+    __shared__ __align__(32) T As[HGEMM_TILE][HGEMM_LD];
+    __shared__ __align__(32) T Ws[HGEMM_TILE][HGEMM_LD];
+    __shared__ __align__(32) float Cs[HGEMM_TILE][HGEMM_TILE + 4];
+
+    int tid = threadIdx.x;
+    int warp = tid / 32;
+    int wm = warp / 2 * 32, wn = warp % 2 * 32;
+    int rowBase = blockIdx.y * HGEMM_TILE;
+    int colBase = blockIdx.x * HGEMM_TILE;
+
+    HgemmWarpTile<T> tile;
+    tile.zero();
+    for (int k0 = 0; k0 < K; k0 += HGEMM_BK) {
+        for (int idx = tid; idx < HGEMM_TILE * HGEMM_BK; idx += 128) {
+            int r = idx / HGEMM_BK, k = k0 + idx % HGEMM_BK;
+            As[r][idx % HGEMM_BK] = fromFloat<T>(rowBase + r < M && k < K ? A[(size_t)(rowBase + r) * K + k] : 0);
+            Ws[r][idx % HGEMM_BK] = colBase + r < N && k < K ? W.at(colBase + r, k) : fromFloat<T>(0);
+        }
+        __syncthreads();
+        tile.mma(As, Ws, wm, wn);
+        __syncthreads();
+    }
+
+    // Fragments have no defined element order, so go through shared memory to bounds check
+    tile.store(Cs, wm, wn);
+    __syncthreads();
+    for (int idx = tid; idx < HGEMM_TILE * HGEMM_TILE; idx += 128) {
+        int row = rowBase + idx / HGEMM_TILE, col = colBase + idx % HGEMM_TILE;
+        if (row < M && col < N) {
+            epi.store(&C[(size_t)row * N + col], Cs[idx / HGEMM_TILE][idx % HGEMM_TILE], col);
+        }
+    }
+}
+
+template <typename T, int EPILOGUE>
+static void matMulHalf(const float* a, int aRows, int aCols, const T* w, int wRows, float* out, Epilogue<EPILOGUE> epi) {
+    bool vectorized = aCols % 4 == 0 && (uintptr_t)a % 16 == 0 && (uintptr_t)w % 8 == 0;
+    if (vectorized && aRows <= 32) {
+        dim3 dimGrid(CEIL_DIV(wRows, 8), CEIL_DIV(aRows, SKINNY_ROWS));
+        sgemmSkinnyKernel<T, EPILOGUE><<<dimGrid, 256, 0, stream>>>(a, w, out, aRows, wRows, aCols, epi);
+    } else {
+        dim3 dimGrid(CEIL_DIV(wRows, HGEMM_TILE), CEIL_DIV(aRows, HGEMM_TILE));
+        DenseWeights<T> weights = {w, aCols};
+        hgemmKernel<T, DenseWeights<T>, EPILOGUE><<<dimGrid, 128, 0, stream>>>(a, weights, out, aRows, wRows, aCols, epi);
+    }
+}
+
+// Eight consecutive values of a quantized row starting at element k, before scaling.
+// k must be a multiple of eight, so int8 rows are read 8 bytes and int4 rows 4 bytes at a time.
+template <int BITS> __device__ __forceinline__ void unpack8(const int8_t* row, int k, float w[8]);
+
+template <> __device__ __forceinline__ void unpack8<8>(const int8_t* row, int k, float w[8]) {
+    uint2 raw = *(const uint2*)(row + k);
+    const int8_t* q = (const int8_t*)&raw;
+    #pragma unroll
+    for (int i = 0; i < 8; i++) w[i] = q[i];
+}
+
+template <> __device__ __forceinline__ void unpack8<4>(const int8_t* row, int k, float w[8]) {
+    unsigned raw = *(const unsigned*)(row + k / 2);
+    #pragma unroll
+    for (int i = 0; i < 8; i++) w[i] = (int)(raw << (28 - 4 * i)) >> 28;
+}
 
+// The skinny GEMV for quantized weights. Same work split as sgemmSkinnyKernel, but each
+// lane takes eight weights per step, and their group's scale is applied once to the
+// partial dot product. The group size is a multiple of eight, so eight never straddle two.
+template <int BITS, int EPILOGUE>
+__global__ void qgemmSkinnyKernel(const float* A, const int8_t* B, const float* scales, int group,
+                                  float* C, int M, int N, int K, Epilogue<EPILOGUE> epi) {
+    int col = (blockIdx.x * blockDim.x + threadIdx.x) / 32;
+    int lane = threadIdx.x % 32;
+    int rowBase = blockIdx.y * SKINNY_ROWS;
+    if (col >= N) return;
+
+    const int8_t* b = B + (size_t)col * K * BITS / 8;
+    const float* s = scales + (size_t)col * (K / group);
+    float acc[SKINNY_ROWS] = {};
+    for (int k = lane * 8; k < K; k += 32 * 8) {
+        float w[8];
+        unpack8<BITS>(b, k, w);
+        float scale = s[k / group];
+        #pragma unroll
+        for (int r = 0; r < SKINNY_ROWS; r++) {
+            if (rowBase + r < M) {
+                const float4* x = (const float4*)(A + (size_t)(rowBase + r) * K + k);
+                float4 x0 = x[0], x1 = x[1];
+                acc[r] += scale * (w[0] * x0.x + w[1] * x0.y + w[2] * x0.z + w[3] * x0.w +
+                                   w[4] * x1.x + w[5] * x1.y + w[6] * x1.z + w[7] * x1.w);
+            }
+        }
+    }
+
+    #pragma unroll
+    for (int r = 0; r < SKINNY_ROWS; r++) {
+        for (int offset = 16; offset > 0; offset >>= 1) {
+            acc[r] += __shfl_down_sync(0xffffffff, acc[r], offset);
+        }
+        if (lane == 0 && rowBase + r < M) {
+            epi.store(&C[(size_t)(rowBase + r) * N + col], acc[r], col);
+        }
+    }
+}
+
+template <int BITS, int EPILOGUE>
+static void matMulQuant(Matrix a, Matrix w, float* out, Epilogue<EPILOGUE> epi) {
+    const int8_t* q = (const int8_t*)w.dat;
+    bool vectorized = a.cols % 8 == 0 && w.group % 8 == 0 && (uintptr_t)a.dat % 16 == 0;
+    if (vectorized && a.rows <= 32) {
+        dim3 dimGrid(CEIL_DIV(w.rows, 8), CEIL_DIV(a.rows, SKINNY_ROWS));
+        qgemmSkinnyKernel<BITS, EPILOGUE><<<dimGrid, 256, 0, stream>>>(a.dat, q, w.scales, w.group, out,
+                                                                      a.rows, w.rows, a.cols, epi);
+    } else {
+        dim3 dimGrid(CEIL_DIV(w.rows, HGEMM_TILE), CEIL_DIV(a.rows, HGEMM_TILE));
+        QuantWeights<BITS> weights = {q, w.scales, a.cols, w.group};
+        hgemmKernel<__half, QuantWeights<BITS>, EPILOGUE><<<dimGrid, 128, 0, stream>>>(a.dat, weights, out,
+                                                                                      a.rows, w.rows, a.cols, epi);
+    }
+}
+
+__global__ void castKernel(const void* in, int in_dtype, void* out, int out_dtype, size_t n) {
+    size_t idx = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= n) return;
+    float v = in_dtype == DTYPE_FP16 ? toFloat(((const __half*)in)[idx])
+            : in_dtype == DTYPE_BF16 ? toFloat(((const __nv_bfloat16*)in)[idx])
+            : ((const float*)in)[idx];
+    if (out_dtype == DTYPE_FP16) {
+        ((__half*)out)[idx] = fromFloat<__half>(v);
+    } else if (out_dtype == DTYPE_BF16) {
+        ((__nv_bfloat16*)out)[idx] = fromFloat<__nv_bfloat16>(v);
+    } else {
+        ((float*)out)[idx] = v;
+    }
+}
+
+extern "C" void castCUDA(Matrix a, Matrix out) {
+    PROFILE;
+    size_t n = (size_t)a.rows * a.cols;
+    castKernel<<<CEIL_DIV(n, 256), 256, 0, stream>>>(a.dat, a.dtype, out.dat, out.dtype, n);
+}
+
+static cudaDataType cudaType(int dtype) {
+    return dtype == DTYPE_FP16 ? CUDA_R_16F : dtype == DTYPE_BF16 ? CUDA_R_16BF : CUDA_R_32F;
+}
+
+// One cuBLAS handle for the whole process, created on first use.
+// Creating a handle costs far more than a decode step, so never do it per call.
+static cublasHandle_t cublas_handle;
+
+static cublasHandle_t cublasHandle() {
+    if (!cublas_handle) {
+        cublasCreate(&cublas_handle);
+        cublasSetStream(cublas_handle, stream);
+    }
+    return cublas_handle;
+}
+
+// C = A * B.T + beta * C with every pointer already on the device
+static void cublasMatMulT(const float* a, int aRows, int aCols, const float* b, int bRows, float* out, float beta) {
+    float one = 1.0;
+
+    // We WTG C = A * B.T
+    // Cublas stores in column order while C stores in row order
+    // So Cublas interprets A and B as A.T and B.T
+    // Therefore we input B.T * A -> interpreted as B * A.T = C.T
+    // C.T in column major = C in row major, so we have what we want
+    cublasSgemm(cublasHandle(), CUBLAS_OP_T, CUBLAS_OP_N,
+                bRows, aRows, aCols, // rows C, cols C, cols op(A)
+                &one,
+                b, aCols, // ld B
+                a, aCols, // ld A
+                &beta, out, bRows); // ld C
+}
+
+// Cublas for matrix multiplication with A and transpose(B), on host memory
+extern "C" void matMulCublas(float* a, int aRows, int aCols, float* b, int bRows, int bCols, float* out) {
+    PROFILE;
     float *d_A, *d_B, *d_C;
     size_t sizeA = aRows * aCols * sizeof(float);
     size_t sizeB = bRows * bCols * sizeof(float);
@@ -109,65 +786,417 @@ extern "C" void matMulCublas(float* a, int aRows, int aCols, float* b, int bRows
 
     cudaMemcpy(d_A, a, sizeA, cudaMemcpyHostToDevice);
     cudaMemcpy(d_B, b, sizeB, cudaMemcpyHostToDevice);
-    
-    // Cublas Kernel
-    float one = 1.0;
-    float zero = 0.0;
 
-    // We WTG C = A * B.T
-    // Cublas stores in column order while C stores in row order
-    // So Cublas interprets A and B as A.T and B.T
-    // Therefore we input B.T * A -> interpreted as B * A.T = C.T
-    // C.T in column major = C in row major, so we have what we want
-    cublasSgemm(handle, CUBLAS_OP_T, CUBLAS_OP_N,
-                bRows, aRows, aCols, // rows C, cols C, cols op(A)
-                &one,
-                d_B, bCols, // ld B
-                d_A, aCols, // ld A
-                &zero, d_C, bRows); // ld C
+    cublasMatMulT(d_A, aRows, aCols, d_B, bRows, d_C, 0);
 
     cudaMemcpy(out, d_C, sizeC, cudaMemcpyDeviceToHost);
 
     cudaFree(d_A);
     cudaFree(d_B);
     cudaFree(d_C);
-    cublasDestroy(handle);
 }
 
-// Brodcasts sum of each row across rows
-__global__ void sumCudaKernel(float* input, float* output, int rows, int cols) {
-    extern __shared__ float sharedSum[];
+// cuBLASLt can fuse the bias and GELU into the GEMM itself. Describing a
+// problem to it is expensive, so plans are built once per shape and reused.
+static cublasLtHandle_t cublaslt_handle;
+static void* cublaslt_workspace;
+static const size_t CUBLASLT_WORKSPACE = 32 << 20;
+
+typedef struct {
+    int m, n, k, epilogue, dtype;
+    cublasLtMatmulDesc_t desc;
+    cublasLtMatrixLayout_t w_layout, a_layout, out_layout;
+    cublasLtMatmulAlgo_t algo;
+} LtPlan;
+
+static LtPlan lt_plans[64];
+static int num_lt_plans;
+
+static LtPlan* ltPlan(int m, int n, int k, int epilogue, int dtype) {
+    for (int i = 0; i < num_lt_plans && i < 64; i++) {
+        LtPlan* plan = &lt_plans[i];
+        if (plan->m == m && plan->n == n && plan->k == k && plan->epilogue == epilogue && plan->dtype == dtype) {
+            return plan;
+        }
+    }
 
-    for (int row = blockIdx.x; row < rows; row += gridDim.x) {
-        float sum = 0;
-        for (int col = threadIdx.x; col < cols; col += blockDim.x) {
-            sum += input[row * cols + col];
+    // Replace plans round robin once the table is full
+    LtPlan* plan = &lt_plans[num_lt_plans++ % 64];
+    if (plan->desc) {
+        cublasLtMatmulDescDestroy(plan->desc);
+        cublasLtMatrixLayoutDestroy(plan->w_layout);
+        cublasLtMatrixLayoutDestroy(plan->a_layout);
+        cublasLtMatrixLayoutDestroy(plan->out_layout);
+    }
+    plan->m = m;
+    plan->n = n;
+    plan->k = k;
+    plan->epilogue = epilogue;
+    plan->dtype = dtype;
+
+    // Same trick as cublasMatMulT: compute C.T = W * A.T in column major
+    cublasOperation_t transpose = CUBLAS_OP_T, no_transpose = CUBLAS_OP_N;
+    // The residual is accumulated through C, the output itself, with beta = 1
+    cublasLtEpilogue_t lt_epilogue = epilogue == EPILOGUE_BIAS_GELU ? CUBLASLT_EPILOGUE_GELU_BIAS
+                                   : epilogue != EPILOGUE_NONE ? CUBLASLT_EPILOGUE_BIAS
+                                   : CUBLASLT_EPILOGUE_DEFAULT;
+    cublasLtMatmulDescCreate(&plan->desc, CUBLAS_COMPUTE_32F, CUDA_R_32F);
+    cublasLtMatmulDescSetAttribute(plan->desc, CUBLASLT_MATMUL_DESC_TRANSA, &transpose, sizeof(transpose));
+    cublasLtMatmulDescSetAttribute(plan->desc, CUBLASLT_MATMUL_DESC_TRANSB, &no_transpose, sizeof(no_transpose));
+    cublasLtMatmulDescSetAttribute(plan->desc, CUBLASLT_MATMUL_DESC_EPILOGUE, &lt_epilogue, sizeof(lt_epilogue));
+    // The inputs may be 16 bit, but the bias and output stay fp32
+    cudaDataType bias_type = CUDA_R_32F;
+    cublasLtMatmulDescSetAttribute(plan->desc, CUBLASLT_MATMUL_DESC_BIAS_DATA_TYPE, &bias_type, sizeof(bias_type));
+    cublasLtMatrixLayoutCreate(&plan->w_layout, cudaType(dtype), k, n, k);
+    cublasLtMatrixLayoutCreate(&plan->a_layout, cudaType(dtype), k, m, k);
+    cublasLtMatrixLayoutCreate(&plan->out_layout, CUDA_R_32F, n, m, n);
+
+    cublasLtMatmulPreference_t preference;
+    cublasLtMatmulPreferenceCreate(&preference);
+    cublasLtMatmulPreferenceSetAttribute(preference, CUBLASLT_MATMUL_PREF_MAX_WORKSPACE_BYTES,
+                                         &CUBLASLT_WORKSPACE, sizeof(CUBLASLT_WORKSPACE));
+    cublasLtMatmulHeuristicResult_t heuristic;
+    int found = 0;
+    cublasLtMatmulAlgoGetHeuristic(cublaslt_handle, plan->desc, plan->w_layout, plan->a_layout,
+                                   plan->out_layout, plan->out_layout, preference, 1, &heuristic, &found);
+    cublasLtMatmulPreferenceDestroy(preference);
+    if (!found) {
+        std::cerr << "cuBLASLt has no algorithm for " << m << "x" << n << "x" << k << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    plan->algo = heuristic.algo;
+    return plan;
+}
+
+static int gemm_backend = GEMM_CUSTOM;
+
+// cuBLAS wants both inputs in the same type, so with 16 bit weights the activations
+// are rounded into a scratch buffer first. It is allocated in gemmInitCUDA, before
+// any step is captured, and never moves after, since every graph keeps its address.
+static void* gemm_scratch;
+static size_t gemm_scratch_size;
+
+extern "C" void gemmInitCUDA(int backend, size_t scratch) {
+    gemm_backend = backend;
+    if (backend != GEMM_CUSTOM) {
+        cublasHandle();
+        if (scratch * 2 > gemm_scratch_size) {
+            cudaFree(gemm_scratch);
+            cudaMalloc(&gemm_scratch, scratch * 2);
+            gemm_scratch_size = scratch * 2;
         }
-        sharedSum[threadIdx.x] = sum;
+    }
+    if (backend == GEMM_CUBLASLT && !cublaslt_handle) {
+        cublasLtCreate(&cublaslt_handle);
+        cudaMalloc(&cublaslt_workspace, CUBLASLT_WORKSPACE);
+    }
+}
 
-        __syncthreads();
+extern "C" void setStreamCUDA(cudaStream_t s) {
+    stream = s;
+    if (cublas_handle) {
+        cublasSetStream(cublas_handle, s);
+    }
+}
 
-        // Reduction in shared memory
-        if (threadIdx.x == 0) {
-            float totalSum = 0;
-            for (int i = 0; i < blockDim.x; i++) {
-                totalSum += sharedSum[i];
-            }
-            output[row * cols] = totalSum;
+// Tensor parallelism, only compiled in with NCCL=1. Every GPU is driven by its own
+// process, and they find each other through the id the first one makes.
+#ifdef USE_NCCL
+static ncclComm_t tp_comm;
+#endif
+
+extern "C" int tensorParallelIdCUDA(void* id) {
+#ifdef USE_NCCL
+    static_assert(sizeof(ncclUniqueId) == TP_ID_BYTES, "TP_ID_BYTES has to match NCCL");
+    return ncclGetUniqueId((ncclUniqueId*)id) == ncclSuccess;
+#else
+    return 0;
+#endif
+}
+
+extern "C" void tensorParallelInitCUDA(const void* id, int rank, int ranks) {
+#ifdef USE_NCCL
+    ncclResult_t result = ncclCommInitRank(&tp_comm, ranks, *(const ncclUniqueId*)id, rank);
+    if (result != ncclSuccess) {
+        std::cerr << "NCCL failed to connect rank " << rank << ": " << ncclGetErrorString(result) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+extern "C" void allReduceCUDA(Matrix a) {
+    PROFILE;
+#ifdef USE_NCCL
+    ncclAllReduce(a.dat, a.dat, (size_t)a.rows * a.cols, ncclFloat, ncclSum, tp_comm, stream);
+#endif
+}
+
+static Matrix roundActivations(Matrix a, int dtype) {
+    size_t size = (size_t)a.rows * a.cols * 2;
+    if (size > gemm_scratch_size) {
+        std::cerr << "A GEMM input of " << a.rows << "x" << a.cols << " does not fit the scratch gemmInitCUDA was given" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    Matrix out = {(float*)gemm_scratch, a.rows, a.cols, dtype};
+    castCUDA(a, out);
+    return out;
+}
+
+// Our own kernels, every one of them with the epilogue fused into its stores
+template <int EPILOGUE>
+static void gemmCustom(Matrix a, Matrix w, Matrix bias, Matrix out) {
+    Epilogue<EPILOGUE> epi = {bias.dat};
+    if (w.dtype == DTYPE_INT8) {
+        matMulQuant<8>(a, w, out.dat, epi);
+    } else if (w.dtype == DTYPE_INT4) {
+        matMulQuant<4>(a, w, out.dat, epi);
+    } else if (w.dtype == DTYPE_FP16) {
+        matMulHalf(a.dat, a.rows, a.cols, (const __half*)w.dat, w.rows, out.dat, epi);
+    } else if (w.dtype == DTYPE_BF16) {
+        matMulHalf(a.dat, a.rows, a.cols, (const __nv_bfloat16*)w.dat, w.rows, out.dat, epi);
+    } else {
+        matMul(a.dat, a.rows, a.cols, w.dat, w.rows, out.dat, epi);
+    }
+}
+
+// The epilogue on its own, for cuBLAS, which cannot fuse it. It is a single pass over
+// the product, four elements at a time, so out.cols has to be a multiple of four.
+template <int EPILOGUE>
+__global__ void epilogueKernel(float* out, int cols, size_t n, Epilogue<EPILOGUE> epi) {
+    size_t stride = (size_t)gridDim.x * blockDim.x * 4;
+    for (size_t i = ((size_t)blockIdx.x * blockDim.x + threadIdx.x) * 4; i < n; i += stride) {
+        float4 v = *(float4*)(out + i);
+        int col = i % cols;
+        v.x = epi.apply(v.x, col);
+        v.y = epi.apply(v.y, col + 1);
+        v.z = epi.apply(v.z, col + 2);
+        v.w = epi.apply(v.w, col + 3);
+        *(float4*)(out + i) = v;
+    }
+}
+
+template <int EPILOGUE>
+static void epilogueCUDA(Matrix out, Matrix bias) {
+    size_t n = (size_t)out.rows * out.cols;
+    int blocks = CEIL_DIV(n / 4, 256) < 1024 ? CEIL_DIV(n / 4, 256) : 1024;
+    epilogueKernel<EPILOGUE><<<blocks, 256, 0, stream>>>(out.dat, out.cols, n, Epilogue<EPILOGUE>{bias.dat});
+}
+
+extern "C" void gemmCUDA(Matrix a, Matrix w, Matrix bias, int epilogue, Matrix out) {
+    PROFILE;
+    // cuBLAS has no weight-only integer GEMM, quantized weights always take our kernels
+    bool quantized = w.dtype == DTYPE_INT8 || w.dtype == DTYPE_INT4;
+    int backend = quantized ? GEMM_CUSTOM : gemm_backend;
+    if (backend == GEMM_CUSTOM) {
+        switch (epilogue) {
+            case EPILOGUE_BIAS: gemmCustom<EPILOGUE_BIAS>(a, w, bias, out); break;
+            case EPILOGUE_BIAS_GELU: gemmCustom<EPILOGUE_BIAS_GELU>(a, w, bias, out); break;
+            case EPILOGUE_BIAS_RESIDUAL: gemmCustom<EPILOGUE_BIAS_RESIDUAL>(a, w, bias, out); break;
+            default: gemmCustom<EPILOGUE_NONE>(a, w, bias, out);
         }
-        __syncthreads();
+        return;
+    }
+
+    if (w.dtype != DTYPE_FP32) {
+        a = roundActivations(a, w.dtype);
+    }
+    // Both libraries add the residual that is already in out through beta
+    float one = 1.0;
+    float beta = epilogue == EPILOGUE_BIAS_RESIDUAL;
+
+    if (backend == GEMM_CUBLASLT) {
+        LtPlan* plan = ltPlan(a.rows, w.rows, a.cols, epilogue, w.dtype);
+        if (epilogue != EPILOGUE_NONE) {
+            cublasLtMatmulDescSetAttribute(plan->desc, CUBLASLT_MATMUL_DESC_BIAS_POINTER, &bias.dat, sizeof(bias.dat));
+        }
+        cublasLtMatmul(cublaslt_handle, plan->desc, &one, w.dat, plan->w_layout, a.dat, plan->a_layout,
+                       &beta, out.dat, plan->out_layout, out.dat, plan->out_layout,
+                       &plan->algo, cublaslt_workspace, CUBLASLT_WORKSPACE, stream);
+        return;
     }
+
+    if (w.dtype != DTYPE_FP32) {
+        // Same layout as cublasMatMulT, on tensor cores with fp32 accumulation
+        cublasGemmEx(cublasHandle(), CUBLAS_OP_T, CUBLAS_OP_N, w.rows, a.rows, a.cols,
+                     &one, w.dat, cudaType(w.dtype), a.cols, a.dat, cudaType(w.dtype), a.cols,
+                     &beta, out.dat, CUDA_R_32F, w.rows, CUBLAS_COMPUTE_32F, CUBLAS_GEMM_DEFAULT_TENSOR_OP);
+    } else {
+        cublasMatMulT(a.dat, a.rows, a.cols, w.dat, w.rows, out.dat, beta);
+    }
+    if (epilogue == EPILOGUE_BIAS_GELU) {
+        epilogueCUDA<EPILOGUE_BIAS_GELU>(out, bias);
+    } else if (epilogue != EPILOGUE_NONE) {
+        epilogueCUDA<EPILOGUE_BIAS>(out, bias);
+    }
+}
+
+// Reductions. An op combines two partial results, and identity is what changes
+// nothing. warpReduce gives every lane of a warp the reduction of v over the warp,
+// with shuffles, and blockReduce every thread of a block the reduction over the
+// block, through one value per warp in scratch, so the block has to be a multiple
+// of 32 threads, at most 1024.
+struct SumOp {
+    template <typename T>
+    __device__ __forceinline__ T operator()(T a, T b) const { return a + b; }
+};
+
+struct MaxOp {
+    template <typename T>
+    __device__ __forceinline__ T operator()(T a, T b) const { return a > b ? a : b; }
+};
+
+// The two statistics of a softmax in a single pass: the max of the values, and the
+// sum of exp(x - max) over them. When two are merged, the sum under the smaller max
+// is rescaled to the larger one.
+struct MaxSum {
+    float max, sum;
+};
+
+struct MaxSumOp {
+    __device__ __forceinline__ MaxSum operator()(MaxSum a, MaxSum b) const {
+        float max = fmaxf(a.max, b.max);
+        if (max == -INFINITY) return {max, 0};
+        return {max, a.sum * expf(a.max - max) + b.sum * expf(b.max - max)};
+    }
+};
+
+// Welford's running (count, mean, M2) statistics, merged pairwise so a block can
+// reduce a row in one pass without the sum of squares losing precision
+struct Welford {
+    float n, mean, m2;
+};
+
+struct WelfordOp {
+    __device__ __forceinline__ Welford operator()(Welford a, Welford b) const {
+        float count = a.n + b.n;
+        if (count == 0) return a;
+        float delta = b.mean - a.mean;
+        float w = b.n / count;
+        return {count, a.mean + delta * w, a.m2 + b.m2 + delta * delta * a.n * w};
+    }
+};
+
+// Any value made of 32 bit words, one shuffle per word
+template <typename T>
+__device__ __forceinline__ T shuffleXor(T v, int offset) {
+    static_assert(sizeof(T) % 4 == 0, "a shuffled value is made of 32 bit words");
+    unsigned words[sizeof(T) / 4];
+    memcpy(words, &v, sizeof(T));
+    for (int i = 0; i < sizeof(T) / 4; i++) {
+        words[i] = __shfl_xor_sync(0xffffffff, words[i], offset);
+    }
+    memcpy(&v, words, sizeof(T));
+    return v;
 }
 
+// Both lanes of a pair combine the lower one with the upper one, so every lane ends
+// up with the same bits even when the op rounds differently the other way around
+template <typename T, typename Op>
+__device__ __forceinline__ T warpReduce(T v, Op op) {
+    for (int offset = 16; offset > 0; offset >>= 1) {
+        T other = shuffleXor(v, offset);
+        v = threadIdx.x & offset ? op(other, v) : op(v, other);
+    }
+    return v;
+}
 
-extern "C" void sumCUDA(Matrix a, Matrix out)
-{
-    dim3 dimBlock(256, 1);
-    dim3 dimGrid(128, 1);
-;
-    int sharedMemSize = dimBlock.x * sizeof(float);
+template <typename T, typename Op>
+__device__ T blockReduce(T v, Op op, T identity, T* scratch) {
+    int lane = threadIdx.x % 32, warp = threadIdx.x / 32;
+    v = warpReduce(v, op);
+    __syncthreads();  // scratch may still be read from the previous call
+    if (lane == 0) scratch[warp] = v;
+    __syncthreads();
+    v = lane < blockDim.x / 32 ? scratch[lane] : identity;
+    return warpReduce(v, op);
+}
+
+// The log of the sum of exp over a row, which a block reduces in one pass
+__device__ float logSumExpRow(const float* row, int cols) {
+    __shared__ MaxSum scratch[32];
+    MaxSum v = {-INFINITY, 0};
+    for (int col = threadIdx.x; col < cols; col += blockDim.x) {
+        v = MaxSumOp()(v, MaxSum{row[col], 1});
+    }
+    v = blockReduce(v, MaxSumOp(), MaxSum{-INFINITY, 0}, scratch);
+    return v.max + logf(v.sum);
+}
+
+// One block per row, every thread reduces a strided slice of it on its own first,
+// and the result goes to every column of the row
+template <int REDUCE>
+__global__ void rowReduceKernel(const float* a, float* out, int cols) {
+    __shared__ float scratch[32];
+    const float* row = a + (size_t)blockIdx.x * cols;
+
+    float result;
+    if (REDUCE == REDUCE_LOGSUMEXP) {
+        result = logSumExpRow(row, cols);
+    } else if (REDUCE == REDUCE_MAX) {
+        float v = -INFINITY;
+        for (int col = threadIdx.x; col < cols; col += blockDim.x) {
+            v = fmaxf(v, row[col]);
+        }
+        result = blockReduce(v, MaxOp(), -INFINITY, scratch);
+    } else {
+        float v = 0;
+        for (int col = threadIdx.x; col < cols; col += blockDim.x) {
+            v += REDUCE == REDUCE_SUM_SQUARES ? row[col] * row[col] : row[col];
+        }
+        result = blockReduce(v, SumOp(), 0.f, scratch);
+    }
+
+    for (int col = threadIdx.x; col < cols; col += blockDim.x) {
+        out[(size_t)blockIdx.x * cols + col] = result;
+    }
+}
+
+extern "C" void rowReduceCUDA(Matrix a, int reduce, Matrix out) {
+    PROFILE;
+    if (reduce == REDUCE_SUM) {
+        rowReduceKernel<REDUCE_SUM><<<a.rows, 256, 0, stream>>>(a.dat, out.dat, a.cols);
+    } else if (reduce == REDUCE_MAX) {
+        rowReduceKernel<REDUCE_MAX><<<a.rows, 256, 0, stream>>>(a.dat, out.dat, a.cols);
+    } else if (reduce == REDUCE_SUM_SQUARES) {
+        rowReduceKernel<REDUCE_SUM_SQUARES><<<a.rows, 256, 0, stream>>>(a.dat, out.dat, a.cols);
+    } else {
+        rowReduceKernel<REDUCE_LOGSUMEXP><<<a.rows, 256, 0, stream>>>(a.dat, out.dat, a.cols);
+    }
+}
+
+extern "C" void sumCUDA(Matrix a, Matrix out) {
+    PROFILE;
+    rowReduceCUDA(a, REDUCE_SUM, out);
+}
+
+// One block per row: each thread accumulates a strided slice of the row, and the
+// slices are merged over the block. Like the CPU LayerNorm this uses the (cols - 1)
+// variance. A thread only reads the columns of its own slice.
+__device__ void layerNormRow(const float* x, float* out, const float* weight, const float* bias, int cols) {
+    __shared__ Welford scratch[32];
+
+    Welford v = {0, 0, 0};
+    for (int col = threadIdx.x; col < cols; col += blockDim.x) {
+        float delta = x[col] - v.mean;
+        v.n += 1;
+        v.mean += delta / v.n;
+        v.m2 += delta * (x[col] - v.mean);
+    }
+    v = blockReduce(v, WelfordOp(), Welford{0, 0, 0}, scratch);
+    float rstd = rsqrtf(v.m2 / (cols - 1) + 1e-5f);
+
+    for (int col = threadIdx.x; col < cols; col += blockDim.x) {
+        out[col] = (x[col] - v.mean) * rstd * weight[col] + bias[col];
+    }
+}
 
-    sumCudaKernel<<<dimGrid, dimBlock, sharedMemSize>>>(a.dat, out.dat, a.rows, a.cols);
+__global__ void layerNormKernel(float* input, float* output, float* weight, float* bias, int rows, int cols) {
+    layerNormRow(input + (size_t)blockIdx.x * cols, output + (size_t)blockIdx.x * cols, weight, bias, cols);
+}
+
+extern "C" void layerNormCUDA(Matrix a, Matrix out, Matrix weight, Matrix bias) {
+    PROFILE;
+    layerNormKernel<<<a.rows, 256, 0, stream>>>(a.dat, out.dat, weight.dat, bias.dat, a.rows, a.cols);
 }
 
 // From Lab 2
@@ -209,6 +1238,7 @@ void transposeKernel(const float *input, float *output, int rows, int cols) {
 
 extern "C" void transposeCUDA_util(Matrix a, Matrix out)
 {
+    PROFILE;
     float *d_input, *d_output;
     size_t size = a.rows * a.cols * sizeof(float);
 
@@ -223,7 +1253,7 @@ extern "C" void transposeCUDA_util(Matrix a, Matrix out)
     dim3 dimGrid(CEIL_DIV(a.cols, TILE_DIM), CEIL_DIV(a.rows, TILE_DIM));
     
 
-    transposeKernel<<<dimGrid, dimBlock>>>(d_input, d_output, a.rows, a.cols);
+    transposeKernel<<<dimGrid, dimBlock, 0, stream>>>(d_input, d_output, a.rows, a.cols);
 
     cudaMemcpy(out.dat, d_output, size, cudaMemcpyDeviceToHost);
 
@@ -233,10 +1263,28 @@ extern "C" void transposeCUDA_util(Matrix a, Matrix out)
 
 extern "C" void transposeCUDA(Matrix a, Matrix out)
 {
+    PROFILE;
     const int TILE_DIM = 64;
     dim3 dimBlock(TILE_DIM, TILE_DIM / 4); // 64x16
     dim3 dimGrid(CEIL_DIV(a.cols, TILE_DIM), CEIL_DIV(a.rows, TILE_DIM));
-    transposeKernel<<<dimGrid, dimBlock>>>(a.dat, out.dat, a.rows, a.cols);
+    transposeKernel<<<dimGrid, dimBlock, 0, stream>>>(a.dat, out.dat, a.rows, a.cols);
+}
+
+// Column j of the embedding of token
+__device__ float tokenEmbedding(Matrix wte, int token, int j) {
+    size_t at = (size_t)token * wte.cols + j;
+    return wte.dtype == DTYPE_FP16 ? toFloat(((const __half*)wte.dat)[at])
+         : wte.dtype == DTYPE_BF16 ? toFloat(((const __nv_bfloat16*)wte.dat)[at])
+         : wte.dat[at];
+}
+
+// Which sequence of the batch a stacked row belongs to
+__device__ int batchSequence(const Batch* batch, int row) {
+    int s = 0;
+    while (row >= batch->first_row[s + 1]) {
+        s++;
+    }
+    return s;
 }
 
 __global__ void embeddingsKernel(Matrix line, Matrix wpe, int *output, int num_total_tokens, int DIM, Matrix wte) {
@@ -244,99 +1292,645 @@ __global__ void embeddingsKernel(Matrix line, Matrix wpe, int *output, int num_t
      int i = idx / DIM;
      int j = idx % DIM;
      if (idx < num_total_tokens * DIM) {
-        line.dat[i * DIM + j] = wte.dat[output[i] * DIM + j] + wpe.dat[j * 1024 + i];
+        line.dat[i * DIM + j] = tokenEmbedding(wte, output[i], j) + wpe.dat[i * DIM + j];
      }
 }
 
+// What the last sampleCUDA or speculateCUDA produced, on the device
+static int* sample_out;
+
+// One block per row: row i is the token tokens[i], at the position that row has in
+// its own sequence. Positions past the last one the model has an embedding for get
+// that one. A token of -1 - s is the one the last sampleCUDA drew for sequence s of
+// its batch. wpe is kept a position per row, so the threads of a block read both
+// embeddings along a row, and every thread norms the very columns it just wrote, so
+// the row only goes out to memory once, with its LayerNorm next to it.
+__global__ void embeddingsLayerNormBatchKernel(Matrix line, Matrix out, Matrix wte, Matrix wpe, Matrix weight,
+                                               Matrix bias, int *tokens, const Batch* batch) {
+    int DIM = line.cols;
+    int i = blockIdx.x;
+    int s = batchSequence(batch, i);
+    int pos = min(batch->pos[s] + i - batch->first_row[s], wpe.rows - 1);
+    int token = tokens[i] < 0 ? sample_out[-1 - tokens[i]] : tokens[i];
+    float* x = line.dat + (size_t)i * DIM;
+    for (int j = threadIdx.x; j < DIM; j += blockDim.x) {
+        x[j] = tokenEmbedding(wte, token, j) + wpe.dat[(size_t)pos * DIM + j];
+    }
+    layerNormRow(x, out.dat + (size_t)i * DIM, weight.dat, bias.dat, DIM);
+}
+
 extern "C" void embeddingsCUDA(Matrix line, Matrix wte, Matrix wpe, int *output, int num_total_tokens, int DIM) {
+    PROFILE;
     int threadsPerBlock = 1024;
     int numBlocks = CEIL_DIV(num_total_tokens * DIM, threadsPerBlock);
-    embeddingsKernel<<<numBlocks, threadsPerBlock>>>(line, wpe, output, num_total_tokens, DIM, wte);
+    embeddingsKernel<<<numBlocks, threadsPerBlock, 0, stream>>>(line, wpe, output, num_total_tokens, DIM, wte);
 }
 
-__device__ static float atomicMax(float* address, float val)
-{
-    int* address_as_i = (int*) address;
-    int old = *address_as_i, assumed;
-    do {
-        assumed = old;
-        old = ::atomicCAS(address_as_i, assumed,
-            __float_as_int(::fmaxf(val, __int_as_float(assumed))));
-    } while (assumed != old);
-    return __int_as_float(old);
+extern "C" void embeddingsLayerNormBatchCUDA(Matrix line, Matrix out, Matrix wte, Matrix wpe, Matrix weight, Matrix bias,
+                                             int *tokens, const Batch* batch) {
+    PROFILE;
+    embeddingsLayerNormBatchKernel<<<line.rows, 256, 0, stream>>>(line, out, wte, wpe, weight, bias, tokens, batch);
 }
 
-// From lab 3
-__global__
-void findMaxKernel(float *out_data, float *max_abs_val, int length) {
-    extern __shared__ float sdata[];
+// A batch of one sequence, with its rows starting at pos, in cache block 0
+static Batch* singleSequence(int rows, int pos) {
+    static Batch* d_batch;
+    if (!d_batch) {
+        cudaMalloc(&d_batch, sizeof(Batch));
+    }
+    Batch batch = {1};
+    batch.first_row[1] = rows;
+    batch.pos[0] = pos;
+    cudaMemcpy(d_batch, &batch, sizeof(Batch), cudaMemcpyHostToDevice);
+    return d_batch;
+}
+
+// Where the 64 floats of head at position pos of sequence s start in a paged cache.
+// The cache of a sequence is a ring, position pos goes to pos % cache_len, and a block
+// is laid out [head][position][64] so each head's keys form a contiguous matrix.
+__device__ size_t cachedAt(const Batch* batch, int s, int pos, int head, int cache_len, int block_len,
+                           size_t block_stride) {
+    int p = pos % cache_len;
+    return batch->blocks[s][p / block_len] * block_stride + ((size_t)head * block_len + p % block_len) * 64;
+}
+
+// Append the keys and values of the fused QKV product to the cache
+__global__ void kvCacheKernel(float* qkv, int rows, int dim, float* k_cache, float* v_cache, const Batch* batch,
+                              int cache_len, int block_len, size_t block_stride) {
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < rows * dim) {
+        int row = idx / dim;
+        int col = idx % dim;
+        int s = batchSequence(batch, row);
+        int pos = batch->pos[s] + row - batch->first_row[s];
+        float* src = qkv + (size_t)row * 3 * dim;
+        size_t cached = cachedAt(batch, s, pos, col / 64, cache_len, block_len, block_stride) + col % 64;
+        k_cache[cached] = src[dim + col];
+        v_cache[cached] = src[2 * dim + col];
+    }
+}
+
+extern "C" void kvCacheBatchCUDA(Matrix qkv, float* k_cache, float* v_cache, const Batch* batch, int cache_len,
+                                 int block_len, size_t block_stride) {
+    PROFILE;
+    int dim = qkv.cols / 3;
+    int threadsPerBlock = 256;
+    int numBlocks = CEIL_DIV(qkv.rows * dim, threadsPerBlock);
+    kvCacheKernel<<<numBlocks, threadsPerBlock, 0, stream>>>(qkv.dat, qkv.rows, dim, k_cache, v_cache, batch,
+                                                             cache_len, block_len, block_stride);
+}
+
+extern "C" void kvCacheCUDA(Matrix qkv, float* k_cache, float* v_cache, int pos, int cache_len) {
+    PROFILE;
+    kvCacheBatchCUDA(qkv, k_cache, v_cache, singleSequence(qkv.rows, pos), cache_len, cache_len, 0);
+}
+
+// Causal self attention for all heads in one launch, FlashAttention style.
+// A block handles one head and ATT_ROWS consecutive queries, one warp per query.
+// Keys and values are staged through shared memory 32 positions at a time and
+// each warp keeps a running max and sum, so the softmax is computed online and
+// the scores never leave registers. Lane j scores key j of the tile, then the
+// probabilities are broadcast so each lane accumulates output dims j and j + 32.
+// Queries come straight out of the Linear(..., 0) layout [row][q | k | v], and
+// row r of a sequence is at position pos + r, so the same kernel does prefill and
+// decode. The rows of a block all belong to one sequence of the batch, which
+// sequence it is follows from counting off the blocks each one needs. The batch
+// is read from device memory, so the launch only depends on its size.
+// A query attends to the last window positions up to its own, which the ring of
+// cache_len positions still holds as long as window <= cache_len. The keys of a tile
+// are looked up in the block table of the sequence, so they may come from different
+// blocks anywhere in the cache.
+#define ATT_ROWS 4
+
+__global__ void attentionKernel(float* qkv, float* k_cache, float* v_cache, float* out, int dim, const Batch* batch,
+                                int cache_len, int block_len, size_t block_stride, int window) {
+    __shared__ float Qs[ATT_ROWS][64];
+    __shared__ float Ks[32][65];  // +1 for padding, lane j reads row j
+    __shared__ float Vs[32][64];
+
+    int head = blockIdx.x;
+    int warp = threadIdx.y;
+    int lane = threadIdx.x;
+    int tid = warp * 32 + lane;
+
+    // The grid is sized for the worst case, blocks past the last sequence have nothing to do
+    int s = 0, block = blockIdx.y;
+    while (s < batch->count && block >= CEIL_DIV(batch->first_row[s + 1] - batch->first_row[s], ATT_ROWS)) {
+        block -= CEIL_DIV(batch->first_row[s + 1] - batch->first_row[s], ATT_ROWS);
+        s++;
+    }
+    if (s == batch->count) return;
+    int rows = batch->first_row[s + 1] - batch->first_row[s];
+    int pos = batch->pos[s];
+    bool active = block * ATT_ROWS + warp < rows;
+    int row = batch->first_row[s] + block * ATT_ROWS + warp;
+    int query_pos = pos + block * ATT_ROWS + warp;
+
+    // Fold the 1/sqrt(64) scale into the query
+    if (active) {
+        float* q = qkv + (size_t)row * 3 * dim + head * 64;
+        Qs[warp][lane] = q[lane] / 8;
+        Qs[warp][lane + 32] = q[lane + 32] / 8;
+    }
+
+    int num_keys = pos + min(rows, (block + 1) * ATT_ROWS);
+    int first_key = max(0, pos + block * ATT_ROWS - window + 1);
+
+    float running_max = -INFINITY, running_sum = 0, acc0 = 0, acc1 = 0;
+    for (int start = first_key; start < num_keys; start += 32) {
+        __syncthreads();
+        for (int i = tid; i < 32 * 64; i += 32 * ATT_ROWS) {
+            int key = start + i / 64;
+            size_t cached = key < num_keys ? cachedAt(batch, s, key, head, cache_len, block_len, block_stride) : 0;
+            Ks[i / 64][i % 64] = key < num_keys ? k_cache[cached + i % 64] : 0;
+            Vs[i / 64][i % 64] = key < num_keys ? v_cache[cached + i % 64] : 0;
+        }
+        __syncthreads();
+
+        if (active) {
+            int key = start + lane;
+            bool in_window = key <= query_pos && key > query_pos - window;
+            float score = -INFINITY;
+            if (in_window) {
+                score = 0;
+                for (int d = 0; d < 64; d++) {
+                    score += Qs[warp][d] * Ks[lane][d];
+                }
+            }
+
+            float tile_max = warpReduce(score, MaxOp());
+            // The first tile always holds the first key of every query in the
+            // block, so new_max is finite from here on
+            float new_max = fmaxf(running_max, tile_max);
+            float p = in_window ? expf(score - new_max) : 0;
+            float rescale = expf(running_max - new_max);
+
+            float tile_sum = warpReduce(p, SumOp());
+            running_sum = running_sum * rescale + tile_sum;
+            running_max = new_max;
+
+            acc0 *= rescale;
+            acc1 *= rescale;
+            for (int j = 0; j < 32; j++) {
+                float pj = __shfl_sync(0xffffffff, p, j);
+                acc0 += pj * Vs[j][lane];
+                acc1 += pj * Vs[j][lane + 32];
+            }
+        }
+    }
+
+    if (active) {
+        out[(size_t)row * dim + head * 64 + lane] = acc0 / running_sum;
+        out[(size_t)row * dim + head * 64 + lane + 32] = acc1 / running_sum;
+    }
+}
+
+extern "C" void attentionBatchCUDA(Matrix qkv, float* k_cache, float* v_cache, const Batch* batch, int count, int cache_len,
+                                   int block_len, size_t block_stride, int window, Matrix out) {
+    PROFILE;
+    int dim = qkv.cols / 3;
+    // No split of the rows into count sequences needs more blocks than this
+    int blocks = (qkv.rows + count * (ATT_ROWS - 1)) / ATT_ROWS;
+    if (!blocks) return;
+    dim3 dimBlock(32, ATT_ROWS);
+    dim3 dimGrid(dim / 64, blocks);
+    attentionKernel<<<dimGrid, dimBlock, 0, stream>>>(qkv.dat, k_cache, v_cache, out.dat, dim, batch, cache_len,
+                                                      block_len, block_stride, window);
+}
+
+extern "C" void attentionCUDA(Matrix qkv, float* k_cache, float* v_cache, int pos, int cache_len, Matrix out) {
+    PROFILE;
+    attentionBatchCUDA(qkv, k_cache, v_cache, singleSequence(qkv.rows, pos), 1, cache_len, cache_len, 0, cache_len, out);
+}
+
+__global__ void lastRowsKernel(Matrix a, const Batch* batch, int last, Matrix out) {
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < out.rows * a.cols) {
+        int r = idx / a.cols, s = r / last;
+        int row = batch->first_row[s + 1] - last + r % last;
+        out.dat[idx] = a.dat[(size_t)row * a.cols + idx % a.cols];
+    }
+}
+
+extern "C" void lastRowsCUDA(Matrix a, const Batch* batch, int last, Matrix out) {
+    PROFILE;
+    int threadsPerBlock = 256;
+    int numBlocks = CEIL_DIV(out.rows * a.cols, threadsPerBlock);
+    lastRowsKernel<<<numBlocks, threadsPerBlock, 0, stream>>>(a, batch, last, out);
+}
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+// It is counter based, so draw number counter of a random stream costs the same as
+// any other and needs no state. The CPU demo has the same generator.
+extern "C" __host__ __device__ double philoxUniform(unsigned long long seed, unsigned sequence, unsigned counter) {
+    unsigned c[4] = {counter, sequence, 0, 0};
+    unsigned k[2] = {(unsigned)seed, (unsigned)(seed >> 32)};
+    for (int r = 0; r < 10; r++) {
+        unsigned long long p0 = 0xD2511F53ull * c[0], p1 = 0xCD9E8D57ull * c[2];
+        unsigned next[4] = {(unsigned)(p1 >> 32) ^ c[1] ^ k[0], (unsigned)p1,
+                            (unsigned)(p0 >> 32) ^ c[3] ^ k[1], (unsigned)p0};
+        for (int i = 0; i < 4; i++) c[i] = next[i];
+        k[0] += 0x9E3779B9;
+        k[1] += 0xBB67AE85;
+    }
+    // The top 53 bits of the first two words
+    return ((((unsigned long long)c[0] << 32) | c[1]) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Probabilities are kept in fixed point, exp(logit - max) scaled by 2^40, so that
+// the sums of the histograms and of the CDF are exact and come out the same in
+// any order. A token that is 2^-40 as likely as the best one is never sampled.
+#define SAMPLE_ONE (1ull << 40)
+#define SAMPLE_THREADS 1024
+
+// Sort key of a float: the unsigned order of the keys is the order of the floats
+__device__ unsigned orderedKey(float f) {
+    unsigned u = __float_as_uint(f);
+    return u & 0x80000000 ? ~u : u | 0x80000000;
+}
+
+// Block-level radix select. Finds the largest key such that the weight of all the
+// keys at or above it reaches target, 8 bits at a time from bit shift + 7 down, so
+// n elements are read (shift / 8 + 1) times. With weight 1 that is the target-th
+// largest key, with probabilities as weights it is the top-p cutoff.
+template <typename Key, typename Weight>
+__device__ unsigned long long radixSelect(int n, int shift, Key key, Weight weight, unsigned long long target) {
+    __shared__ unsigned long long hist[256];
+    __shared__ unsigned long long above;
+    __shared__ int digit;
+    unsigned long long prefix = 0, mask = 0;
+    if (threadIdx.x == 0) above = 0;
+    for (; shift >= 0; shift -= 8) {
+        for (int i = threadIdx.x; i < 256; i += blockDim.x) hist[i] = 0;
+        __syncthreads();
+        for (int i = threadIdx.x; i < n; i += blockDim.x) {
+            unsigned long long k = key(i);
+            if ((k & mask) == prefix) {
+                atomicAdd(&hist[(k >> shift) & 255], (unsigned long long)weight(i));
+            }
+        }
+        __syncthreads();
+        // Walk down from the highest digit until the weight at or above it is enough
+        if (threadIdx.x == 0) {
+            int d = 255;
+            while (d > 0 && above + hist[d] < target) {
+                above += hist[d--];
+            }
+            digit = d;
+        }
+        __syncthreads();
+        prefix |= (unsigned long long)digit << shift;
+        mask |= 255ull << shift;
+    }
+    return prefix;
+}
+
+// The distribution a row of logits is sampled from, in four passes over it: the max,
+// the top-k cutoff, the fixed point probabilities and their sum, and the top-p cutoff.
+// w receives the probabilities, zero outside of the top-k and top-p, and every thread
+// gets their sum.
+__device__ unsigned long long distribution(const float* row, int cols, Sampler sampler, unsigned long long* w) {
+    __shared__ float max_scratch[32];
+    __shared__ unsigned long long sum_scratch[32];
+    float inv_temperature = 1 / sampler.temperature;
+
+    float max = -INFINITY;
+    for (int i = threadIdx.x; i < cols; i += blockDim.x) {
+        max = fmaxf(max, row[i] * inv_temperature);
+    }
+    max = blockReduce(max, MaxOp(), -INFINITY, max_scratch);
 
-    uint thread_idx = blockDim.x * blockIdx.x + threadIdx.x;
+    unsigned cutoff = 0;
+    if (sampler.top_k > 0 && sampler.top_k < cols) {
+        cutoff = radixSelect(cols, 24, [&](int i) { return orderedKey(row[i] * inv_temperature); },
+                             [](int i) { return 1; }, sampler.top_k);
+    }
 
-    float localMax = -INFINITY;
-    while (thread_idx < length) {
-        localMax = fmaxf(localMax, out_data[thread_idx]);
-        thread_idx += blockDim.x * gridDim.x;
+    unsigned long long total = 0;
+    for (int i = threadIdx.x; i < cols; i += blockDim.x) {
+        float logit = row[i] * inv_temperature;
+        w[i] = orderedKey(logit) >= cutoff ? (unsigned long long)(expf(logit - max) * SAMPLE_ONE) : 0;
+        total += w[i];
     }
-    uint tid = threadIdx.x;
-    sdata[tid] = localMax;
+    total = blockReduce(total, SumOp(), 0ull, sum_scratch);
+
+    if (sampler.top_p < 1) {
+        unsigned long long target = (unsigned long long)(sampler.top_p * (double)total);
+        unsigned long long p_cutoff = radixSelect(cols, 40, [&](int i) { return w[i]; }, [&](int i) { return w[i]; },
+                                                  target ? target : 1);
+        total = 0;
+        for (int i = threadIdx.x; i < cols; i += blockDim.x) {
+            if (w[i] < p_cutoff) w[i] = 0;
+            total += w[i];
+        }
+        total = blockReduce(total, SumOp(), 0ull, sum_scratch);
+    }
+    return total;
+}
+
+// The first token whose running sum of w passes u * total, which every thread gets.
+// Thread t sums a contiguous chunk, the chunks are scanned warp by warp, and the
+// thread whose chunk holds the target walks it.
+__device__ int pick(const unsigned long long* w, int cols, unsigned long long total, double u) {
+    __shared__ unsigned long long sum_scratch[32];
+    __shared__ int token;
+    unsigned long long target = (unsigned long long)(u * (double)total);
+    target = target < total ? target : total - 1;
+    int chunk = (cols + blockDim.x - 1) / blockDim.x;
+    int begin = min(cols, (int)threadIdx.x * chunk), end = min(cols, begin + chunk);
+    unsigned long long sum = 0;
+    for (int i = begin; i < end; i++) {
+        sum += w[i];
+    }
+    int lane = threadIdx.x % 32, warp = threadIdx.x / 32;
+    unsigned long long before = sum;
+    for (int offset = 1; offset < 32; offset <<= 1) {
+        unsigned long long other = __shfl_up_sync(0xffffffff, before, offset);
+        if (lane >= offset) before += other;
+    }
+    __syncthreads();
+    if (lane == 31) sum_scratch[warp] = before;
     __syncthreads();
+    before -= sum;
+    for (int i = 0; i < warp; i++) {
+        before += sum_scratch[i];
+    }
+    if (before <= target && target < before + sum) {
+        for (int i = begin; i < end; i++) {
+            before += w[i];
+            if (before > target) {
+                token = i;
+                break;
+            }
+        }
+    }
+    __syncthreads();
+    return token;
+}
 
-    for (uint s = blockDim.x / 2; s > 0; s >>= 1) {
-        if (tid < s) {
-            sdata[tid] = fmaxf(sdata[tid], sdata[tid + s]);
+// The sampler of sequence s, with its own temperature if it has one
+__device__ Sampler sequenceSampler(const Batch* batch, int s, Sampler sampler) {
+    if (batch->temperature[s] > 0) sampler.temperature = batch->temperature[s];
+    return sampler;
+}
+
+// One block per sequence. With index the row holds candidates, already divided by
+// the temperature, and element i of it stands for token index[i].
+__global__ void sampleKernel(float* logits, const int* index, int cols, const Batch* batch, Sampler sampler,
+                             unsigned long long* weights, int* out) {
+    if (!index) sampler = sequenceSampler(batch, blockIdx.x, sampler);
+    unsigned long long* w = weights + (size_t)blockIdx.x * cols;
+    unsigned long long total = distribution(logits + (size_t)blockIdx.x * cols, cols, sampler, w);
+    double u = philoxUniform(sampler.seed, batch->sequence[blockIdx.x], batch->draw[blockIdx.x]);
+    int token = pick(w, cols, total, u);
+    if (threadIdx.x == 0) out[blockIdx.x] = index ? index[(size_t)blockIdx.x * cols + token] : token;
+}
+
+// One block per sequence, which goes through the proposals in order. Every thread
+// takes the same branches, since the tests only depend on block wide values.
+__global__ void speculateKernel(float* logits, int cols, Matrix draft, const int* tokens, const Batch* batch,
+                                Sampler sampler, int k, unsigned long long* weights, int* out) {
+    __shared__ unsigned long long sum_scratch[32];
+    int s = blockIdx.x;
+    sampler = sequenceSampler(batch, s, sampler);
+    unsigned long long *p = weights + (size_t)2 * s * cols, *q = p + cols;
+    const int* proposed = tokens + batch->first_row[s + 1] - k;
+    unsigned sequence = batch->sequence[s], draw = batch->draw[s];
+
+    int n = 0;
+    unsigned long long p_total, q_total;
+    for (;; n++) {
+        p_total = distribution(logits + ((size_t)s * (k + 1) + n) * cols, cols, sampler, p);
+        if (n == k) break;
+        q_total = distribution(draft.dat + ((size_t)n * draft.rows + s) * cols, cols, sampler, q);
+        int x = proposed[n];
+        double u = philoxUniform(sampler.seed, sequence, DRAW_ACCEPT | (draw + n));
+        // u < p(x) / q(x), without dividing. q(x) is never 0, the draft drew x from q.
+        if (!(u * (double)q[x] * (double)p_total < (double)p[x] * (double)q_total)) break;
+    }
+
+    unsigned long long* w = p;
+    unsigned long long total = p_total;
+    if (n < k) {
+        // Each residual probability is rounded on its own, so the sum is still exact.
+        // Every thread has to be done reading q[x] before it is overwritten.
+        __syncthreads();
+        unsigned long long residual = 0;
+        for (int i = threadIdx.x; i < cols; i += blockDim.x) {
+            double r = (double)p[i] / (double)p_total - (double)q[i] / (double)q_total;
+            q[i] = r > 0 ? (unsigned long long)(r * SAMPLE_ONE) : 0;
+            residual += q[i];
+        }
+        residual = blockReduce(residual, SumOp(), 0ull, sum_scratch);
+        // Rounding can leave p below q everywhere, then p itself is the closest there is
+        if (residual) {
+            w = q;
+            total = residual;
+        }
+    }
+    int token = pick(w, cols, total, philoxUniform(sampler.seed, sequence, draw + n));
+    if (threadIdx.x == 0) {
+        out[2 * s] = n;
+        out[2 * s + 1] = token;
+    }
+}
+
+// Four values of the embedding of token from column j on, in a single load
+__device__ float4 tokenEmbedding4(Matrix wte, int token, int j) {
+    size_t at = (size_t)token * wte.cols + j;
+    if (wte.dtype == DTYPE_FP32) return *(const float4*)(wte.dat + at);
+    uint2 v = *(const uint2*)((const unsigned short*)wte.dat + at);
+    if (wte.dtype == DTYPE_FP16) {
+        const __half* h = (const __half*)&v;
+        return make_float4(toFloat(h[0]), toFloat(h[1]), toFloat(h[2]), toFloat(h[3]));
+    }
+    const __nv_bfloat16* h = (const __nv_bfloat16*)&v;
+    return make_float4(toFloat(h[0]), toFloat(h[1]), toFloat(h[2]), toFloat(h[3]));
+}
+
+// One block per LM_HEAD_TOKENS tokens and a warp per token at a time, which reads the
+// row of wte four values per lane and multiplies it with every row of a at once, so
+// wte goes through once for the whole step. The rows of a are small enough to stay in
+// the cache. With top_k the block then keeps, for every row, its top_k logits divided
+// by the temperature of the sequence of that row, in the order of their tokens, at block * top_k of the row in
+// values and tokens. When there are ties at the last one it keeps the first tokens.
+__global__ void lmHeadKernel(Matrix a, Matrix wte, Matrix out, const Batch* batch, Sampler sampler, int top_k,
+                             float* values, int* tokens) {
+    __shared__ float scaled[LM_HEAD_ROWS][LM_HEAD_TOKENS];
+    __shared__ int warpAbove[32], warpTies[32];
+    int lane = threadIdx.x % 32, warp = threadIdx.x / 32, warps = blockDim.x / 32;
+    int first = blockIdx.x * LM_HEAD_TOKENS, DIM = a.cols;
+
+    for (int t = warp; t < LM_HEAD_TOKENS; t += warps) {
+        int token = first + t;
+        float sum[LM_HEAD_ROWS] = {0};
+        for (int j = lane * 4; token < wte.rows && j < DIM; j += 128) {
+            float4 w = tokenEmbedding4(wte, token, j);
+#pragma unroll
+            for (int r = 0; r < LM_HEAD_ROWS; r++) {
+                if (r < a.rows) {
+                    float4 x = *(const float4*)(a.dat + (size_t)r * DIM + j);
+                    sum[r] += w.x * x.x + w.y * x.y + w.z * x.z + w.w * x.w;
+                }
+            }
+        }
+#pragma unroll
+        for (int r = 0; r < LM_HEAD_ROWS; r++) {
+            for (int offset = 16; offset > 0; offset >>= 1) {
+                sum[r] += __shfl_xor_sync(0xffffffff, sum[r], offset);
+            }
+            if (lane == 0 && r < a.rows) {
+                if (token < wte.rows) out.dat[(size_t)r * out.cols + token] = sum[r];
+                if (top_k) {
+                    float inv_temperature = 1 / sequenceSampler(batch, r, sampler).temperature;
+                    scaled[r][t] = token < wte.rows ? sum[r] * inv_temperature : -INFINITY;
+                }
+            }
+        }
+    }
+    if (!top_k) return;
+    __syncthreads();
+
+    // One logit per thread. Everything above the cutoff stays, and the first ties at
+    // it, as many as there is room for, and each goes after those before it.
+    for (int r = 0; r < a.rows; r++) {
+        const float* row = scaled[r];
+        unsigned cutoff = radixSelect(LM_HEAD_TOKENS, 24, [&](int i) { return orderedKey(row[i]); },
+                                      [](int i) { return 1; }, top_k);
+        unsigned key = orderedKey(row[threadIdx.x]), lower = (1u << lane) - 1;
+        unsigned above = __ballot_sync(0xffffffff, key > cutoff), ties = __ballot_sync(0xffffffff, key == cutoff);
+        if (lane == 0) {
+            warpAbove[warp] = __popc(above);
+            warpTies[warp] = __popc(ties);
         }
         __syncthreads();
+        int above_before = __popc(above & lower), ties_before = __popc(ties & lower), room = top_k;
+        for (int w = 0; w < warps; w++) {
+            room -= warpAbove[w];
+            if (w < warp) {
+                above_before += warpAbove[w];
+                ties_before += warpTies[w];
+            }
+        }
+        if (key > cutoff || (key == cutoff && ties_before < room)) {
+            size_t at = ((size_t)r * gridDim.x + blockIdx.x) * top_k + above_before + min(ties_before, room);
+            values[at] = row[threadIdx.x];
+            tokens[at] = first + threadIdx.x;
+        }
+        __syncthreads();  // warpAbove and warpTies are written again for the next row
     }
+}
 
-    if (tid == 0) {
-        atomicMax(max_abs_val, sdata[0]);
+// One block per row, the log-probability of the token sampled from it
+__global__ void logProbKernel(const float* logits, int cols, const int* tokens, float* log_probs) {
+    const float* row = logits + (size_t)blockIdx.x * cols;
+    float lse = logSumExpRow(row, cols);
+    if (threadIdx.x == 0) log_probs[blockIdx.x] = row[tokens[blockIdx.x]] - lse;
+}
+
+// A logit and its token. Of two equal logits the lower token ranks first.
+struct ArgMax {
+    float value;
+    int index;
+};
+
+struct ArgMaxOp {
+    __device__ __forceinline__ ArgMax operator()(ArgMax a, ArgMax b) const {
+        return b.value > a.value || (b.value == a.value && b.index < a.index) ? b : a;
+    }
+};
+
+// One block per row, which takes its k best tokens one pass at a time, each the best
+// of those ranked below the one before
+__global__ void beamCandidatesKernel(const float* logits, int cols, int k, int* tokens, float* log_probs) {
+    __shared__ ArgMax scratch[32];
+    const float* row = logits + (size_t)blockIdx.x * cols;
+    float lse = logSumExpRow(row, cols);
+
+    ArgMax last = {INFINITY, -1};
+    for (int j = 0; j < k; j++) {
+        ArgMax best = {-INFINITY, INT_MAX};
+        for (int col = threadIdx.x; col < cols; col += blockDim.x) {
+            ArgMax c = {row[col], col};
+            if (c.value < last.value || (c.value == last.value && c.index > last.index)) best = ArgMaxOp()(best, c);
+        }
+        best = blockReduce(best, ArgMaxOp(), ArgMax{-INFINITY, INT_MAX}, scratch);
+        if (threadIdx.x == 0) {
+            tokens[blockIdx.x * k + j] = best.index;
+            log_probs[blockIdx.x * k + j] = best.value - lse;
+        }
+        last = best;
     }
 }
 
-__global__
-void weightedSampleKernel(float *probs, int *output, double rand_val, int length) {
-    double sum = 0.0;
-    int tmp = 0;
-    while(tmp < length) {
-        sum += probs[tmp];
-        if (sum >= rand_val) {
-            break;
-        }
-        tmp++;
-    }
-    *output = tmp;
-}
-
-extern "C" void softmaxSampleCUDA(Matrix a, int *out) {
-    dim3 dimBlock(256, 1);
-    dim3 dimGrid(128, 1);
-    int sharedMemSize = dimBlock.x * sizeof(float);
-
-    float *dev_max_val;
-    float max_val;
-    cudaMalloc(&dev_max_val, sizeof(float));
-    cudaMemset(dev_max_val, -10000, sizeof(float));
-    findMaxKernel<<<dimGrid, dimBlock, sharedMemSize>>>(a.dat, dev_max_val, a.cols);
-    cudaMemcpy(&max_val, dev_max_val, sizeof(float), cudaMemcpyDeviceToHost);
-    add_constCUDA(a, -1.0 * max_val);
-    mat_expCUDA(a, 1);
-    
-    float *dev_sum;
-    float sum;
-    cudaMalloc(&dev_sum, sizeof(float));
-    sumCudaKernel<<<dimGrid, dimBlock, dimBlock.x * sizeof(float)>>>(a.dat, dev_sum, a.rows, a.cols);
-    cudaMemcpy(&sum, dev_sum, sizeof(float), cudaMemcpyDeviceToHost);
-    divide_constCUDA(a, sum);
-    
-    int *dev_out;
-    cudaMalloc(&dev_out, sizeof(int));
-    double r = ((double)rand() / RAND_MAX);
-    weightedSampleKernel<<<1, 1>>>(a.dat, dev_out, r, a.cols);
-    cudaMemcpy(out, dev_out, sizeof(int), cudaMemcpyDeviceToHost);
-}
-   
-//  Matrix fn(Matrix a, float k)
+static unsigned long long* sample_weights;
+static float* sample_log_probs;
+// The candidates of the last lmHeadCUDA, and how many of them every row has
+static float* head_values;
+static int* head_tokens;
+static int head_candidates;
+
+extern "C" void samplerInitCUDA(int rows, int cols) {
+    cudaMalloc(&sample_weights, (size_t)2 * rows * cols * sizeof(unsigned long long));
+    cudaMalloc(&sample_out, MAX_BEAMS * rows * sizeof(int));
+    cudaMalloc(&sample_log_probs, MAX_BEAMS * rows * sizeof(float));
+    size_t candidates = (size_t)rows * CEIL_DIV(cols, LM_HEAD_TOKENS) * LM_HEAD_TOPK;
+    cudaMalloc(&head_values, candidates * sizeof(float));
+    cudaMalloc(&head_tokens, candidates * sizeof(int));
+}
+
+extern "C" void sampledCUDA(int* out, int n) {
+    PROFILE;
+    cudaMemcpyAsync(out, sample_out, n * sizeof(int), cudaMemcpyDeviceToHost, stream);
+}
+
+extern "C" void sampleCUDA(Matrix logits, const Batch* batch, Sampler sampler, int* out) {
+    PROFILE;
+    sampleKernel<<<logits.rows, SAMPLE_THREADS, 0, stream>>>(logits.dat, NULL, logits.cols, batch, sampler,
+                                                             sample_weights, sample_out);
+    if (out) sampledCUDA(out, logits.rows);
+}
+
+extern "C" void lmHeadCUDA(Matrix a, Matrix wte, const Batch* batch, const Sampler* sampler, Matrix out) {
+    PROFILE;
+    int blocks = CEIL_DIV(wte.rows, LM_HEAD_TOKENS), top_k = sampler ? sampler->top_k : 0;
+    head_candidates = blocks * top_k;
+    lmHeadKernel<<<blocks, LM_HEAD_TOKENS, 0, stream>>>(a, wte, out, batch, sampler ? *sampler : Sampler{}, top_k,
+                                                        head_values, head_tokens);
+}
+
+// The candidates are already divided by the temperature
+extern "C" void sampleTopCUDA(int rows, const Batch* batch, Sampler sampler, int* out) {
+    PROFILE;
+    sampler.temperature = 1;
+    sampleKernel<<<rows, SAMPLE_THREADS, 0, stream>>>(head_values, head_tokens, head_candidates, batch, sampler,
+                                                      sample_weights, sample_out);
+    if (out) sampledCUDA(out, rows);
+}
+
+extern "C" void speculateCUDA(Matrix logits, Matrix draft, int* tokens, const Batch* batch, Sampler sampler, int k, int* out) {
+    PROFILE;
+    int count = logits.rows / (k + 1);
+    speculateKernel<<<count, SAMPLE_THREADS, 0, stream>>>(logits.dat, logits.cols, draft, tokens, batch, sampler, k,
+                                                          sample_weights, sample_out);
+    if (out) sampledCUDA(out, 2 * count);
+}
+
+extern "C" void logProbCUDA(Matrix logits) {
+    PROFILE;
+    logProbKernel<<<logits.rows, 256, 0, stream>>>(logits.dat, logits.cols, sample_out, sample_log_probs);
+}
+
+extern "C" void beamCandidatesCUDA(Matrix logits, int k) {
+    PROFILE;
+    beamCandidatesKernel<<<logits.rows, 256, 0, stream>>>(logits.dat, logits.cols, k, sample_out, sample_log_probs);
+}
+
+extern "C" void sampledLogProbsCUDA(float* out, int n) {
+    PROFILE;
+    cudaMemcpyAsync(out, sample_log_probs, n * sizeof(float), cudaMemcpyDeviceToHost, stream);
+}
+
 #define UNARY(fn, opr)                                                 \
     __global__ void fn##Kernel_MTP(float* a, int aRows, int aCols, float* out, float k) { \
         int row = blockIdx.y * blockDim.y + threadIdx.y;               \
@@ -349,13 +1943,14 @@ extern "C" void softmaxSampleCUDA(Matrix a, int *out) {
         }                                                              \
     }                                                                  \
     extern "C" Matrix fn##CUDA(Matrix m, float k) {                    \
+        PROFILE;                                                       \
         float* a = m.dat;                                              \
         int aRows = m.rows;                                            \
         int aCols = m.cols;                                            \
         dim3 blockSize(32, 32);                                        \
         dim3 gridSize((aCols + blockSize.x - 1) / blockSize.x,         \
                       (aRows + blockSize.y - 1) / blockSize.y);        \
-        fn##Kernel_MTP<<<gridSize, blockSize>>>(a, aRows, aCols, a, k);\
+        fn##Kernel_MTP<<<gridSize, blockSize, 0, stream>>>(a, aRows, aCols, a, k);\
         return m;                                                      \
     }
 
@@ -373,7 +1968,7 @@ UNARY(broadcast, a[(i / aCols) * aCols])  // copy the first column to every colu
 UNARY(tril, (i / k < i % (int)k) ? 0 : exp(b / 8))
 
 // GELU is the activation function used for transformers
-UNARY(GELU, b / 2 * (1 + tanh(.7978845 * (b + .044715 * b * b * b))))
+UNARY(GELU, gelu(b))
 
 #define BINARY(fn, opr)                                                                    \
     __global__ void fn##Kernel_MTP(float* a, int aRows, int aCols, float* b, float* out) { \
@@ -385,10 +1980,11 @@ UNARY(GELU, b / 2 * (1 + tanh(.7978845 * (b + .044715 * b * b * b))))
         }                                                                                  \
     }                                                                                      \
     extern "C" Matrix fn##CUDA(Matrix a, Matrix b) {                                       \
+        PROFILE;                                                                           \
         dim3 blockSize(32, 32);                                                            \
         dim3 gridSize((a.cols + blockSize.x - 1) / blockSize.x,                            \
                       (a.rows + blockSize.y - 1) / blockSize.y);                           \
-        fn##Kernel_MTP<<<gridSize, blockSize>>>(a.dat, a.rows, a.cols, b.dat, a.dat);      \
+        fn##Kernel_MTP<<<gridSize, blockSize, 0, stream>>>(a.dat, a.rows, a.cols, b.dat, a.dat); \
         return a;                                                                          \
     }
 
@@ -1,4 +1,5 @@
 #pragma once
+#include <stddef.h>
 #define UNARYdef(fn) Matrix fn##CUDA(Matrix a, float k);
 #define BINARYdef(fn) Matrix fn##CUDA(Matrix a, Matrix b);
 
@@ -6,24 +7,206 @@
 extern "C" {
 #endif
 
+// Element types a matrix can be stored in. Activations are always fp32, weights
+// may be rounded to 16 bits at load, in which case dat points at 2 byte elements.
+// Quantized weights hold one int8, or two int4 with the even column in the low
+// nibble, per element of a row, and one fp32 scale per group of columns in scales.
+enum { DTYPE_FP32, DTYPE_FP16, DTYPE_BF16, DTYPE_INT8, DTYPE_INT4 };
+
 typedef struct {
     float* dat;
     int rows, cols;
+    int dtype;
+    float* scales;
+    int group;
 } Matrix;
 
+// Layout of a model file written by gpu/pack.c. The header is followed by one
+// PackedTensor per matrix, in the order the demo indexes its weights: 12 per layer
+// with the layers in numeric order, then the final layer norm bias and gain, wpe and
+// wte. Every matrix is stored exactly as the kernels read it, the weights already
+// transposed and wpe a position per row, at an offset from the start of the file
+// that is a multiple of PACK_ALIGN. Files of the first version, PACK_MAGIC_V1, have
+// wpe transposed and need to be packed again.
+#define PACK_MAGIC "GPT2PK2"
+#define PACK_MAGIC_V1 "GPT2PAK"
+#define PACK_ALIGN 4096
+
+typedef struct {
+    char magic[8];
+    int dim, nlayer, ntensors;
+} PackedHeader;
+
+typedef struct {
+    int rows, cols, dtype, group;
+    long long offset, scales;  // scales is 0 unless the matrix is quantized
+} PackedTensor;
+
 void matMulCUDANaive(float* a, int aRows, int aCols, float* b, int bRows, int bCols, float* out);
 
 void matMulCUDA(float* a, int aRows, int aCols, float* b, int bRows, int bCols, float* out);
 
 void matMulCublas(float* a, int aRows, int aCols, float* b, int bRows, int bCols, float* out);
 
+// Backends for gemmCUDA, chosen once at startup
+enum { GEMM_CUSTOM, GEMM_CUBLAS, GEMM_CUBLASLT };
+// What happens to the product before it is written out. With the residual the biased
+// product is added to what out already holds, the residual stream.
+enum { EPILOGUE_NONE, EPILOGUE_BIAS, EPILOGUE_BIAS_GELU, EPILOGUE_BIAS_RESIDUAL };
+
+// scratch is the most elements any GEMM input has, which the cuBLAS backends round
+// to 16 bits in a buffer of their own for 16 bit weights
+void gemmInitCUDA(int backend, size_t scratch);
+// Instrumentation of every entry point that launches work, off until profileInitCUDA
+// turns some of it on. With PROFILE_TIMES every call records a pair of events on the
+// stream, and profileReportCUDA prints the GPU time spent in each entry point and in
+// each range, a span that rangePushCUDA opens and rangePopCUDA closes, which the host
+// uses for its layers and steps. With PROFILE_CHECK the stream is synchronized after
+// every call, and the first that failed is named before exiting. Neither works while
+// the stream is captured into a graph. Built with -DUSE_NVTX, the entry points and
+// the ranges are also NVTX ranges, so they show up by name in nsys.
+enum { PROFILE_TIMES = 1, PROFILE_CHECK = 2 };
+void profileInitCUDA(int flags);
+void profileReportCUDA(void);
+void rangePushCUDA(const char *name);
+void rangePopCUDA(void);
+// Issue all further kernels and library calls into stream (a cudaStream_t)
+struct CUstream_st;
+void setStreamCUDA(struct CUstream_st *stream);
+// out = epilogue(a * transpose(w) + bias), every matrix in device memory.
+// Only w may be half precision or quantized, the product is accumulated in fp32 either way.
+void gemmCUDA(Matrix a, Matrix w, Matrix bias, int epilogue, Matrix out);
+// Tensor parallelism over NCCL. The first process makes an id of TP_ID_BYTES, which
+// returns 0 when built without NCCL, and every process then joins under its rank.
+// allReduceCUDA sums a over all of them in place, on the stream.
+#define TP_ID_BYTES 128
+int tensorParallelIdCUDA(void *id);
+void tensorParallelInitCUDA(const void *id, int rank, int ranks);
+void allReduceCUDA(Matrix a);
+// Copy a into out, converting from a.dtype to out.dtype
+void castCUDA(Matrix a, Matrix out);
+
+// Reduce every row of a and write the result to every column of the same row of out:
+// its sum, max or sum of squares, or the log of the sum of its exponentials, which
+// comes from the max and the sum of exp(x - max) taken in a single pass like a
+// softmax does. sumCUDA is the sum.
+enum { REDUCE_SUM, REDUCE_MAX, REDUCE_SUM_SQUARES, REDUCE_LOGSUMEXP };
+void rowReduceCUDA(Matrix a, int reduce, Matrix out);
 void sumCUDA(Matrix a, Matrix out);
+void layerNormCUDA(Matrix a, Matrix out, Matrix weight, Matrix bias);
 
 void transposeCUDA_util(Matrix a, Matrix out);
 void transposeCUDA(Matrix a, Matrix out);
 
+// The rows of one step of several sequences at once, stacked sequence by sequence.
+// Sequence s owns rows first_row[s] up to first_row[s + 1], which are its tokens at
+// positions pos[s] onwards, and keeps its keys and values in the cache blocks listed
+// in blocks[s], in the order of its positions. Its next token is draw number draw[s]
+// of random stream sequence[s], at temperature[s], or the temperature of the sampler
+// where that is 0. The kernels read it from device memory.
+#define MAX_BATCH 32
+
+// The engine pages its KV caches in blocks of KV_BLOCK positions, and MAX_BLOCKS of
+// them hold the longest context
+#define KV_BLOCK 16
+#define MAX_BLOCKS (1024 / KV_BLOCK)
+
+typedef struct {
+    int count;
+    int first_row[MAX_BATCH + 1];
+    int pos[MAX_BATCH];
+    int sequence[MAX_BATCH];
+    int draw[MAX_BATCH];
+    float temperature[MAX_BATCH];
+    int blocks[MAX_BATCH][MAX_BLOCKS];
+} Batch;
+
+// How the next token is drawn from the logits. They are divided by temperature,
+// then only the top_k most likely tokens stay in (0 keeps them all), and of those
+// only the fewest whose probabilities add up to top_p (1 keeps them all). The
+// random numbers come from Philox keyed by seed.
+typedef struct {
+    float temperature;
+    int top_k;
+    float top_p;
+    unsigned long long seed;
+} Sampler;
+
 void embeddingsCUDA(Matrix line, Matrix wte, Matrix wpe, int *output, int num_total_tokens, int DIM);
-void softmaxSampleCUDA(Matrix a, int *out);
+void kvCacheCUDA(Matrix qkv, float *k_cache, float *v_cache, int pos, int cache_len);
+void attentionCUDA(Matrix qkv, float *k_cache, float *v_cache, int pos, int cache_len, Matrix out);
+
+// The same for a whole batch of count sequences, described by batch in device memory.
+// tokens holds the token of every row, and the caches are paged. The cache of a
+// sequence is a ring that holds position pos at pos % cache_len, which is position
+// pos % cache_len % block_len of its block pos % cache_len / block_len. A block is
+// laid out [head][position][64] for block_len positions, and block b starts
+// block_stride floats after block b - 1. Every query attends to the last window
+// positions (at most cache_len) up to its own. The cache of a single sequence above
+// is a single block of cache_len positions. A token of -1 - s in tokens stands
+// for the one the last sampleCUDA drew for sequence s of its batch, so a step can
+// be queued before the tokens of the one before have reached the host. Besides the
+// embeddings of every row in line, embeddingsLayerNormBatchCUDA writes their
+// LayerNorm with weight and bias into out, the first one of the first layer.
+void embeddingsLayerNormBatchCUDA(Matrix line, Matrix out, Matrix wte, Matrix wpe, Matrix weight, Matrix bias,
+                                  int *tokens, const Batch *batch);
+void kvCacheBatchCUDA(Matrix qkv, float *k_cache, float *v_cache, const Batch *batch, int cache_len, int block_len,
+                      size_t block_stride);
+void attentionBatchCUDA(Matrix qkv, float *k_cache, float *v_cache, const Batch *batch, int count, int cache_len,
+                        int block_len, size_t block_stride, int window, Matrix out);
+// Copy the last rows of every sequence in a into out, which has that many rows per
+// sequence: row s * last + j of out is row first_row[s + 1] - last + j of a
+void lastRowsCUDA(Matrix a, const Batch *batch, int last, Matrix out);
+
+// Reserve the buffers of sampleCUDA and speculateCUDA for up to rows sequences of cols logits
+void samplerInitCUDA(int rows, int cols);
+// Sample the next token of every sequence of batch from its row of logits. The
+// tokens are copied to out asynchronously, so out should be pinned and is only
+// ready once the stream has been synchronized. With out NULL they stay on the device.
+void sampleCUDA(Matrix logits, const Batch *batch, Sampler sampler, int *out);
+// Copy the first n values the last sampleCUDA, speculateCUDA or beamCandidatesCUDA
+// produced into out, asynchronously
+void sampledCUDA(int *out, int n);
+// The log-probability of the token the last sampleCUDA or sampleTopCUDA drew from
+// every row of logits, under the distribution of the logits as they are, before any
+// temperature or truncation. sampledLogProbsCUDA copies the first n of them into out.
+void logProbCUDA(Matrix logits);
+void sampledLogProbsCUDA(float *out, int n);
+// Beam search. The k most likely tokens that follow every row of logits, at most
+// MAX_BEAMS, the most likely first, take the place of the token sampleCUDA would
+// have drawn, k per row, and their log-probabilities that of logProbCUDA.
+#define MAX_BEAMS 8
+void beamCandidatesCUDA(Matrix logits, int k);
+
+// The logits of the at most LM_HEAD_ROWS rows of a, out = a * transpose(wte), in a
+// single pass over wte, the table the embeddings are looked up in. With a sampler,
+// whose top_k has to be between 1 and LM_HEAD_TOPK, every LM_HEAD_TOKENS tokens also
+// keep their top_k logits divided by the temperature, row r being sequence r of batch. The top_k of the whole row are
+// among them, so sampleTopCUDA draws the same tokens from those as sampleCUDA would
+// from all the logits, apart from ties with the last one. a.cols has to be a multiple of 4.
+#define LM_HEAD_ROWS 8
+#define LM_HEAD_TOKENS 512
+#define LM_HEAD_TOPK 64
+void lmHeadCUDA(Matrix a, Matrix wte, const Batch *batch, const Sampler *sampler, Matrix out);
+// Sample like sampleCUDA for rows sequences, from what the last lmHeadCUDA kept
+void sampleTopCUDA(int rows, const Batch *batch, Sampler sampler, int *out);
+
+// Speculative decoding. The last k tokens of every sequence in tokens were proposed
+// by a draft model, whose logits for proposal j of sequence s are row j * draft.rows + s
+// of draft. logits has the k + 1 rows of the target model for the same positions.
+// Proposal j is accepted with probability min(1, p / q) of its probabilities under
+// the target and the draft, up to the first rejection, after which the next token is
+// drawn from the normalized max(0, p - q), or from p once all k are accepted, so the
+// tokens come out distributed exactly as if the target had sampled them one by one.
+// out[2 * s] receives how many proposals were accepted and out[2 * s + 1] the token
+// after them, asynchronously like sampleCUDA.
+void speculateCUDA(Matrix logits, Matrix draft, int *tokens, const Batch *batch, Sampler sampler, int k, int *out);
+// The random counters of the proposals and of their acceptance tests, which come
+// from their own ranges so they never reuse a draw of the tokens themselves
+#define DRAW_DRAFT (1u << 30)
+#define DRAW_ACCEPT (2u << 30)
+// Draw number counter of random stream sequence, uniform in [0, 1)
+double philoxUniform(unsigned long long seed, unsigned sequence, unsigned counter);
 
 //Matrix sliceCublas(Matrix a, int b, int rows, int cols);
 
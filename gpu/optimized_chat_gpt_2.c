@@ -20,281 +20,2433 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <cuda_runtime.h>
 #include"cuda_utils.h"
 
+// The shape of the model being loaded
 int DIM, NLAYER, NHEAD;
 
-int token_processed_upto;
-int num_total_tokens;
 int tmp, zz;
+// The vocabulary, packed back to back: token i is the string at bpe + bpe_offset[i]
 char* bpe;
+int bpe_offset[50000];
 
-void *memory_gpu, *memory_gpu_top;
+// The pool every activation of a step is planned into
+void* memory_gpu;
 FILE* fp;
 
+// How many tokens a draft model may propose at once
+#define MAX_DRAFT 8
+
+// The activations of a step, each written by one operation of forward
+enum {
+    ACT_LINE, ACT_LN1, ACT_QKV, ACT_ATT, ACT_LN2, ACT_FC, ACT_LAST, ACT_LN_F, ACT_LOGITS, NUM_ACTS
+};
+
+// A model and everything that lives as long as it does. The keys and values of every
+// token seen so far are in the blocks of the paged KV cache, at kv_offset into each,
+// see kv_cache. There is one decode graph per number of sequences, and for a draft
+// model per proposal as well. With --tp a GPU only holds local_heads of the heads,
+// and the caches only have those.
+typedef struct {
+    int id;  // which entry of Sequence.processed tracks its cache
+    int nhead, dim, nlayer;
+    int local_heads, local_dim;
+    Matrix weights[999];
+    Matrix wpe, wte;
+    size_t kv_offset;
+    cudaGraphExec_t graphs[MAX_DRAFT][MAX_BATCH + 1];
+    int steps[MAX_DRAFT][MAX_BATCH + 1];
+    size_t plan[NUM_ACTS];  // where each activation starts in the pool
+} Model;
+
+Model target_model = {0}, draft_model = {1};
+
 Matrix* layer_weights_GPU;
 
-// Standard stuff here. Let's save space with all our loops
-#define LOOP(i, j) for (int i = 0; i < j; i++)
+// Standard stuff here. Let's save space with all our loops
+#define LOOP(i, j) for (int i = 0; i < j; i++)
+
+// A matrix is just a 2d vector of floats with rows and columns.
+Matrix NewMatrix(int rows, int cols, int reuse) {
+    tmp = 4 * rows * cols;
+    float *a = malloc(tmp);
+    memset(a, 0, tmp * reuse);
+    Matrix out = {a, rows, cols};
+    return out;
+}
+
+// Helper function for timing
+double get_wall_time() {
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    double wall_time = (double)time.tv_sec + (double)time.tv_usec * 1e-6;
+    return wall_time;
+}
+
+// Transpose a matrix flipping the rows and columns
+Matrix transpose_util(Matrix a) {
+    Matrix out = NewMatrix(a.cols, a.rows, 1);
+    transposeCUDA_util(a, out);
+    return out;
+}
+
+// With the KV cache only the rows of new tokens ever reach a matmul,
+// so there is nothing from a prior run to preserve and no clone to make
+Matrix matmul_t_fast(Matrix a, Matrix b, Matrix out) {
+  Matrix no_bias = {0};
+  gemmCUDA(a, b, no_bias, EPILOGUE_NONE, out);
+  return out;
+}
+
+// Take a slice out of a larger matrix and return a new matrix with the given shape
+Matrix slice(Matrix a, int b, int rows, int cols) {
+    Matrix out = {a.dat + b * rows, rows, cols};
+    return out;
+}
+
+// A single fused kernel computes the row statistics and writes the
+// normalized, scaled and biased output without any scratch matrices
+Matrix LayerNorm(Matrix d_a, int i, Matrix d_out) {
+    layerNormCUDA(d_a, d_out, layer_weights_GPU[i + 1], layer_weights_GPU[i]);
+    return d_out;
+}
+
+// Compute a linear matrix layer, x * W + b, with the bias, and optionally GELU or the
+// residual connection, applied as the GEMM writes out its result
+Matrix linear(Matrix a, int i, int epilogue, Matrix out) {
+    gemmCUDA(a, layer_weights_GPU[i + 1], layer_weights_GPU[i], epilogue, out);
+    return out;
+}
+
+#define Linear(a, i, out) linear(a, i, EPILOGUE_BIAS, out)
+
+// Options of the form --name=value may appear anywhere on the command line.
+// They are pulled out here so the positional arguments keep their meaning.
+int gemm_backend = GEMM_CUSTOM;
+int weight_dtype = DTYPE_FP32;
+// --batch=FILE runs every line of FILE as a prompt, up to --max-batch of them at once.
+// --max-tokens=N ends a response after N tokens even without a newline, 0 never does.
+char* batch_file;
+int max_batch = 1;
+int max_tokens = 0;
+// With --prefill-chunk=N a prompt goes through at most N rows per step
+int prefill_chunk;
+// --graph replays decode steps from CUDA graphs
+bool use_graphs;
+// --temperature, --top-k and --top-p pick how tokens are sampled, the seed is set in main
+Sampler sampler = {0.7, 0, 1};
+// --draft=MODEL has a smaller model propose --speculate=N tokens at a time
+char* draft_file;
+int speculate = 4;
+// --prefix-cache=MB keeps the caches of finished histories in up to MB of device memory
+size_t prefix_budget;
+// --kv-cache=MB sizes the pool of KV cache blocks, instead of room for every sequence
+size_t kv_budget;
+// --window keeps going past zz tokens with the caches as rings, every token attending
+// to the last window positions, instead of purging the history by half
+bool sliding;
+int window;
+// --tp=N splits every layer over N GPUs, each driven by a process of its own, rank
+// tp_rank. The first one reads the input and forwards it to the others through pipes.
+#define MAX_TP 8
+int tp_ranks = 1, tp_rank;
+int tp_inputs[MAX_TP];
+
+// With --offload=N the layers of the target model stay in host memory, and only N of
+// them at a time are on the device, see offload_init
+#define MAX_SLOTS 8
+int offload_slots;
+
+// --serve=PORT loads the model once and answers requests over HTTP, see serve_http
+int serve_port;
+
+// --bench times a fixed prompt at every batch size up to --max-batch instead, see run_benchmark
+bool benchmark;
+
+// --n-best=N samples N responses to a prompt as a batch, --beam=N searches for the N
+// likeliest, and either prints them with their log-probabilities, see serve_candidates
+int n_best, beam_width;
+
+// --profile reports the GPU time of every op and every layer, --check-launches stops
+// at the first op that fails, see profileInitCUDA
+int profile_flags;
+
+// Match value against a list of names, returning its index or -1
+int option_index(char* value, const char** names, int count) {
+    LOOP(j, count) {
+        if (!strcmp(value, names[j])) return j;
+    }
+    return -1;
+}
+
+int parse_options(int argc, char** argv) {
+    const char* gemm_names[] = {"custom", "cublas", "cublaslt"};
+    const char* precision_names[] = {"fp32", "fp16", "bf16"};
+    int positional = 1;
+    LOOP(i, argc - 1) {
+        char* arg = argv[i + 1];
+        char* value = strchr(arg, '=');
+        if (strncmp(arg, "--", 2)) {
+            argv[positional++] = arg;
+            continue;
+        }
+        if (value && !strncmp(arg, "--gemm=", 7)) {
+            gemm_backend = option_index(value + 1, gemm_names, 3);
+            if (gemm_backend >= 0) continue;
+        }
+        if (value && !strncmp(arg, "--precision=", 12)) {
+            weight_dtype = option_index(value + 1, precision_names, 3);
+            if (weight_dtype >= 0) continue;
+        }
+        if (value && !strncmp(arg, "--temperature=", 14)) {
+            sampler.temperature = atof(value + 1);
+            if (sampler.temperature > 0) continue;
+        }
+        if (value && !strncmp(arg, "--top-k=", 8)) {
+            sampler.top_k = atoi(value + 1);
+            if (sampler.top_k >= 0) continue;
+        }
+        if (value && !strncmp(arg, "--top-p=", 8)) {
+            sampler.top_p = atof(value + 1);
+            if (sampler.top_p > 0 && sampler.top_p <= 1) continue;
+        }
+        if (!strcmp(arg, "--graph")) {
+            use_graphs = true;
+            continue;
+        }
+        if (!strcmp(arg, "--window")) {
+            sliding = true;
+            continue;
+        }
+        if (value && !strncmp(arg, "--batch=", 8)) {
+            batch_file = value + 1;
+            continue;
+        }
+        if (value && !strncmp(arg, "--max-batch=", 12)) {
+            max_batch = atoi(value + 1);
+            if (max_batch > 0 && max_batch <= MAX_BATCH) continue;
+        }
+        if (value && !strncmp(arg, "--max-tokens=", 13)) {
+            max_tokens = atoi(value + 1);
+            if (max_tokens >= 0) continue;
+        }
+        if (value && !strncmp(arg, "--prefill-chunk=", 16)) {
+            prefill_chunk = atoi(value + 1);
+            if (prefill_chunk > 0) continue;
+        }
+        if (value && !strncmp(arg, "--draft=", 8)) {
+            draft_file = value + 1;
+            continue;
+        }
+        if (value && !strncmp(arg, "--speculate=", 12)) {
+            speculate = atoi(value + 1);
+            if (speculate > 0 && speculate <= MAX_DRAFT) continue;
+        }
+        if (value && !strncmp(arg, "--tp=", 5)) {
+            tp_ranks = atoi(value + 1);
+            if (tp_ranks > 0 && tp_ranks <= MAX_TP) continue;
+        }
+        if (!strcmp(arg, "--offload")) {
+            offload_slots = 2;
+            continue;
+        }
+        if (value && !strncmp(arg, "--offload=", 10)) {
+            offload_slots = atoi(value + 1);
+            if (offload_slots >= 2 && offload_slots <= MAX_SLOTS) continue;
+        }
+        if (value && !strncmp(arg, "--n-best=", 9)) {
+            n_best = atoi(value + 1);
+            if (n_best > 0 && n_best <= MAX_BATCH) continue;
+        }
+        if (value && !strncmp(arg, "--beam=", 7)) {
+            beam_width = atoi(value + 1);
+            if (beam_width > 0 && beam_width <= MAX_BEAMS) continue;
+        }
+        if (!strcmp(arg, "--profile")) {
+            profile_flags |= PROFILE_TIMES;
+            continue;
+        }
+        if (!strcmp(arg, "--check-launches")) {
+            profile_flags |= PROFILE_CHECK;
+            continue;
+        }
+        if (!strcmp(arg, "--bench")) {
+            benchmark = true;
+            continue;
+        }
+        if (value && !strncmp(arg, "--serve=", 8)) {
+            serve_port = atoi(value + 1);
+            if (serve_port > 0 && serve_port < 65536) continue;
+        }
+        if (value && !strncmp(arg, "--prefix-cache=", 15)) {
+            prefix_budget = (size_t)atoi(value + 1) << 20;
+            if (atoi(value + 1) >= 0) continue;
+        }
+        if (value && !strncmp(arg, "--kv-cache=", 11)) {
+            kv_budget = (size_t)atoi(value + 1) << 20;
+            if (atoi(value + 1) > 0) continue;
+        }
+        fprintf(stderr, "Unknown option %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    argv[positional] = NULL;
+    return positional;
+}
+
+// Read a weight matrix out of the data file into memory
+Matrix read_matrix(int rows, int cols) {
+    rows += !rows;  // if rows == 0 then load at least one row
+    cols += !cols;  // if cols == 0 then load at least one col
+
+    Matrix a = NewMatrix(rows, cols, 1);
+
+    // It's already stored as a float on disk. Just load the bytes.
+    // (This assumes your machine is little endian)
+    size_t result = fread(a.dat, tmp, 1, fp);
+    if (result != 1) {
+        // Handle error, e.g., print an error message and exit
+        perror("Error reading matrix");
+        exit(EXIT_FAILURE);
+    }
+
+    // Our matrix multiply assumes transposed weights.
+    Matrix out = transpose_util(a);
+    free(a.dat);
+    return out;
+}
+
+// The layers on disk are stored by sorting alphabetically, because tensorflow makes
+// no sense. We need to convert this to the correct order. For example, if there are
+// 12 layers, we would have them on disk in order: 0 1 10 11 2 3 4 5 6 7 8 9
+// which means we permute by the inverse: 0 1 4 5 6 7 8 9 10 11 2 3
+int disk_layer(int i) {
+    int permute = 0;
+    tmp = 0;
+    LOOP(j, 10) {
+        if (j == i) {
+            permute = tmp;
+        }
+        tmp++;
+        LOOP(k, 10 * (j > 0)) {
+            if (j * 10 + k < NLAYER && tmp++ && i == j * 10 + k) {
+                permute = tmp;
+            }
+        }
+    }
+    return permute;
+}
+
+// Tensor parallelism in the way of Megatron-LM. Each GPU keeps a range of the heads,
+// as the rows of the query, key and value weights that compute them, and the same
+// share of the MLP, 256 rows of the up projection per head. The projections back
+// into the residual stream keep the matching columns, so each GPU computes a part
+// of their sum from what it has, and the parts are added up over all of them.
+// split cuts w into parts equal pieces along its rows or its columns, the query, key
+// and value parts of the fused weights, and keeps this GPU's range of heads out of
+// each piece, unit rows or columns per head.
+Matrix split(Matrix w, bool by_rows, int parts, int unit) {
+    int piece = (by_rows ? w.rows : w.cols) / parts;
+    int begin = NHEAD * tp_rank / tp_ranks * unit;
+    int len = NHEAD * (tp_rank + 1) / tp_ranks * unit - begin;
+    Matrix out = by_rows ? NewMatrix(parts * len, w.cols, 0) : NewMatrix(w.rows, parts * len, 0);
+    LOOP(p, parts) {
+        if (by_rows) {
+            memcpy(out.dat + (size_t)p * len * w.cols, w.dat + (size_t)(p * piece + begin) * w.cols,
+                   (size_t)len * w.cols * sizeof(float));
+        } else {
+            LOOP(r, w.rows) {
+                memcpy(out.dat + (size_t)r * out.cols + p * len, w.dat + (size_t)r * w.cols + p * piece + begin,
+                       len * sizeof(float));
+            }
+        }
+    }
+    return out;
+}
+
+// The part of entry j of a layer that stays on this GPU. The biases are a single row.
+// Those of the projections into the residual stream are only added once, by rank 0,
+// and the LayerNorms are needed in full everywhere.
+Matrix shard(Matrix w, int j) {
+    switch (j) {
+        case 0: return split(w, false, 3, 64);  // query, key and value bias
+        case 1: return split(w, true, 3, 64);   // query, key and value weights
+        case 3: return split(w, false, 1, 64);  // attention projection
+        case 8: return split(w, false, 1, 256); // up projection bias
+        case 9: return split(w, true, 1, 256);  // up projection
+        case 11: return split(w, false, 1, 256);// down projection
+        default: return w;
+    }
+}
+
+// The matmul weights are the odd entries of a layer, leaving out its LayerNorms
+bool layer_weight(int j) {
+    return j % 2 && j != 5 && j != 7;
+}
+
+// With --offload the layers of the target model are kept back to back in one pinned
+// host image, and a step streams them through a ring of slots on the device on a
+// stream of their own, layer i into slot i % offload_slots. The copy of a layer runs
+// while the layers before it compute, and reuses a slot as soon as the layer in it
+// is done, so the model only needs as much device memory as a few of its layers,
+// and a step takes as long as copying all of them over PCIe, or computing them.
+typedef struct {
+    char* host;
+    size_t layer_bytes;
+    char* device;
+    Matrix slots[MAX_SLOTS][12];  // the entries of a layer in every slot
+    cudaEvent_t loaded[MAX_SLOTS], released[MAX_SLOTS], start;
+    cudaStream_t stream;
+} Offload;
+
+Offload offload;
+bool offloading;  // whether the model being loaded is offloaded
+
+// Allocate the slots, given the entries of the first layer in the host image
+void offload_init(Matrix* layer) {
+    if (cudaMalloc((void**)&offload.device, offload_slots * offload.layer_bytes) != cudaSuccess) {
+        printf("Help!!! cudaMalloc of the layer slots failed\n");
+        exit(EXIT_FAILURE);
+    }
+    LOOP(s, offload_slots) {
+        char* slot = offload.device + s * offload.layer_bytes;
+        LOOP(j, 12) {
+            Matrix w = layer[j];
+            w.dat = (float*)(slot + ((char*)w.dat - offload.host));
+            if (w.scales) w.scales = (float*)(slot + ((char*)w.scales - offload.host));
+            offload.slots[s][j] = w;
+        }
+        cudaEventCreateWithFlags(&offload.loaded[s], cudaEventDisableTiming);
+        cudaEventCreateWithFlags(&offload.released[s], cudaEventDisableTiming);
+    }
+    cudaEventCreateWithFlags(&offload.start, cudaEventDisableTiming);
+    cudaStreamCreate(&offload.stream);
+    printf("Streaming %d layers of %zu bytes through %d slots\n", NLAYER, offload.layer_bytes, offload_slots);
+}
+
+void lower_layer(Matrix* w);
+
+// Move layer i of a checkpoint out of device memory into the host image, once it has
+// been uploaded into w and rounded like every other layer
+void offload_layer(Matrix* w, int i) {
+    lower_layer(w);
+    size_t bytes[12], offset = 0;
+    LOOP(j, 12) {
+        bytes[j] = (size_t)w[j].rows * w[j].cols * (w[j].dtype == DTYPE_FP32 ? 4 : 2);
+    }
+    if (!offload.host) {
+        LOOP(j, 12) {
+            offload.layer_bytes += (bytes[j] + 255) & ~(size_t)255;
+        }
+        if (cudaMallocHost((void**)&offload.host, NLAYER * offload.layer_bytes) != cudaSuccess) {
+            printf("Help!!! cudaMallocHost of the offloaded layers failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char* layer = offload.host + i * offload.layer_bytes;
+    LOOP(j, 12) {
+        cudaMemcpy(layer + offset, w[j].dat, bytes[j], cudaMemcpyDeviceToHost);
+        cudaFree(w[j].dat);
+        w[j].dat = (float*)(layer + offset);
+        offset += (bytes[j] + 255) & ~(size_t)255;
+    }
+    if (!i) offload_init(w);
+}
+
+// Load an original checkpoint. Every tensor is read and transposed on its own,
+// and the layers are put into numeric order as they are uploaded.
+void load_checkpoint(char* path, Matrix* weights_gpu, Matrix* d_wpe, Matrix* d_wte) {
+    fp = fopen(path, "r");
+
+    const int LENWEIGHTS = 999;
+    Matrix weights[LENWEIGHTS];
+    Matrix* out = weights;
+
+    LOOP(i, NLAYER){
+        LOOP(j, 12){
+                // These two nasty expressions compute the shapes of the matricies on disk
+                * out++ = read_matrix(DIM + DIM * (j ? j ^ 8 ? j ^ 11 ? 0 : 3 : 3 : 2), DIM * ((j % 8 == 3) + 3 * (j % 8 == 1) + (j == 9)));
+        }
+    }
+
+    *out++ = read_matrix(DIM, 1);  // ln_f.bias
+    *out++ = read_matrix(DIM, 1);  // ln_f.weight
+
+    // The embeddings are looked up by row, a token or a position per row
+    Matrix wpe = transpose_util(read_matrix(1024, DIM)),
+    wte = transpose_util(read_matrix(5e4, DIM));
+
+    *d_wpe = (Matrix){0, wpe.rows, wpe.cols};
+    *d_wte = (Matrix){0, wte.rows, wte.cols};
+    cudaMalloc((void**)&d_wpe->dat, wpe.rows * wpe.cols * sizeof(float));
+    cudaMalloc((void**)&d_wte->dat, wte.rows * wte.cols * sizeof(float));
+    cudaMemcpy(d_wpe->dat, wpe.dat, wpe.rows * wpe.cols * sizeof(float), cudaMemcpyHostToDevice);
+    cudaMemcpy(d_wte->dat, wte.dat, wte.rows * wte.cols * sizeof(float), cudaMemcpyHostToDevice);
+    // Loop to copy each matrix from CPU to GPU
+    for (int i = 0; i < (NLAYER * 12 + 2); i++) {
+        Matrix full = weights[i < NLAYER * 12 ? 12 * disk_layer(i / 12) + i % 12 : i], w = full;
+        if (tp_ranks > 1 && i < NLAYER * 12) {
+            w = shard(full, i % 12);
+        }
+        // Allocate memory for the matrix data on GPU
+        int dataSize = w.rows * w.cols * sizeof(float);
+        weights_gpu[i] = (Matrix){0, w.rows, w.cols};
+        cudaMalloc((void**)&weights_gpu[i].dat, dataSize);
+        // Copy matrix data from CPU to GPU
+        cudaMemcpy(weights_gpu[i].dat, w.dat, dataSize, cudaMemcpyHostToDevice);
+        // Neither the shard nor the whole matrix it came from is needed on the host any
+        // more, the largest models would otherwise be held in full by every rank
+        if (w.dat != full.dat) {
+            free(w.dat);
+            free(full.dat);
+        }
+        if (offloading && i < NLAYER * 12 && i % 12 == 11) {
+            offload_layer(weights_gpu + i - 11, i / 12);
+        }
+    }
+}
+
+// Files written by gpu/pack.c are mapped and uploaded as they are, every matrix is
+// already in the layout and order the kernels use. The whole blob goes into one
+// device allocation through two pinned buffers, so that copying a chunk out of the
+// mapping overlaps with the transfer of the one before it.
+#define UPLOAD_CHUNK (64 << 20)
+
+void upload(char* dst, const char* src, size_t size) {
+    void* staging[2];
+    cudaEvent_t done[2];
+    cudaStream_t stream;
+    cudaStreamCreate(&stream);
+    LOOP(b, 2) {
+        cudaMallocHost(&staging[b], UPLOAD_CHUNK);
+        cudaEventCreate(&done[b]);
+    }
+
+    int b = 0;
+    for (size_t offset = 0; offset < size; offset += UPLOAD_CHUNK, b ^= 1) {
+        size_t n = size - offset < UPLOAD_CHUNK ? size - offset : UPLOAD_CHUNK;
+        // Wait until the last transfer out of this buffer is done before refilling it
+        cudaEventSynchronize(done[b]);
+        memcpy(staging[b], src + offset, n);
+        cudaMemcpyAsync(dst + offset, staging[b], n, cudaMemcpyHostToDevice, stream);
+        cudaEventRecord(done[b], stream);
+    }
+
+    cudaStreamSynchronize(stream);
+    LOOP(b, 2) {
+        cudaFreeHost(staging[b]);
+        cudaEventDestroy(done[b]);
+    }
+    cudaStreamDestroy(stream);
+}
+
+// Whether the elements of t, and its scales if it has any, lie between from and to
+bool packed_within(PackedTensor* t, long long from, long long to) {
+    if (t->rows <= 0 || t->cols <= 0 || t->dtype < DTYPE_FP32 || t->dtype > DTYPE_INT4) return false;
+    long long n = (long long)t->rows * t->cols;
+    long long bytes = t->dtype == DTYPE_FP32 ? 4 * n : t->dtype == DTYPE_INT8 ? n : t->dtype == DTYPE_INT4 ? n / 2 : 2 * n;
+    if (t->offset < from || t->offset > to - bytes) return false;
+    if (!t->scales) return true;
+    if (t->group <= 0 || t->scales < from) return false;
+    return t->scales <= to - (long long)sizeof(float) * t->rows * (t->cols / t->group);
+}
+
+// Whether the table of the packed file of size bytes at file, and every tensor it
+// lists, lie within the file, with the tensors after the table
+bool packed_intact(char* file, long long size) {
+    PackedHeader* header = (PackedHeader*)file;
+    PackedTensor* tensors = (PackedTensor*)(header + 1);
+    long long table_end = sizeof(PackedHeader) + (long long)header->ntensors * sizeof(PackedTensor);
+    if (header->ntensors <= 0 || table_end > size || tensors[0].offset < table_end) return false;
+    LOOP(i, header->ntensors) {
+        if (!packed_within(tensors + i, tensors[0].offset, size)) return false;
+    }
+    return true;
+}
+
+// Returns false if path is not a packed file
+bool load_packed(char* path, Matrix* weights_gpu, Matrix* d_wpe, Matrix* d_wte) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || st.st_size < sizeof(PackedHeader)) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    char* file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return false;
+
+    PackedHeader* header = (PackedHeader*)file;
+    if (!memcmp(header->magic, PACK_MAGIC_V1, 8)) {
+        fprintf(stderr, "%s was packed in an older layout, run make pack again\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (memcmp(header->magic, PACK_MAGIC, 8)) {
+        munmap(file, st.st_size);
+        return false;
+    }
+    if (header->dim != DIM || header->nlayer != NLAYER || header->ntensors != NLAYER * 12 + 4) {
+        fprintf(stderr, "%s was packed for a different model\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (tp_ranks > 1) {
+        fprintf(stderr, "--tp splits the weights as they are loaded, so it needs the original checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    // Nothing in the table is trusted before it is known to lie within the file, so a
+    // truncated or stale pack cannot point the weights past what gets uploaded
+    if (!packed_intact(file, st.st_size)) {
+        fprintf(stderr, "%s is truncated or does not match its table, run make pack again\n", path);
+        exit(EXIT_FAILURE);
+    }
+    // --precision cannot free the fp32 weights of a pack, which are part of the one
+    // allocation of the blob, so they would stay on the device beside their copies
+    PackedTensor* tensors = (PackedTensor*)(header + 1);
+    bool fp32_weights = tensors[1].dtype == DTYPE_FP32 || tensors[NLAYER * 12 + 3].dtype == DTYPE_FP32;
+    if (weight_dtype != DTYPE_FP32 && fp32_weights) {
+        fprintf(stderr, "--precision=%s cannot round the fp32 weights of %s, pack them as fp16 or bf16 instead\n",
+                weight_dtype == DTYPE_FP16 ? "fp16" : "bf16", path);
+        exit(EXIT_FAILURE);
+    }
+    madvise(file, st.st_size, MADV_SEQUENTIAL);
+
+    // Everything from the first tensor to the end of the file is uploaded in one piece.
+    // Offloaded layers are all the same size and come first, so they are copied into
+    // the host image as they are and the upload starts after them.
+    size_t start = tensors[0].offset;
+    if (offloading) {
+        offload.layer_bytes = tensors[12].offset - start;
+        bool fits = tensors[12].offset > tensors[0].offset && start + NLAYER * offload.layer_bytes <= st.st_size;
+        LOOP(i, header->ntensors) {
+            long long end = start + NLAYER * offload.layer_bytes;
+            if (fits) fits = i < NLAYER * 12 ? packed_within(tensors + i, start, end)
+                                             : packed_within(tensors + i, end, st.st_size);
+        }
+        if (!fits) {
+            fprintf(stderr, "%s does not have its layers the same size, run make pack again\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (cudaMallocHost((void**)&offload.host, NLAYER * offload.layer_bytes) != cudaSuccess) {
+            printf("Help!!! cudaMallocHost of the offloaded layers failed\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(offload.host, file + start, NLAYER * offload.layer_bytes);
+        start += NLAYER * offload.layer_bytes;
+    }
+    char* blob;
+    if (cudaMalloc((void**)&blob, st.st_size - start) != cudaSuccess) {
+        printf("Help!!! cudaMalloc of the weights failed\n");
+        exit(EXIT_FAILURE);
+    }
+    upload(blob, file + start, st.st_size - start);
+
+    LOOP(i, header->ntensors) {
+        PackedTensor t = tensors[i];
+        char* base = offloading && i < NLAYER * 12 ? offload.host - tensors[0].offset : blob - start;
+        Matrix m = {(float*)(base + t.offset), t.rows, t.cols, t.dtype, t.scales ? (float*)(base + t.scales) : NULL,
+                    t.group};
+        if (i < NLAYER * 12 + 2) {
+            weights_gpu[i] = m;
+        } else if (i == NLAYER * 12 + 2) {
+            *d_wpe = m;
+        } else {
+            *d_wte = m;
+        }
+    }
+    munmap(file, st.st_size);
+    if (offloading) offload_init(weights_gpu);
+    return true;
+}
+
+// With --precision=fp16 or bf16 the matmul weights are rounded once, here, and
+// the fp32 copy is freed. Biases and LayerNorm parameters are tiny and stay fp32.
+// Weights that were converted offline are left as they are, and load_packed turns
+// down a packed file with fp32 weights to round.
+Matrix lower_precision(Matrix w) {
+    if (weight_dtype == DTYPE_FP32 || w.dtype != DTYPE_FP32) return w;
+    Matrix out = {0, w.rows, w.cols, weight_dtype};
+    cudaMalloc((void**)&out.dat, (size_t)w.rows * w.cols * 2);
+    castCUDA(w, out);
+    cudaFree(w.dat);
+    return out;
+}
+
+void lower_layer(Matrix* w) {
+    LOOP(j, 12) {
+        if (layer_weight(j)) w[j] = lower_precision(w[j]);
+    }
+}
+
+// Work out the hyperparameters of a model from the name of its file.
+// tmp will map 124M -> 0, 355M -> 1, 775M -> 2, 1558M -> 3
+// Note that if you change the name of the file then this will break.
+void model_shape(Model* m, char* path) {
+    tmp = path[5] + 3 * path[7] + 3 & 3;
+    // Now we just compute the layer sizes from tmp
+    m->nhead = 12 + 4 * tmp + (tmp > 2);
+    m->dim = m->nhead * 64;
+    m->nlayer = 12 * tmp + 12;
+    m->local_heads = m->nhead * (tp_rank + 1) / tp_ranks - m->nhead * tp_rank / tp_ranks;
+    m->local_dim = m->local_heads * 64;
+}
+
+// Load the weights of m from path, its KV cache is allocated with the others in main
+void load_model(Model* m, char* path) {
+    // The loaders work on the globals
+    NHEAD = m->nhead;
+    DIM = m->dim;
+    NLAYER = m->nlayer;
+    offloading = m == &target_model && offload_slots;
+    if (!load_packed(path, m->weights, &m->wpe, &m->wte)) {
+        load_checkpoint(path, m->weights, &m->wpe, &m->wte);
+    }
+
+    // Offloaded layers were rounded before they left the device
+    m->wte = lower_precision(m->wte);
+    LOOP(i, NLAYER * !offloading) {
+        lower_layer(m->weights + 12 * i);
+    }
+}
+
+// And now for something completely different: byte pair encoding.
+// The vocabulary is kept as a trie so that all the tokens starting at some position of
+// a word can be found in one walk. Its edges are in an open addressing hash table keyed
+// by (node, next character), node 0 is the root, and every node knows the smallest
+// token that spells it, or -1.
+#define TRIE_SIZE (1 << 20)
+unsigned trie_key[TRIE_SIZE];
+int trie_child[TRIE_SIZE], trie_token[TRIE_SIZE], trie_nodes = 1;
+
+// Follow the edge for c out of node, adding it if insert is set. Returns -1 if there is none.
+int trie_step(int node, unsigned char c, int insert) {
+    unsigned key = node * 256 + c + 1, h = key * 2654435761u % TRIE_SIZE;
+    while (trie_key[h] && trie_key[h] != key) {
+        h = (h + 1) % TRIE_SIZE;
+    }
+    if (!trie_key[h]) {
+        if (!insert) return -1;
+        trie_key[h] = key;
+        trie_token[trie_nodes] = -1;
+        trie_child[h] = trie_nodes++;
+    }
+    return trie_child[h];
+}
+
+void trie_insert(char* token, int i) {
+    int node = 0;
+    while (*token) {
+        node = trie_step(node, *token++, 1);
+    }
+    if (node && trie_token[node] < 0) trie_token[node] = i;
+}
+
+// This function takes a single word and produces the tokenization of that word.
+// It picks the tokenization with the fewest tokens, and among those the one whose
+// token ids sum to the least, preferring the smaller first token on a tie. Because
+// the best way to finish a word does not depend on how it was started, this is
+// computed backwards from the end of the word, in time linear in its length
+// (times the length of the longest token). A character no token spells is skipped.
+int* fix(char* word, int* result) {
+    int n = strlen(word);
+    long long cost[n + 1];
+    int best[n + 1];
+    cost[n] = 0;
+    for (int k = n - 1; k >= 0; k--) {
+        cost[k] = cost[k + 1] + (long long)1e12;
+        best[k] = -1;
+        for (int end = k, node = 0; word[end] && (node = trie_step(node, word[end], 0)) >= 0; end++) {
+            int i = trie_token[node];
+            long long sub_cost = cost[end + 1] + i + 1 + (long long)1e7;
+            if (i >= 0 && (sub_cost < cost[k] || (sub_cost == cost[k] && i < best[k]))) {
+                cost[k] = sub_cost;
+                best[k] = i;
+            }
+        }
+    }
+    for (int k = 0; k < n; k += best[k] < 0 ? 1 : strlen(bpe + bpe_offset[best[k]])) {
+        if (best[k] >= 0) *result++ = best[k];
+    }
+    return result;
+}
+
+// Given the ability to byte-pair encode a single word, this encodes a sentence
+// by splitting it into individual words, and tokenizing each word separately
+int* tokenize(char* seq, /*INT*/ int* result) {
+    int i = 0;
+    while (seq[i]) {
+        int j = i++;
+        while (47 < seq[i] && seq[i] < 58 || 64 < seq[i]) {
+            i++;
+        }
+        // Only the word itself is copied, so words and prompts can be any length
+        char out[i - j + 1];
+        memcpy(out, seq + j, i - j);
+        out[i - j] = 0;
+        result = fix(out, result);
+    }
+    return result;
+}
+
+// Everything the engine knows about one conversation. Up to max_batch of them are
+// decoded together, each keeping its keys and values in the cache blocks of its table.
+typedef struct Sequence {
+    int id;              // the random stream the sequence samples from
+    char* prompt;
+    int* tokens;         // the history, with room for 2 * zz tokens and a round of proposals
+    int num_tokens;      // how many tokens are in the history
+    int offset;          // the position of tokens[0], which only moves with --window
+    int processed[2];    // how many of those already have their keys and values cached,
+                         // by the target and by the draft model
+    int blocks[MAX_BLOCKS]; // its block table, -1 where it has no block yet, see kv_cache
+    float* swapped;      // while it is swapped out, the num_swapped blocks it had, see swap_out
+    int num_swapped;
+    int generated;
+    int pending;         // 1 + its place in the last step while the token from there is still on the device
+    bool done;
+    bool stream;         // print tokens as they come, otherwise all at once at the end
+    int max_tokens;      // the most tokens of response, 0 for no limit
+    float temperature;   // its own temperature, or 0 for that of the sampler
+    int client;          // the socket a --serve request streams to, or -1
+    bool hung_up;        // the client went away before the end of the response
+    char* response;
+    int response_len;
+    double start;
+    double first_token;  // when its first token came back
+    double* token_times; // with --bench, when each of its tokens came back
+    struct Sequence* parent; // with --n-best, the one whose blocks it starts from, see fork_sequence
+    double log_prob;     // with --n-best or --beam, of its response so far
+} Sequence;
+
+// Everything a step reads from the device besides the weights: the batch, followed
+// by the token of every row. The host fills the same layout in pinned memory and
+// copies it over at once, and the sampled tokens come back into next. There are two
+// of these, used by every other step, so the host can fill in a step while the one
+// before may still be running and read that one's tokens back while the next runs.
+typedef struct {
+    Batch* batch;
+    int* tokens;
+    int* next;
+    float* log_probs;             // of every one of next, with --n-best or --beam
+    cudaEvent_t done;             // fires once next has arrived
+    bool partial[MAX_BATCH];      // still had prompt left after the step, so its token is dropped
+} Staging;
+
+Staging staging[2];
+int num_steps;
+Batch* d_batch;
+int* d_tokens;
+
+// The most rows a step can have, which is what the activations are planned for
+int max_rows;
+
+// The logits the draft model drew proposal j of sequence s from are row
+// j * max_batch + s, as speculateCUDA expects
+Matrix proposals;
+int num_proposed, num_accepted;
+
+// Every step is queued on this stream
+cudaStream_t compute_stream;
+
+// The k-th conversation of a run samples from the k-th random stream, the same as in the CPU demo
+int num_sequences;
+
+// The paged KV cache. A block holds the keys and values of KV_BLOCK positions for the
+// caches of every loaded model, laid out [model][layer][k or v][head][position][64], so
+// that a block moves in one copy. Position pos of a sequence is in block pos % zz /
+// KV_BLOCK of its table. Sequences take blocks off the free list as they grow instead
+// of each holding zz positions from the start, so how many fit depends on how long
+// they actually are. Blocks are reference counted: forks, beams and the prefix cache
+// share the blocks of the positions they have in common, and a sequence that is about
+// to write into a block it shares copies it first.
+float* kv_cache;
+size_t block_floats;
+int num_blocks, num_free_blocks;
+int* free_blocks;
+int* block_refs;
+
+// What a block table holds for a block that is in host memory, see swap_out
+#define SWAPPED -2
+
+void drop_block(int b) {
+    if (!--block_refs[b]) free_blocks[num_free_blocks++] = b;
+}
+
+// Copy block from into block to, in stream order
+void copy_block(int from, int to) {
+    cudaMemcpyAsync(kv_cache + to * block_floats, kv_cache + from * block_floats, block_floats * sizeof(float),
+                    cudaMemcpyDeviceToDevice, compute_stream);
+}
+
+// Give back the blocks of seq from entry first of its table on
+void release_blocks(Sequence* seq, int first) {
+    for (int i = first; i < MAX_BLOCKS; i++) {
+        if (seq->blocks[i] >= 0) drop_block(seq->blocks[i]);
+        seq->blocks[i] = -1;
+    }
+}
+
+// Have seq share the blocks of the first n positions of the table blocks, in place of its own
+void share_blocks(Sequence* seq, const int* blocks, int n) {
+    release_blocks(seq, 0);
+    LOOP(i, (n + KV_BLOCK - 1) / KV_BLOCK) {
+        seq->blocks[i] = blocks[i];
+        block_refs[blocks[i]]++;
+    }
+}
+
+// Make the blocks seq writes positions from up to to into its own: a free block where
+// it has none yet, and a copy of every one it shares. Returns how many blocks that
+// takes, and with dry_run only counts them, so there have to be that many free before
+// it runs for real. Blocks in host memory are left to swap_in.
+int own_blocks(Sequence* seq, int from, int to, bool dry_run) {
+    int taken = 0;
+    for (int pos = from; pos < to;) {
+        int p = pos % zz, i = p / KV_BLOCK, b = seq->blocks[i];
+        pos += KV_BLOCK - p % KV_BLOCK < zz - p ? KV_BLOCK - p % KV_BLOCK : zz - p;
+        if (b == SWAPPED || (b >= 0 && block_refs[b] == 1)) continue;
+        taken++;
+        if (dry_run) continue;
+        int own = free_blocks[--num_free_blocks];
+        block_refs[own] = 1;
+        if (b >= 0) {
+            copy_block(b, own);
+            drop_block(b);
+        }
+        seq->blocks[i] = own;
+    }
+    return taken;
+}
+
+// When the blocks run out a sequence is preempted: its blocks are copied out to host
+// memory and given back, and once there are enough free again it gets new ones with
+// the copies put back in. Both copies are in stream order, after the last step that
+// wrote the blocks and before the first one that reads them.
+void swap_out(Sequence* seq) {
+    seq->num_swapped = 0;
+    LOOP(i, MAX_BLOCKS) {
+        seq->num_swapped += seq->blocks[i] >= 0;
+    }
+    cudaMallocHost((void**)&seq->swapped, seq->num_swapped * block_floats * sizeof(float));
+    int n = 0;
+    LOOP(i, MAX_BLOCKS) {
+        if (seq->blocks[i] < 0) continue;
+        cudaMemcpyAsync(seq->swapped + n++ * block_floats, kv_cache + seq->blocks[i] * block_floats,
+                        block_floats * sizeof(float), cudaMemcpyDeviceToHost, compute_stream);
+        drop_block(seq->blocks[i]);
+        seq->blocks[i] = SWAPPED;
+    }
+    fprintf(stderr, "\n----Out of KV cache blocks, swapped %d of them out to host memory----\n", n);
+}
+
+// The host copies swap_in has queued reads of, each with an event recorded behind
+// them. A copy can only go once it has been read, which is only after the step that
+// is running, so they wait here instead of on the stream.
+#define MAX_SWAP_COPIES (2 * MAX_BATCH)
+
+struct {
+    float* copy;
+    cudaEvent_t read;
+} swap_copies[MAX_SWAP_COPIES];
+int num_swap_copies;
+
+// Free the host copies that have been read, and with wait all of them, once they are
+void free_swap_copies(bool wait) {
+    int kept = 0;
+    LOOP(i, num_swap_copies) {
+        if (!wait && cudaEventQuery(swap_copies[i].read) == cudaErrorNotReady) {
+            swap_copies[kept++] = swap_copies[i];
+            continue;
+        }
+        cudaEventSynchronize(swap_copies[i].read);
+        cudaEventDestroy(swap_copies[i].read);
+        cudaFreeHost(swap_copies[i].copy);
+    }
+    num_swap_copies = kept;
+}
+
+void swap_in(Sequence* seq) {
+    int n = 0;
+    LOOP(i, MAX_BLOCKS) {
+        if (seq->blocks[i] != SWAPPED) continue;
+        int b = free_blocks[--num_free_blocks];
+        block_refs[b] = 1;
+        cudaMemcpyAsync(kv_cache + b * block_floats, seq->swapped + n++ * block_floats, block_floats * sizeof(float),
+                        cudaMemcpyHostToDevice, compute_stream);
+        seq->blocks[i] = b;
+    }
+    if (num_swap_copies == MAX_SWAP_COPIES) free_swap_copies(true);
+    swap_copies[num_swap_copies].copy = seq->swapped;
+    cudaEventCreateWithFlags(&swap_copies[num_swap_copies].read, cudaEventDisableTiming);
+    cudaEventRecord(swap_copies[num_swap_copies++].read, compute_stream);
+    seq->swapped = NULL;
+    seq->num_swapped = 0;
+}
+
+void new_sequence(Sequence* seq, char* prompt, bool stream) {
+    *seq = (Sequence){num_sequences++, prompt};
+    seq->start = get_wall_time();
+    seq->tokens = malloc((2 * zz + MAX_DRAFT + 1) * sizeof(int));
+    seq->response = malloc(1);
+    seq->response[0] = 0;
+    seq->stream = stream;
+    seq->max_tokens = max_tokens;
+    seq->client = -1;
+    memset(seq->blocks, -1, sizeof(seq->blocks));
+
+    char buf[strlen(prompt) + 3];
+    strcpy(buf, prompt);
+    strcat(buf, "\n\n");
+    seq->num_tokens = tokenize(buf, seq->tokens) - seq->tokens;
+
+    // A prompt has to leave room in the context for at least one token of response
+    if (seq->num_tokens >= zz) {
+        memmove(seq->tokens, seq->tokens + seq->num_tokens - zz + 1, (zz - 1) * sizeof(int));
+        seq->num_tokens = zz - 1;
+    }
+}
+
+void free_sequence(Sequence* seq) {
+    release_blocks(seq, 0);
+    if (seq->swapped) cudaFreeHost(seq->swapped);
+    free(seq->tokens);
+    free(seq->response);
+}
+
+// Put the history of the previous turn in front of the prompt of seq, so the model
+// sees the whole conversation. Once that would take more than half of the context
+// only the end of the history is kept.
+void continue_conversation(Sequence* seq, Sequence* previous) {
+    int keep = previous->num_tokens;
+    if (keep + seq->num_tokens > zz / 2) {
+        keep = seq->num_tokens < zz / 2 ? zz / 2 - seq->num_tokens : 0;
+    }
+    memmove(seq->tokens + keep, seq->tokens, seq->num_tokens * sizeof(int));
+    memcpy(seq->tokens, previous->tokens + previous->num_tokens - keep, keep * sizeof(int));
+    seq->num_tokens += keep;
+}
+
+// The prefix cache. When a sequence finishes, its blocks stay on in an entry with
+// its history, and a later sequence whose history starts with the same tokens, like the
+// next turn of a conversation or a prompt with the same preamble, shares the blocks of
+// what they have in common and only runs the rest through the network. The entries hold
+// up to max_prefix_blocks blocks, and the least recently used ones are dropped to stay
+// within that, or when a sequence needs their blocks.
+#define MAX_PREFIXES 256
+
+typedef struct {
+    int* tokens;
+    int len;
+    int* blocks;
+    long long last_used;
+} Prefix;
+
+Prefix prefixes[MAX_PREFIXES];
+int num_prefixes;
+int prefix_blocks, max_prefix_blocks;
+long long prefix_clock;
+
+// The bytes one position takes in the caches of every loaded model
+size_t position_bytes() {
+    size_t bytes = 2 * sizeof(float) * target_model.nlayer * target_model.local_dim;
+    if (speculate) bytes += 2 * sizeof(float) * draft_model.nlayer * draft_model.local_dim;
+    return bytes;
+}
+
+// How many tokens a and b start with in common, looking at no more than n
+int common_prefix(int* a, int* b, int n) {
+    int len = 0;
+    while (len < n && a[len] == b[len]) {
+        len++;
+    }
+    return len;
+}
+
+void drop_prefix(int e) {
+    int n = (prefixes[e].len + KV_BLOCK - 1) / KV_BLOCK;
+    LOOP(i, n) {
+        drop_block(prefixes[e].blocks[i]);
+    }
+    prefix_blocks -= n;
+    free(prefixes[e].blocks);
+    free(prefixes[e].tokens);
+    prefixes[e] = prefixes[--num_prefixes];
+}
+
+int lru_prefix() {
+    int lru = 0;
+    LOOP(e, num_prefixes) {
+        if (prefixes[e].last_used < prefixes[lru].last_used) lru = e;
+    }
+    return lru;
+}
+
+// Whether n blocks are free, once cached prefixes have been dropped for them if need be
+bool make_room(int n) {
+    while (num_free_blocks < n && num_prefixes) {
+        drop_prefix(lru_prefix());
+    }
+    return num_free_blocks >= n;
+}
+
+// Start seq off from the longest cached prefix of its history. At least its last
+// token still goes through the network, since its logits are what gets sampled.
+void reuse_prefix(Sequence* seq) {
+    int best = -1, best_len = 0;
+    LOOP(e, num_prefixes) {
+        int n = prefixes[e].len < seq->num_tokens - 1 ? prefixes[e].len : seq->num_tokens - 1;
+        int len = common_prefix(prefixes[e].tokens, seq->tokens, n);
+        if (len > best_len) {
+            best = e;
+            best_len = len;
+        }
+    }
+    if (best < 0) return;
+    share_blocks(seq, prefixes[best].blocks, best_len);
+    prefixes[best].last_used = ++prefix_clock;
+    seq->processed[0] = seq->processed[1] = best_len;
+}
+
+// Keep the history of a finished sequence, as far as every cache has it
+void store_prefix(Sequence* seq) {
+    int len = seq->processed[0];
+    if (speculate && seq->processed[1] < len) len = seq->processed[1];
+    int size = (len + KV_BLOCK - 1) / KV_BLOCK;
+    if (!len || size > max_prefix_blocks) return;
+    // Once the ring has wrapped around the start of the history is gone
+    if (seq->offset + seq->num_tokens + speculate > zz) return;
+
+    // An entry this history extends is of no more use, and if an entry
+    // extends this history there is nothing to add
+    LOOP(e, num_prefixes) {
+        int n = prefixes[e].len < len ? prefixes[e].len : len;
+        int common = common_prefix(prefixes[e].tokens, seq->tokens, n);
+        if (common == len) {
+            prefixes[e].last_used = ++prefix_clock;
+            return;
+        }
+        if (common == prefixes[e].len) {
+            drop_prefix(e--);
+        }
+    }
+    while (num_prefixes && (num_prefixes == MAX_PREFIXES || prefix_blocks + size > max_prefix_blocks)) {
+        drop_prefix(lru_prefix());
+    }
+
+    Prefix* entry = prefixes + num_prefixes;
+    entry->tokens = malloc(len * sizeof(int));
+    memcpy(entry->tokens, seq->tokens, len * sizeof(int));
+    entry->len = len;
+    entry->blocks = malloc(size * sizeof(int));
+    LOOP(i, size) {
+        entry->blocks[i] = seq->blocks[i];
+        block_refs[seq->blocks[i]]++;
+    }
+    entry->last_used = ++prefix_clock;
+    prefix_blocks += size;
+    num_prefixes++;
+}
+
+// A fork shares its prompt with its parent and starts with processed set to all of it
+// but the last token, and once the parent has run that far it shares the parent's
+// blocks of those positions. The last token goes through the network once more, so
+// the fork has logits of its own to sample its first token from, from its own random
+// stream. A parent that is done may have given its blocks back already, so then the
+// fork starts over as a sequence of its own.
+bool forkable(Sequence* seq) {
+    Sequence* parent = seq->parent;
+    return !parent || parent->done || (!parent->swapped && parent->processed[0] >= seq->processed[0]);
+}
+
+void fork_sequence(Sequence* seq) {
+    share_blocks(seq, seq->parent->blocks, seq->processed[0]);
+}
+
+// How many of the last rows of every sequence a step of m needs the logits of
+int last_rows(Model* m) {
+    return m == &target_model && speculate ? speculate + 1 : 1;
+}
+
+// The activations are planned once instead of taken from the pool one after another.
+// This is the dataflow of forward, one entry per operation: the activation it writes
+// and the ones it reads. Every layer runs the same operations and only the residual
+// stream lives from one layer into the next, so a single layer stands in for all.
+typedef struct {
+    int out, in, in2;
+} Operation;
+
+const Operation dataflow[] = {
+    {ACT_LINE, -1, -1},             // embeddings
+    {ACT_LN1, ACT_LINE, -1},        // first LayerNorm, in the first layer the same kernel
+    {ACT_QKV, ACT_LN1, -1},         // keys, queries and values, into the cache
+    {ACT_ATT, ACT_QKV, -1},         // attention
+    {ACT_LINE, ACT_ATT, ACT_LINE},  // its projection, added to the residual stream
+    {ACT_LN2, ACT_LINE, -1},        // second LayerNorm
+    {ACT_FC, ACT_LN2, -1},          // up projection and GELU
+    {ACT_LINE, ACT_FC, ACT_LINE},   // down projection, added to the residual stream
+    {ACT_LAST, ACT_LINE, -1},       // the last rows of every sequence
+    {ACT_LN_F, ACT_LAST, -1},       // final LayerNorm
+    {ACT_LOGITS, ACT_LN_F, -1},     // logits
+};
+
+#define NUM_OPERATIONS (int)(sizeof(dataflow) / sizeof(dataflow[0]))
+
+// The heads and the MLP only have the columns of this GPU, the residual stream is whole
+int activation_cols(Model* m, int a) {
+    return a == ACT_QKV ? 3 * m->local_dim : a == ACT_ATT ? m->local_dim : a == ACT_FC ? 4 * m->local_dim
+         : a == ACT_LOGITS ? 5e4 : m->dim;
+}
+
+// The bytes activation a of m takes in the largest step, rounded to keep every
+// activation aligned. From the last rows on there are at most last_rows per sequence.
+size_t activation_bytes(Model* m, int a) {
+    size_t rows = a >= ACT_LAST ? max_batch * last_rows(m) : max_rows;
+    return (rows * activation_cols(m, a) * sizeof(float) + 255) & ~(size_t)255;
+}
+
+// The most elements any GEMM of m reads, which bounds what cuBLAS rounds to 16 bits
+size_t gemm_input_size(Model* m) {
+    static const int inputs[] = {ACT_LN1, ACT_ATT, ACT_LN2, ACT_FC, ACT_LN_F};
+    size_t size = 0;
+    LOOP(i, (int)(sizeof(inputs) / sizeof(inputs[0]))) {
+        if (activation_bytes(m, inputs[i]) > size) size = activation_bytes(m, inputs[i]);
+    }
+    return size / sizeof(float);
+}
+
+// Give every activation of m its offset in the pool and return how large the pool has
+// to be. An activation is alive from the operation that first writes it to the last
+// one that reads it, and two that are alive at the same time must not overlap. They
+// are placed largest first, each at the lowest offset past everything in its way.
+// For GPT-2 the peak is the residual stream next to the up projection and its
+// input, six rows of dim in all, the same for any number of layers.
+size_t plan_activations(Model* m) {
+    int first[NUM_ACTS], last[NUM_ACTS];
+    bool placed[NUM_ACTS] = {0};
+    LOOP(a, NUM_ACTS) {
+        first[a] = -1;
+    }
+    LOOP(o, NUM_OPERATIONS) {
+        const Operation* op = dataflow + o;
+        if (first[op->out] < 0) first[op->out] = o;
+        last[op->out] = o;
+        if (op->in >= 0) last[op->in] = o;
+        if (op->in2 >= 0) last[op->in2] = o;
+    }
+
+    size_t size = 0;
+    LOOP(n, NUM_ACTS) {
+        int a = -1;
+        LOOP(b, NUM_ACTS) {
+            if (!placed[b] && (a < 0 || activation_bytes(m, b) > activation_bytes(m, a))) a = b;
+        }
+        size_t offset = 0, bytes = activation_bytes(m, a);
+        for (bool moved = true; moved;) {
+            moved = false;
+            LOOP(b, NUM_ACTS) {
+                size_t end = m->plan[b] + activation_bytes(m, b);
+                if (placed[b] && first[b] <= last[a] && first[a] <= last[b] &&
+                    m->plan[b] < offset + bytes && offset < end) {
+                    offset = end;
+                    moved = true;
+                }
+            }
+        }
+        m->plan[a] = offset;
+        placed[a] = true;
+        if (offset + bytes > size) size = offset + bytes;
+    }
+    return size;
+}
+
+// Activation a of a step of m, with the given number of rows
+Matrix activation(Model* m, int a, int rows) {
+    Matrix out = {(float*)((char*)memory_gpu + m->plan[a]), rows, activation_cols(m, a)};
+    return out;
+}
+
+// Add the projection i of a into the residual stream line. With --tp every GPU only
+// has its part of the sum, so rank 0 adds its part, the bias and the residual, and
+// the others overwrite line with just their part, which the all-reduce then sums.
+// It leaves the same line on every GPU, so they all go on to sample the same tokens.
+void project(Matrix a, int i, Matrix line) {
+    linear(a, i, tp_rank ? EPILOGUE_NONE : EPILOGUE_BIAS_RESIDUAL, line);
+    if (tp_ranks > 1) allReduceCUDA(line);
+}
+
+// Queue the copy of offloaded layer i into its slot
+void fetch_layer(int i) {
+    int s = i % offload_slots;
+    cudaMemcpyAsync(offload.device + s * offload.layer_bytes, offload.host + i * offload.layer_bytes,
+                    offload.layer_bytes, cudaMemcpyHostToDevice, offload.stream);
+    cudaEventRecord(offload.loaded[s], offload.stream);
+}
+
+// Push the rows of a step through model m and return the logits of the last rows
+// of every sequence, last of them each. Positions, slots and tokens are only read
+// on the device, and every activation has its place in the pool, so the launches
+// depend on nothing but rows and count. With top the LM head also keeps the
+// candidates sampleTopCUDA draws from.
+Matrix forward(Model* m, int rows, int count, int last, bool top) {
+    Matrix d_line = activation(m, ACT_LINE, rows);
+
+    // Offloaded layers only start copying once the step before is done with every
+    // slot, so that a step always makes the same copies and can go into a graph
+    bool streamed = m == &target_model && offload_slots;
+    if (streamed) {
+        cudaEventRecord(offload.start, compute_stream);
+        cudaStreamWaitEvent(offload.stream, offload.start, 0);
+        LOOP(i, (offload_slots < m->nlayer ? offload_slots : m->nlayer)) {
+            fetch_layer(i);
+        }
+    }
+
+    // Start the transformer neural network inference.
+    LOOP(i, m->nlayer) {  // Lynn loop
+        char range[32];
+        snprintf(range, sizeof(range), "%slayer %d", m == &draft_model ? "draft " : "", i);
+        rangePushCUDA(range);
+
+        // This layer's weights are at this offset, or in its slot once they are there
+        layer_weights_GPU = m->weights + 12 * i;
+        if (streamed) {
+            cudaStreamWaitEvent(compute_stream, offload.loaded[i % offload_slots], 0);
+            layer_weights_GPU = offload.slots[i % offload_slots];
+        }
+
+        // The first LayerNorm of the first layer comes with the embeddings
+        Matrix d_ln = activation(m, ACT_LN1, rows);
+        if (i) {
+            LayerNorm(d_line, 4, d_ln);
+        } else {
+            embeddingsLayerNormBatchCUDA(d_line, d_ln, m->wte, m->wpe, layer_weights_GPU[5], layer_weights_GPU[4],
+                                         d_tokens, d_batch);
+        }
+
+        // Compute the keys, queries, and values all at once with a big multiply
+        Matrix d_qkv = Linear(d_ln, 0, activation(m, ACT_QKV, rows));
+
+        // Append the new keys and values to this layer's part of the cache blocks
+        float *k_layer = kv_cache + m->kv_offset + (size_t)i * 2 * KV_BLOCK * m->local_dim;
+        float *v_layer = k_layer + KV_BLOCK * m->local_dim;
+        kvCacheBatchCUDA(d_qkv, k_layer, v_layer, d_batch, zz, KV_BLOCK, block_floats);
+
+        // Every head of every sequence attends over its own blocks in a single
+        // fused launch, writing its 64 columns of the result directly
+        Matrix result = activation(m, ACT_ATT, rows);
+        attentionBatchCUDA(d_qkv, k_layer, v_layer, d_batch, count, zz, KV_BLOCK, block_floats, window, result);
+
+        // Residual connection, which the projection adds as it writes its output
+        project(result, 2, d_line);
+
+        // Activation function and residual connection
+        Matrix d_fc = linear(LayerNorm(d_line, 6, activation(m, ACT_LN2, rows)), 8, EPILOGUE_BIAS_GELU,
+                             activation(m, ACT_FC, rows));
+        project(d_fc, 10, d_line);
+
+        // The slot takes the layer after the next few as soon as this one is done with it
+        if (streamed && i + offload_slots < m->nlayer) {
+            cudaEventRecord(offload.released[i % offload_slots], compute_stream);
+            cudaStreamWaitEvent(offload.stream, offload.released[i % offload_slots], 0);
+            fetch_layer(i + offload_slots);
+        }
+        rangePopCUDA();
+    }
+
+    // Only the last rows of each sequence are needed from here on
+    rangePushCUDA(m == &draft_model ? "draft lm head" : "lm head");
+    Matrix out = activation(m, ACT_LAST, count * last);
+    lastRowsCUDA(d_line, d_batch, last, out);
+
+    // Reset layer weights so we can do the last layer norm
+    layer_weights_GPU = m->weights;
+    out = LayerNorm(out, 12 * m->nlayer, activation(m, ACT_LN_F, count * last));
+
+    // And finally compute the output logits of every sequence in one multiply, or for
+    // a few rows in a single pass over wte
+    Matrix logits = activation(m, ACT_LOGITS, count * last);
+    if (count * last <= LM_HEAD_ROWS) {
+        lmHeadCUDA(out, m->wte, d_batch, top ? &sampler : NULL, logits);
+    } else {
+        matmul_t_fast(out, m->wte, logits);
+    }
+    rangePopCUDA();
+    return logits;
+}
+
+// All the launches of a step, up to sampling, whose tokens stay on the device. The target
+// model samples the next token of every sequence, or with a draft model checks the
+// proposals, or with --beam finds the likeliest next tokens. The draft model samples
+// proposal j and keeps the logits it drew it from.
+void decode(Model* m, int rows, int count, int j) {
+    if (m == &draft_model) {
+        Matrix logits = forward(m, rows, count, 1, false);
+        sampleCUDA(logits, d_batch, sampler, NULL);
+        cudaMemcpyAsync(proposals.dat + (size_t)j * proposals.rows * proposals.cols, logits.dat,
+                        (size_t)count * logits.cols * sizeof(float), cudaMemcpyDeviceToDevice, compute_stream);
+    } else if (speculate) {
+        Matrix logits = forward(m, rows, count, speculate + 1, false);
+        speculateCUDA(logits, proposals, d_tokens, d_batch, sampler, speculate, NULL);
+    } else if (beam_width) {
+        beamCandidatesCUDA(forward(m, rows, count, 1, false), beam_width);
+    } else {
+        // A small top-k only needs the few logits of every block that the LM head kept
+        bool top = sampler.top_k > 0 && sampler.top_k <= LM_HEAD_TOPK && count <= LM_HEAD_ROWS;
+        Matrix logits = forward(m, rows, count, 1, top);
+        if (top) {
+            sampleTopCUDA(count, d_batch, sampler, NULL);
+        } else {
+            sampleCUDA(logits, d_batch, sampler, NULL);
+        }
+        if (n_best) logProbCUDA(logits);
+    }
+}
+
+// Queue a step of model m that pushes the new tokens of every sequence through as
+// one stack of rows, so that every layer runs a single GEMM for the whole batch.
+// What decode returns, one token per sequence, or when the target is checking
+// proposals, how many it accepted and the token after them, arrives in the next
+// of the staging returned once its done event fires.
+Staging* launch(Model* m, Sequence** seqs, int count, int j) {
+    // Everything before processed already has its keys and values in the cache,
+    // so only the new tokens go through the network. On the first step of a
+    // sequence that is its whole prompt, or with --prefill-chunk the next part of
+    // it, afterwards it is one token, or the proposals on top of it when
+    // speculating. A token sampled by the last step that has not been read back
+    // yet is taken from the device.
+    Staging* st = staging + num_steps++ % 2;
+    *st->batch = (Batch){count};
+    int rows = 0;
+    LOOP(s, count) {
+        Sequence* seq = seqs[s];
+        int processed = seq->processed[m->id];
+        int pending = seq->pending != 0;
+        st->batch->first_row[s] = rows;
+        st->batch->pos[s] = seq->offset + processed;
+        memcpy(st->batch->blocks[s], seq->blocks, sizeof(seq->blocks));
+        st->batch->sequence[s] = seq->id;
+        st->batch->draw[s] = m == &draft_model ? DRAW_DRAFT | (seq->generated + j) : seq->generated + pending;
+        st->batch->temperature[s] = seq->temperature;
+        int take = seq->num_tokens - processed;
+        if (prefill_chunk && take > prefill_chunk) take = prefill_chunk;
+        memcpy(st->tokens + rows, seq->tokens + processed, take * sizeof(int));
+        rows += take;
+        if (pending) st->tokens[rows++] = -seq->pending;
+        seq->processed[m->id] = processed + take + pending;
+        st->partial[s] = processed + take < seq->num_tokens;
+        seq->pending = st->partial[s] ? 0 : s + 1;
+    }
+    st->batch->first_row[count] = rows;
+    cudaMemcpyAsync(d_batch, st->batch, (char*)(st->tokens + rows) - (char*)st->batch, cudaMemcpyHostToDevice,
+                    compute_stream);
+
+    // When every sequence brings the same number of rows as in a decode step, the
+    // launches of a step are the same each time, down to the pool addresses. Such
+    // a step is captured into a graph the second time its batch size comes up, once
+    // the first has set up the GEMM plans and scratch buffers outside of the capture,
+    // and replayed from then on, which costs one launch instead of several per kernel
+    // of every layer.
+    int last = last_rows(m);
+    bool replay = false;
+    rangePushCUDA(rows == count * last ? "decode step" : "prefill step");
+    if (use_graphs && rows == count * last && m->steps[j][count]++) {
+        if (!m->graphs[j][count]) {
+            cudaGraph_t graph;
+            cudaStreamBeginCapture(compute_stream, cudaStreamCaptureModeGlobal);
+            decode(m, rows, count, j);
+            if (cudaStreamEndCapture(compute_stream, &graph) != cudaSuccess ||
+                cudaGraphInstantiateWithFlags(&m->graphs[j][count], graph, 0) != cudaSuccess) {
+                fprintf(stderr, "Capturing a CUDA graph failed, running without: %s\n",
+                        cudaGetErrorString(cudaGetLastError()));
+                use_graphs = false;
+            }
+            cudaGraphDestroy(graph);
+        }
+        replay = use_graphs;
+    }
+    if (replay) {
+        cudaGraphLaunch(m->graphs[j][count], compute_stream);
+    } else {
+        decode(m, rows, count, j);
+    }
+    rangePopCUDA();
+
+    // Only the sampled tokens ever come back, with their log-probabilities if asked for
+    int n = (beam_width ? beam_width : last > 1 ? 2 : 1) * count;
+    sampledCUDA(st->next, n);
+    if (n_best || beam_width) sampledLogProbsCUDA(st->log_probs, n);
+    cudaEventRecord(st->done, compute_stream);
+    return st;
+}
+
+// Wait for the step of st and return what it sampled
+int* finish(Staging* st) {
+    cudaEventSynchronize(st->done);
+    return st->next;
+}
+
+// Run a step of m and copy what it sampled into next
+void step(Model* m, Sequence** seqs, int count, int j, int* next) {
+    int* sampled = finish(launch(m, seqs, count, j));
+    memcpy(next, sampled, (last_rows(m) > 1 ? 2 : 1) * count * sizeof(int));
+    LOOP(s, count) {
+        seqs[s]->pending = 0;
+    }
+}
+
+// Send all of text to the client of seq. Once that fails the client is gone, and
+// the sequence ends with its next token.
+void send_client(Sequence* seq, const char* text) {
+    for (size_t sent = 0, len = strlen(text); seq->client >= 0 && sent < len;) {
+        ssize_t n = send(seq->client, text + sent, len - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+        } else {
+            close(seq->client);
+            seq->client = -1;
+            seq->hung_up = true;
+        }
+    }
+}
+
+// A piece of the response as a server-sent event, with the text as a JSON string
+void send_text(Sequence* seq, const char* text) {
+    char event[6 * strlen(text) + 32];
+    char* out = event + sprintf(event, "data: {\"text\": \"");
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            *out++ = '\\';
+            *out++ = *c;
+        } else if (*c < 32) {
+            out += sprintf(out, "\\u%04x", *c);
+        } else {
+            *out++ = *c;
+        }
+    }
+    strcpy(out, "\"}\n\n");
+    send_client(seq, event);
+}
+
+// The last event of a response, with how long it took, and the end of the connection
+void finish_client(Sequence* seq, double end) {
+    char event[200];
+    snprintf(event, sizeof(event), "event: done\ndata: {\"tokens\": %d, \"seconds\": %f, \"first_token\": %f}\n\n",
+             seq->generated, end - seq->start, seq->first_token - seq->start);
+    send_client(seq, event);
+    if (seq->client >= 0) close(seq->client);
+    seq->client = -1;
+}
+
+// Send text to the client, print it straight away, or keep it for the end in the response
+void append_text(Sequence* seq, char* text) {
+    if (seq->client >= 0 || seq->hung_up) {
+        send_text(seq, text);
+    } else if (seq->stream) {
+        printf("%s", text);
+        fflush(stdout);
+    } else {
+        seq->response = realloc(seq->response, seq->response_len + strlen(text) + 1);
+        strcpy(seq->response + seq->response_len, text);
+        seq->response_len += strlen(text);
+    }
+}
+
+// If the history is too long, then purge by half.
+// The caches are indexed by position, so the kept half has to be re-encoded,
+// which makes the next step as slow as a prompt of that length. The blocks
+// past it are given back until the history grows into them again.
+void purge(Sequence* seq) {
+    fprintf(stderr, "\n----Context of %d tokens full, re-encoding the last %d of them----\n",
+            seq->num_tokens, seq->num_tokens - zz / 2);
+    memmove(seq->tokens, seq->tokens + zz / 2, (seq->num_tokens - zz / 2) * sizeof(int));
+    seq->num_tokens -= zz / 2;
+    seq->processed[0] = seq->processed[1] = 0;
+    release_blocks(seq, seq->num_tokens / KV_BLOCK + 1);
+}
+
+// A round of speculation writes speculate positions past the history, which have to
+// be in the context, so a history they would run past is purged before the round
+void fit_proposals(Sequence* seq) {
+    if (speculate && !sliding && seq->num_tokens + speculate > zz) {
+        purge(seq);
+    }
+}
+
+// With --window nothing is re-encoded, the oldest zz tokens are only dropped from
+// the history once the window has long moved past them
+void slide(Sequence* seq) {
+    memmove(seq->tokens, seq->tokens + zz, (seq->num_tokens - zz) * sizeof(int));
+    seq->num_tokens -= zz;
+    seq->offset += zz;
+    seq->processed[0] -= zz;
+    if (speculate) seq->processed[1] -= zz;
+}
+
+// Add a sampled token to the history of seq. Returns true once it is a newline,
+// which is the end of the conversation, the response has reached its max_tokens,
+// or its client has hung up.
+bool append(Sequence* seq, int token) {
+    if (sliding && seq->num_tokens >= 2 * zz) {
+        slide(seq);
+    } else if (!sliding && seq->num_tokens == zz) {
+        purge(seq);
+    }
+    // Write it to the history buffer
+    seq->tokens[seq->num_tokens++] = token;
+    if (!seq->generated++) seq->first_token = get_wall_time();
+    if (seq->token_times) seq->token_times[seq->generated - 1] = get_wall_time();
+    // Nobody is reading the rest of the response
+    if (seq->hung_up) return true;
+
+    // A benchmark always runs to max_tokens, and only reports at the end
+    bool newline = bpe[bpe_offset[token]] == 10 && !benchmark;
+    if (newline || seq->generated == seq->max_tokens) {
+        if (benchmark) return true;
+        if (!newline) {
+            append_text(seq, bpe + bpe_offset[token]);
+        }
+        // The candidates are printed together once they are all done
+        if (n_best) return true;
+        double end = get_wall_time();
+        if (seq->client >= 0) {
+            finish_client(seq, end);
+            return true;
+        }
+        if (!seq->stream) {
+            printf("\nHuman: %s\nAI: %s", seq->prompt, seq->response);
+        }
+        printf("\n\n----Seconds to respond: %f----\n", end - seq->start);
+        printf("----Seconds to first token: %f, then %f per token----\n", seq->first_token - seq->start,
+               seq->generated > 1 ? (end - seq->first_token) / (seq->generated - 1) : 0);
+        return true;
+    }
+
+    // Otherwise print it and keep generating along
+    append_text(seq, bpe + bpe_offset[token]);
+    return false;
+}
 
-// A matrix is just a 2d vector of floats with rows and columns.
-Matrix NewMatrix(int rows, int cols, int reuse) {
-    tmp = 4 * rows * cols;
-    float *a = malloc(tmp);
-    memset(a, 0, tmp * reuse);
-    Matrix out = {a, rows, cols};
-    return out;
+// With a draft model every step of the scheduler is a round of speculation. The
+// draft model proposes speculate tokens for every sequence, one step each, and the
+// target model checks all of them in a single step over speculate + 1 rows per
+// sequence. A decode step of the target is bound by reading its weights, so that
+// costs about as much as producing one token, and every accepted proposal is a token
+// gained. Whatever the caches hold past the accepted tokens is overwritten later.
+void speculate_step(Sequence** seqs, int count) {
+    int base[MAX_BATCH], next[2 * MAX_BATCH];
+    LOOP(s, count) {
+        base[s] = seqs[s]->num_tokens;
+    }
+
+    LOOP(j, speculate) {
+        step(&draft_model, seqs, count, j, next);
+        LOOP(s, count) {
+            seqs[s]->tokens[seqs[s]->num_tokens++] = next[s];
+        }
+    }
+    step(&target_model, seqs, count, 0, next);
+
+    LOOP(s, count) {
+        Sequence* seq = seqs[s];
+        int accepted = next[2 * s], tokens[MAX_DRAFT + 1];
+        memcpy(tokens, seq->tokens + base[s], accepted * sizeof(int));
+        tokens[accepted] = next[2 * s + 1];
+        num_proposed += speculate;
+        num_accepted += accepted;
+
+        // Take the proposals back out and append the accepted ones like any other token.
+        // The draft model never saw its last proposal.
+        seq->num_tokens = base[s];
+        seq->processed[0] = base[s] + accepted;
+        seq->processed[1] = base[s] + (accepted < speculate ? accepted : speculate - 1);
+        LOOP(j, accepted + 1) {
+            if (!seq->done) seq->done = append(seq, tokens[j]);
+        }
+    }
 }
 
-Matrix NewMatrixGPU(int rows, int cols, int reuse) {
-    float* a = memory_gpu;
-    memory_gpu += tmp = 4 * rows * cols;
-    cudaMemset(a, 0, tmp * reuse);
-    Matrix out = {a, rows, cols};
-    return out;
+// Append what the step of st sampled to the sequences it ran, unless they are done
+// or were only part of the way through their prompt
+void collect(Staging* st, Sequence** seqs, int count) {
+    int* next = finish(st);
+    LOOP(s, count) {
+        if (seqs[s]->done || st->partial[s]) continue;
+        if (n_best) seqs[s]->log_prob += st->log_probs[s];
+        seqs[s]->done = append(seqs[s], next[s]);
+    }
 }
 
-// Helper function for timing
-double get_wall_time() {
-    struct timeval time;
-    gettimeofday(&time, NULL);
-    double wall_time = (double)time.tv_sec + (double)time.tv_usec * 1e-6;
-    return wall_time;
+// How many rows seq brings to the next step: its pending token, or what is left of
+// its prompt, at most prefill_chunk of it, and the proposals on top
+int next_rows(Sequence* seq) {
+    int rows = seq->pending ? 1 : seq->num_tokens - seq->processed[0];
+    if (prefill_chunk && rows > prefill_chunk) rows = prefill_chunk;
+    return rows + speculate;
 }
 
-Matrix sum(Matrix d_a) {    
-    Matrix d_out = NewMatrixGPU(d_a.rows, d_a.cols, 1);
-    sumCUDA(d_a, d_out);
-    broadcastCUDA(d_out, 0);
-    return d_out;
+// Make the blocks the next step of seq writes to its own, from the first position
+// either model has yet to cache up to its last row, see own_blocks
+int own_step_blocks(Sequence* seq, bool dry_run) {
+    int first = speculate && seq->processed[1] < seq->processed[0] ? seq->processed[1] : seq->processed[0];
+    return own_blocks(seq, seq->offset + first, seq->offset + seq->processed[0] + next_rows(seq), dry_run);
 }
 
-// Transpose a matrix flipping the rows and columns
-Matrix transpose_util(Matrix a) {
-    Matrix out = NewMatrix(a.cols, a.rows, 1);
-    transposeCUDA_util(a, out);
-    return out;
+// How many blocks the next step of all of seqs takes at most
+int step_blocks(Sequence** seqs, int count) {
+    int n = 0;
+    LOOP(s, count) {
+        n += own_step_blocks(seqs[s], true);
+    }
+    return n;
 }
 
-Matrix tranpose(Matrix a) {
-    Matrix out = NewMatrixGPU(a.cols, a.rows, 1);
-    transposeCUDA(a, out);
-    return out;
+// Set seq up to join the batch: a fork shares the blocks of its parent, a sequence
+// that was swapped out gets its blocks back, and any other starts off from the longest
+// cached prefix of its history. Returns false, leaving seq as it was, if there are not
+// enough blocks for that and its first step.
+bool admit(Sequence* seq) {
+    if (seq->parent && seq->parent->done) {
+        seq->parent = NULL;
+        seq->processed[0] = 0;
+    }
+    fit_proposals(seq);
+    int processed[2] = {seq->processed[0], seq->processed[1]};
+    if (seq->parent) {
+        fork_sequence(seq);
+    } else if (!seq->swapped) {
+        reuse_prefix(seq);
+    }
+    if (!make_room(seq->num_swapped + own_step_blocks(seq, true))) {
+        if (!seq->swapped) release_blocks(seq, 0);
+        seq->processed[0] = processed[0];
+        seq->processed[1] = processed[1];
+        return false;
+    }
+    seq->parent = NULL;
+    if (seq->swapped) swap_in(seq);
+    own_step_blocks(seq, false);
+    return true;
 }
 
-Matrix matmul_t_fast(Matrix a, Matrix b) {
-  Matrix out = NewMatrixGPU(a.rows, b.rows, !token_processed_upto);
-  matMulCUDA(a.dat + token_processed_upto * a.cols, num_total_tokens - token_processed_upto, a.cols, b.dat, b.rows, b.cols, out.dat + token_processed_upto * b.rows);
-  return addCUDA(NewMatrixGPU(out.rows, out.cols, 1), out);
+// A request that came in over HTTP, with the settings it asked for, -1 where it
+// asked for none. The thread that read it queues it for the engine, which owns it
+// from then on. seq comes first, so the sequence of a request is the request.
+typedef struct Request {
+    Sequence seq;
+    _Atomic(struct Request*) next;
+    char* prompt;
+    int client;
+    float temperature;
+    int max_tokens;
+    long long seed;
+    double arrived;
+} Request;
+
+// The queue between the threads reading requests and the engine, an intrusive MPSC
+// queue (Vyukov's) that needs no lock. A producer swaps itself in as the head, then
+// links the old head to itself, and the engine takes requests from the tail. Until
+// that link is made the engine sees the queue end before the new request, so it
+// only waits on ready, which every producer posts once it is linked, when it has
+// nothing else to do.
+typedef struct {
+    _Atomic(Request*) head;
+    Request* tail;
+    Request stub;
+    sem_t ready;
+} Queue;
+
+Queue requests;
+
+// The requests that are open, from the connection being accepted until the engine
+// releases its sequence or it is rejected. Past MAX_OPEN_REQUESTS a connection is
+// turned away at once, and a client has REQUEST_SECONDS to send its request, so
+// clients that connect and never send cannot pile up threads.
+#define MAX_OPEN_REQUESTS 256
+#define REQUEST_SECONDS 10
+atomic_int open_requests;
+
+void push_request(Queue* q, Request* r) {
+    atomic_store_explicit(&r->next, NULL, memory_order_relaxed);
+    Request* prev = atomic_exchange_explicit(&q->head, r, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, r, memory_order_release);
 }
 
-// Take a slice out of a larger matrix and return a new matrix with the given shape
-Matrix slice(Matrix a, int b, int rows, int cols) {
-    Matrix out = {a.dat + b * rows, rows, cols};
-    return out;
+// The oldest request, or NULL if there is none that is linked in yet. The stub keeps
+// the queue from ever being empty, and goes back in once it is at the tail.
+Request* pop_request(Queue* q) {
+    Request* tail = q->tail;
+    Request* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (!next) {
+        if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) return NULL;
+        push_request(q, &q->stub);
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+        if (!next) return NULL;
+    }
+    q->tail = next;
+    return tail;
 }
 
-Matrix LayerNorm(Matrix d_a, int i) {
-    size_t size = d_a.rows * d_a.cols * sizeof(float);
-    Matrix d_b = addCUDA(d_a, divide_constCUDA(sum(d_a), -d_a.cols));
-    Matrix d_k = divide_constCUDA(sum(multiplyCUDA(addCUDA(NewMatrixGPU(d_b.rows, d_b.cols, 1), d_b), d_b)), d_b.cols - 1);
-    Matrix d_out = add_tileCUDA(multiply_tileCUDA(multiplyCUDA(addCUDA(NewMatrixGPU(d_b.rows, d_b.cols, 1), d_b), mat_isqrtCUDA(add_constCUDA(d_k, 1e-5), 0)), layer_weights_GPU[i + 1]), layer_weights_GPU[i]);
-    return d_out;
+// Turn a request into a sequence. A seed picks a random stream of its own, above
+// the ones the other conversations take in order, so a request with the same seed
+// draws the same random numbers every time.
+void start_request(Request* r) {
+    new_sequence(&r->seq, r->prompt, true);
+    r->seq.start = r->arrived;
+    r->seq.client = r->client;
+    r->seq.temperature = r->temperature > 0 ? r->temperature : 0;
+    if (r->max_tokens >= 0) r->seq.max_tokens = r->max_tokens;
+    if (r->seed >= 0) r->seq.id = (int)(1u << 31 | (unsigned)r->seed);
 }
 
-#define Linear(a, i) add_tileCUDA(matmul_t_fast(a, layer_weights_GPU[i + 1]), layer_weights_GPU[i])
+// The next sequence for serve to admit, or NULL if there is none yet. Those of a run
+// are the n of seqs, in order. With --serve they are the requests as they come in,
+// waited for when block is set, since then there is nothing else to do. A wakeup
+// for a request that was already taken only costs another look at the queue.
+Sequence* waiting_sequence(Sequence* seqs, int n, int* waiting, bool block) {
+    if (!serve_port) {
+        return *waiting < n ? seqs + (*waiting)++ : NULL;
+    }
+    Request* r;
+    while (!(r = pop_request(&requests)) && block) {
+        sem_wait(&requests.ready);
+    }
+    if (!r) return NULL;
+    start_request(r);
+    return &r->seq;
+}
 
-// Read a weight matrix out of the data file into memory
-Matrix read_matrix(int rows, int cols) {
-    rows += !rows;  // if rows == 0 then load at least one row
-    cols += !cols;  // if cols == 0 then load at least one col
+void release_request(Sequence* seq) {
+    Request* r = (Request*)seq;
+    free_sequence(seq);
+    free(r->prompt);
+    free(r);
+    atomic_fetch_sub(&open_requests, 1);
+}
 
-    Matrix a = NewMatrix(rows, cols, 1);
+// The scheduler works one step at a time. Before each step it admits waiting
+// sequences while the batch has room and there are cache blocks for them, and after
+// it retires the ones that just finished, so a short answer gives its blocks to the
+// next prompt right away instead of waiting on the longest one in the batch. A prompt
+// is encoded whole in its first step, so admission also stops once a step would
+// exceed zz rows. When the sequences grow past the blocks there are, the youngest of
+// them are swapped out to host memory, and they are the first to come back in.
+// With --prefill-chunk a long prompt, or a purged history, is encoded over several
+// steps instead, which keeps the steps short enough that the other sequences keep
+// decoding in between. Its samples are dropped until the last piece is through.
+//
+// Without speculation the host stays a step ahead of the device. Step i is queued
+// with the tokens of step i - 1 still on the device, its embedding lookup reads
+// them from there, and only then does the host wait for step i - 1 and detokenize
+// its tokens, while step i runs. A sequence that finished in step i - 1 has run
+// one step too many, whose token is dropped.
+//
+// With --serve this never returns. The sequences come from the queue of requests
+// and are freed once they retire, a step later than that, since the step they ran
+// one too many still refers to them until it is collected.
+void serve(Sequence* seqs, int n) {
+    Sequence *active[MAX_BATCH], *in_flight[MAX_BATCH], *retired[MAX_BATCH], *swapped[MAX_BATCH], *next = NULL;
+    int count = 0, waiting = 0, num_in_flight = 0, num_retired = 0, num_swapped = 0;
+    Staging* last = NULL;
+    num_proposed = num_accepted = 0;
+
+    for (;;) {
+        // A history that is full has to be purged before its next token goes in,
+        // which takes that token on the host, and so does swapping a sequence out,
+        // which may have to happen once the blocks run short
+        bool full = step_blocks(active, count) > num_free_blocks;
+        LOOP(s, count) {
+            full |= !sliding && active[s]->pending && active[s]->num_tokens == zz;
+        }
+        if (full && last) {
+            collect(last, in_flight, num_in_flight);
+            LOOP(s, num_in_flight) {
+                in_flight[s]->pending = 0;
+            }
+            last = NULL;
+        }
 
-    // It's already stored as a float on disk. Just load the bytes.
-    // (This assumes your machine is little endian)
-    size_t result = fread(a.dat, tmp, 1, fp);
-    if (result != 1) {
-        // Handle error, e.g., print an error message and exit
-        perror("Error reading matrix");
-        exit(EXIT_FAILURE);
-    }
+        LOOP(s, num_retired) {
+            release_request(retired[s]);
+        }
+        num_retired = 0;
+        free_swap_copies(false);
+        int kept = 0;
+        LOOP(s, count) {
+            if (active[s]->done) {
+                store_prefix(active[s]);
+                release_blocks(active[s], 0);
+                if (serve_port) retired[num_retired++] = active[s];
+            } else {
+                active[kept++] = active[s];
+            }
+        }
+        count = kept;
 
-    // Our matrix multiply assumes transposed weights.
-    return transpose_util(a);
-}
-
-// And now for something completely different: byte pair encoding
-// This function takes a single word and produces the tokenization of that word
-// We do this with an exponential-time algorithm that's very short:
-// for every token we know about, see if it fits in the first position.
-// If it does, see what the cost of tokenizing the rest of the word would be.
-// Return the first token that has the lowest overall cost.
-int best_outi;
-int fix(char* out) {
-    if (!*out) return 0;
-    int result = 1e9;
-    int best_i;
-    LOOP(i, 5e4) {
-        // if 1st char of the token is not \0 and if 1st part of out matches token
-        if (bpe[999 * i] && strncmp(bpe + 999 * i, out, tmp = strlen(bpe + 999 * i)) == 0) {
-            int sub_cost = fix(out + tmp) + i + 1e7;
-            if (sub_cost < result) {
-                result = sub_cost;
-                best_i = i;
+        // Every sequence needs the blocks its next step writes to, and the youngest go
+        // until the others have them. None of them has a token on the device then.
+        LOOP(s, count) {
+            fit_proposals(active[s]);
+        }
+        while (!make_room(step_blocks(active, count))) {
+            swap_out(active[--count]);
+            swapped[num_swapped++] = active[count];
+        }
+        LOOP(s, count) {
+            own_step_blocks(active[s], false);
+        }
+
+        int rows = 0;
+        LOOP(s, count) {
+            rows += next_rows(active[s]);
+        }
+        if (!next) next = waiting_sequence(seqs, n, &waiting, !count && !num_swapped);
+        for (;;) {
+            Sequence* seq = num_swapped ? swapped[num_swapped - 1] : next;
+            if (!seq || count == max_batch || (rows && rows + next_rows(seq) > zz) || !forkable(seq) || !admit(seq)) {
+                break;
+            }
+            rows += next_rows(seq);
+            active[count++] = seq;
+            if (seq == next) {
+                next = waiting_sequence(seqs, n, &waiting, false);
+            } else {
+                num_swapped--;
             }
         }
+        if (!count) break;
+
+        if (speculate) {
+            speculate_step(active, count);
+            continue;
+        }
+        Staging* st = launch(&target_model, active, count, 0);
+        if (last) {
+            collect(last, in_flight, num_in_flight);
+        }
+        memcpy(in_flight, active, count * sizeof(Sequence*));
+        num_in_flight = count;
+        last = st;
+    }
+    cudaStreamSynchronize(compute_stream);
+    free_swap_copies(true);
+
+    if (speculate) {
+        printf("----%d of %d proposed tokens accepted----\n", num_accepted, num_proposed);
     }
-    best_outi = best_i;
-    return result;
 }
 
-// Given the ability to byte-pair encode a single word, this encodes a sentence
-// by splitting it into individual words, and tokenizing each word separately
-int* tokenize(char* seq, /*INT*/ int* result) {
-    char out[1000];
-    int i = 0;
-    while (seq[i]) {
-        int j = i++;
-        while (47 < seq[i] && seq[i] < 58 || 64 < seq[i]) {
-            fflush(stdout);
-            i++;
+// A finished response of --n-best or --beam
+typedef struct {
+    char* text;
+    int tokens;
+    double log_prob;
+} Candidate;
+
+// The text of tokens from up to to of seq
+char* tokens_text(Sequence* seq, int from, int to) {
+    size_t len = 1;
+    for (int i = from; i < to; i++) {
+        len += strlen(bpe + bpe_offset[seq->tokens[i]]);
+    }
+    char* text = malloc(len);
+    text[0] = 0;
+    for (int i = from; i < to; i++) {
+        strcat(text, bpe + bpe_offset[seq->tokens[i]]);
+    }
+    return text;
+}
+
+// Beam search. Every step extends each beam by its beam_width likeliest next tokens,
+// and of all of those the likeliest go on, by the sum of the log-probabilities of their
+// tokens. A continuation that ends, with a newline, at max_tokens or with the context
+// full, is a candidate and takes a beam with it, so it is over after beam_width of them.
+// Of the continuations of a beam the likeliest goes on in it, and any other takes over
+// a beam that has none left, with a copy of the history of its parent and a share of
+// its blocks, which are only copied once one of them writes to them.
+int beam_search(char* prompt, Candidate* candidates) {
+    Sequence beams[MAX_BEAMS], *live[MAX_BEAMS];
+    LOOP(b, beam_width) {
+        new_sequence(beams + b, prompt, false);
+    }
+    int prompt_len = beams[0].num_tokens, num_live = 1, found = 0;
+    live[0] = beams;
+    reuse_prefix(beams);
+
+    while (found < beam_width) {
+        if (!make_room(step_blocks(live, num_live))) {
+            fprintf(stderr, "--beam=%d needs more KV cache blocks than --kv-cache has\n", beam_width);
+            exit(EXIT_FAILURE);
         }
-        strcpy(out, seq + j);
-        out[i - j] = 0;
-        fflush(stdout);
-        int k = 0;
-        while (out[k]) {
-            fix(out + k);
-            char* ntok = bpe + best_outi * 999;
-            k += strlen(ntok);
-            *result++ = best_outi;
+        LOOP(s, num_live) {
+            own_step_blocks(live[s], false);
+        }
+        Staging* st = launch(&target_model, live, num_live, 0);
+        finish(st);
+        LOOP(s, num_live) {
+            live[s]->pending = 0;
+        }
+        if (st->partial[0]) continue;
+
+        // Pick the likeliest of the continuations one after another
+        int parent[MAX_BEAMS], token[MAX_BEAMS], picks = beam_width - found;
+        double score[MAX_BEAMS];
+        bool taken[MAX_BEAMS * MAX_BEAMS] = {false};
+        LOOP(c, picks) {
+            int best = -1;
+            LOOP(i, num_live * beam_width) {
+                double v = live[i / beam_width]->log_prob + st->log_probs[i];
+                if (!taken[i] && (best < 0 || v > score[c])) {
+                    best = i;
+                    score[c] = v;
+                }
+            }
+            taken[best] = true;
+            parent[c] = best / beam_width;
+            token[c] = st->next[best];
+        }
+
+        // The ones that end become candidates, the first of every parent to go on keeps it
+        Sequence* into[MAX_BEAMS];
+        bool ends[MAX_BEAMS], kept[MAX_BEAMS] = {false}, busy[MAX_BEAMS] = {false};
+        LOOP(c, picks) {
+            Sequence* p = live[parent[c]];
+            bool newline = bpe[bpe_offset[token[c]]] == 10;
+            ends[c] = newline || p->generated + 1 == max_tokens || p->num_tokens + 1 == zz;
+            into[c] = NULL;
+            if (ends[c]) {
+                p->tokens[p->num_tokens] = token[c];
+                candidates[found++] = (Candidate){tokens_text(p, prompt_len, p->num_tokens + !newline),
+                                                  p->generated + 1, score[c]};
+            } else if (!kept[parent[c]]) {
+                kept[parent[c]] = true;
+                into[c] = p;
+                busy[p - beams] = true;
+            }
+        }
+
+        // A beam that keeps none of its continuations was no parent of the others
+        int spare = 0;
+        LOOP(c, picks) {
+            if (ends[c] || into[c]) continue;
+            while (busy[spare]) spare++;
+            Sequence *p = live[parent[c]], *f = beams + spare;
+            busy[spare] = true;
+            memcpy(f->tokens, p->tokens, p->num_tokens * sizeof(int));
+            f->num_tokens = p->num_tokens;
+            f->processed[0] = p->processed[0];
+            f->generated = p->generated;
+            share_blocks(f, p->blocks, p->processed[0]);
+            into[c] = f;
+        }
+        LOOP(b, beam_width) {
+            if (!busy[b]) release_blocks(beams + b, 0);
+        }
+
+        num_live = 0;
+        LOOP(c, picks) {
+            if (ends[c]) continue;
+            Sequence* seq = into[c];
+            seq->tokens[seq->num_tokens++] = token[c];
+            seq->generated++;
+            seq->log_prob = score[c];
+            live[num_live++] = seq;
         }
     }
-    return result;
+
+    LOOP(b, beam_width) {
+        free_sequence(beams + b);
+    }
+    return found;
 }
 
-void do_inference(double start, double end, double cpu_time_used, Matrix d_wpe, Matrix d_wte, Matrix *weights_gpu, int T, char *buf, int *output, int *d_output){
-    start = get_wall_time();
-    num_total_tokens = tokenize(buf, output) - output;
-    memory_gpu_top = memory_gpu;
-    token_processed_upto = 0;
-    cudaMemcpy(d_output, output, 2 * zz * sizeof(int), cudaMemcpyHostToDevice);
-
-    while (1) {  // Brian loop
-        // Reset the memory to the top of the original value
-        memory_gpu = memory_gpu_top;
-
-        // Compute the context window size as the next largest multiple of 32
-        T = num_total_tokens + 32 - num_total_tokens % 32;
-        // If the number is 0 mod 32, then we need to recompute everything bottom up
-        token_processed_upto *= !!(num_total_tokens % 32);
-
-        Matrix d_line = NewMatrixGPU(T, DIM, 1);
-
-        embeddingsCUDA(d_line, d_wte, d_wpe, d_output, num_total_tokens, DIM);
-
-        // Start the transformer neural network inference.
-        LOOP(i, NLAYER) {  // Lynn loop
-            // The layers on disk are stored by sorting alphabetically,
-            // because tensorflow makes no sense. We need to convert this to
-            // the correct order. For example, if there are 12 layers, we would
-            // have them on disk in order: 0 1 10 11 2 3 4 5 6 7 8 9
-            // which means we permute by the inverse: 0 1 4 5 6 7 8 9 10 11 2 3
-            int permute;
-            tmp = 0;
-            LOOP(j, 10) {
-                if (j == i) {
-                    permute = tmp;
-                }
-                tmp++;
-                LOOP(k, 10 * (j > 0)) {
-                    if (j * 10 + k < NLAYER && tmp++ && i == j * 10 + k) {
-                        permute = tmp;
-                    }
-                }
+int compare_candidates(const void* a, const void* b) {
+    double x = ((const Candidate*)a)->log_prob, y = ((const Candidate*)b)->log_prob;
+    return (x < y) - (x > y);
+}
+
+// Respond to prompt with several candidates, and print them the likeliest first. For
+// --n-best the first sequence runs the prompt through the network and the others are
+// forks of it, so the prompt is only encoded once and the responses decode as a batch.
+void serve_candidates(char* prompt) {
+    Candidate candidates[MAX_BATCH];
+    double start = get_wall_time();
+    int n = beam_width;
+    if (beam_width) {
+        n = beam_search(prompt, candidates);
+    } else {
+        Sequence seqs[MAX_BATCH];
+        LOOP(s, n_best) {
+            new_sequence(seqs + s, prompt, false);
+            if (s) {
+                seqs[s].parent = seqs;
+                seqs[s].processed[0] = seqs[s].num_tokens - 1;
             }
+        }
+        serve(seqs, n_best);
+        n = n_best;
+        LOOP(s, n) {
+            candidates[s] = (Candidate){strdup(seqs[s].response), seqs[s].generated, seqs[s].log_prob};
+            free_sequence(seqs + s);
+        }
+    }
 
-            // This layer's weights are at this offset
-            layer_weights_GPU = weights_gpu + 12 * permute;
-
-            // Compute the keys, queries, and values all at once with a big multiply
-            
-            Matrix d_qkv = tranpose(slice(Linear(LayerNorm(d_line, 4), 0), 0, T * 3, DIM));
-
-            // Make space for the output of the computation
-            Matrix result = NewMatrixGPU(DIM, T, 1);
-
-                LOOP(k, NHEAD) {
-                    // Split the qkv into each of the heads
-                    Matrix merge = tranpose(slice(d_qkv, k * 3, 64 * T, 3)),
-                        // perform the product of the queries and keys and then exponentiate
-                        a = trilCUDA(matmul_t_fast(tranpose(slice(merge, 0, 64, T)),
-                                            tranpose(slice(merge, T, 64, T))), T),
-                        // finally multiply the softmax output (a/sum(a)) with the values matrix
-                        out = tranpose(matmul_t_fast(divideCUDA(a, sum(a)), slice(merge, T * 2, 64, T)));
-                    // and copy the output to the proper location in the result matrix
-                    //memcpy(result.dat + 64 * T * k, out.dat, 64 * T * 4);
-                    cudaMemcpy(result.dat + 64 * T * k, out.dat, 64 * T * 4, cudaMemcpyDeviceToDevice);
-                }
+    qsort(candidates, n, sizeof(Candidate), compare_candidates);
+    LOOP(c, n) {
+        printf("\n----Candidate %d of %d, %d tokens, log-probability %f----\n%s\n", c + 1, n, candidates[c].tokens,
+               candidates[c].log_prob, candidates[c].text);
+        free(candidates[c].text);
+    }
+    printf("\n----Seconds to respond: %f----\n", get_wall_time() - start);
+}
+
+// Run every line of path as its own conversation
+void serve_file(char* path) {
+    FILE* prompts = fopen(path, "r");
+    if (prompts == NULL) {
+        perror("Error opening prompts");
+        exit(EXIT_FAILURE);
+    }
+
+    int n = 0, capacity = 16;
+    Sequence* seqs = malloc(capacity * sizeof(Sequence));
+    char line[1000];
+    double start = get_wall_time();
+    while (fgets(line, sizeof(line), prompts)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!line[0]) continue;
+        if (n == capacity) {
+            seqs = realloc(seqs, (capacity *= 2) * sizeof(Sequence));
+        }
+        new_sequence(seqs + n++, strdup(line), false);
+    }
+    fclose(prompts);
+
+    serve(seqs, n);
+
+    int generated = 0;
+    double first_tokens = 0;
+    LOOP(i, n) {
+        generated += seqs[i].generated;
+        first_tokens += seqs[i].first_token - seqs[i].start;
+        free(seqs[i].prompt);
+        free_sequence(seqs + i);
+    }
+    free(seqs);
+    double seconds = get_wall_time() - start;
+    printf("\n----%d prompts, %d tokens in %f seconds, %f tokens per second----\n",
+           n, generated, seconds, generated / seconds);
+    printf("----%f seconds to the first token on average----\n", first_tokens / n);
+}
 
-                // Residual connection
-                d_line = addCUDA(d_line, Linear(tranpose(result), 2));
+// What --bench runs, and for how many tokens unless --max-tokens says otherwise.
+// bench.c collects the JSON it prints from several runs.
+#define BENCH_PROMPT "The quick brown fox jumps over the lazy dog, and then"
+#define BENCH_TOKENS 64
 
-                // Activation function and residual connection
-                d_line = addCUDA(d_line, Linear(GELUCUDA(Linear(LayerNorm(d_line, 6), 8), 0), 10));
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// The p-th percentile of the n sorted values, by nearest rank
+double percentile(double* sorted, int n, double p) {
+    int rank = (int)ceil(p * n);
+    return n ? sorted[rank > 0 ? rank - 1 : 0] : 0;
+}
+
+// Time the tokenizer, then a warmup that sets up the GEMM plans and graphs, then
+// every batch size: as many copies of the prompt, each drawing from its own random
+// stream, all admitted at once. The time to first token is the mean over the batch,
+// the gaps between tokens are when they come back to the host, pooled over the batch.
+// The device memory is what is in use on the device at its highest, whoever uses it.
+void run_benchmark(char* model, double load_seconds) {
+    const int sizes[] = {1, 4, 16, 32};
+    if (!max_tokens) max_tokens = BENCH_TOKENS;
+    size_t free_mem, total_mem, least_free;
+    cudaMemGetInfo(&least_free, &total_mem);
+
+    int tokens[2 * 1024 + MAX_DRAFT + 1];
+    char prompt[] = BENCH_PROMPT "\n\n";
+    double start = get_wall_time();
+    LOOP(i, 100) {
+        tokenize(prompt, tokens);
+    }
+    double tokenize_seconds = (get_wall_time() - start) / 100;
+
+    printf("{\"backend\": \"gpu\", \"model\": \"%s\", \"seq_len\": %d, \"load_seconds\": %f, "
+           "\"tokenize_seconds\": %g, \"batches\": [", model, zz, load_seconds, tokenize_seconds);
+    Sequence seqs[MAX_BATCH];
+    double* times = malloc((size_t)MAX_BATCH * max_tokens * sizeof(double));
+    double* gaps = malloc((size_t)MAX_BATCH * max_tokens * sizeof(double));
+    bool first = true;
+    for (int b = 0; b < 1 + sizeof(sizes) / sizeof(*sizes); b++) {
+        int count = b ? sizes[b - 1] : 1;
+        if (count > max_batch) break;
+        LOOP(s, count) {
+            new_sequence(seqs + s, BENCH_PROMPT, false);
+            seqs[s].token_times = times + (size_t)s * max_tokens;
+            if (!b && max_tokens > 8) seqs[s].max_tokens = 8;
+        }
+        start = get_wall_time();
+        serve(seqs, count);
+        double seconds = get_wall_time() - start;
+        cudaMemGetInfo(&free_mem, &total_mem);
+        if (free_mem < least_free) least_free = free_mem;
+
+        int generated = 0, num_gaps = 0;
+        double first_tokens = 0;
+        LOOP(s, count) {
+            generated += seqs[s].generated;
+            first_tokens += seqs[s].first_token - seqs[s].start;
+            LOOP(t, seqs[s].generated - 1) {
+                gaps[num_gaps++] = seqs[s].token_times[t + 1] - seqs[s].token_times[t];
             }
+            free_sequence(seqs + s);
+        }
+        if (!b) continue;
+        qsort(gaps, num_gaps, sizeof(double), compare_doubles);
+        printf("%s{\"batch\": %d, \"tokens\": %d, \"seconds\": %f, \"tokens_per_second\": %f, "
+               "\"ttft_seconds\": %f, \"itl_p50_seconds\": %f, \"itl_p99_seconds\": %f}",
+               first ? "" : ", ", count, generated, seconds, generated / seconds, first_tokens / count,
+               percentile(gaps, num_gaps, 0.5), percentile(gaps, num_gaps, 0.99));
+        first = false;
+    }
+    printf("], \"device_memory_bytes\": %zu}\n", total_mem - least_free);
+    free(times);
+    free(gaps);
+}
 
-        // Reset layer weights so we can do the last layer norm
-        layer_weights_GPU = weights_gpu;
-        d_line = LayerNorm(d_line, 12 * NLAYER);
-
-        // And finally compute the output logits
-        token_processed_upto = 0;
-        int tmp = num_total_tokens;
-        num_total_tokens = 1;
-        Matrix result = matmul_t_fast(tranpose(slice(d_line, tmp - 1, DIM, 1)), d_wte);
-        token_processed_upto = num_total_tokens = tmp;
-
-        // Calculate softmax probabilities
-        int size = 5e4;
-        float temperature = 0.7;
-        Matrix d_softmax_out = divide_constCUDA(result, temperature);
-        softmaxSampleCUDA(d_softmax_out, &tmp);
-
-        // If the history is too long, then purge by half
-        if (num_total_tokens == zz) {
-            memcpy(output, output + zz / 2, tmp * 2);
-            cudaMemcpy(d_output, d_output + zz / 2, tmp * 2, cudaMemcpyDeviceToDevice);
-            num_total_tokens -= zz / 2;
-            token_processed_upto = 0;
-        }
-        // Write it to the history buffer
-        output[num_total_tokens] = tmp;
-        cudaMemcpy(d_output + num_total_tokens, &tmp, sizeof(int), cudaMemcpyHostToDevice);
-        num_total_tokens++;
-
-        // If it's a newline this is the end of the converstaion
-        if (bpe[tmp * 999] == 10) {
-            end = get_wall_time();
-            cpu_time_used = ((double)(end - start));
-            printf("\n\n----Seconds to respond: %f----\n", cpu_time_used);
-            break;
+// Decode the %XX escapes and the + signs of a query string value in place
+void url_decode(char* s) {
+    char* out = s;
+    for (; *s; s++) {
+        if (*s == '%' && isxdigit(s[1]) && isxdigit(s[2])) {
+            char hex[3] = {s[1], s[2]};
+            *out++ = strtol(hex, NULL, 16);
+            s += 2;
+        } else {
+            *out++ = *s == '+' ? ' ' : *s;
         }
+    }
+    *out = 0;
+}
 
-        // Otherwise print it and keep generating along
-        printf("%s", bpe + tmp * 999);
-        fflush(stdout);
+// Answer a request that is not going to be queued, and hang up
+void reject(int client, const char* status, const char* message) {
+    char response[300];
+    snprintf(response, sizeof(response),
+             "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n%s\n", status, message);
+    send(client, response, strlen(response), MSG_NOSIGNAL);
+    close(client);
+    atomic_fetch_sub(&open_requests, 1);
+}
+
+// Every connection gets a thread of its own that reads its request, which is
+//   GET /generate?prompt=...&temperature=...&max_tokens=...&seed=...
+// with everything but the prompt optional, starts the event stream and queues it.
+// The prompt is limited like those of the other modes, and by the room the history
+// has for its tokens.
+void* read_request(void* arg) {
+    int client = (int)(intptr_t)arg;
+    char buf[8192];
+    size_t len = 0;
+    buf[0] = 0;
+    while (!strstr(buf, "\r\n\r\n")) {
+        ssize_t n = len < sizeof(buf) - 1 ? recv(client, buf + len, sizeof(buf) - 1 - len, 0) : 0;
+        if (n <= 0) {
+            reject(client, "400 Bad Request", "The request did not fit or never ended");
+            return NULL;
+        }
+        buf[len += n] = 0;
+    }
+    if (strncmp(buf, "GET /generate?", 14)) {
+        reject(client, "404 Not Found", "Try GET /generate?prompt=...");
+        return NULL;
+    }
+    char* query = buf + 14;
+    query[strcspn(query, " \r\n")] = 0;
+
+    Request* r = malloc(sizeof(Request));
+    *r = (Request){.client = client, .temperature = -1, .max_tokens = -1, .seed = -1};
+    bool valid = true;
+    char* rest;
+    for (char* param = strtok_r(query, "&", &rest); param; param = strtok_r(NULL, "&", &rest)) {
+        char* value = strchr(param, '=');
+        if (!value) continue;
+        *value++ = 0;
+        url_decode(value);
+        if (!strcmp(param, "prompt")) {
+            free(r->prompt);
+            r->prompt = strdup(value);
+        } else if (!strcmp(param, "temperature")) {
+            valid &= (r->temperature = atof(value)) > 0;
+        } else if (!strcmp(param, "max_tokens")) {
+            valid &= (r->max_tokens = atoi(value)) >= 0;
+        } else if (!strcmp(param, "seed")) {
+            valid &= (r->seed = atoll(value)) >= 0 && r->seed <= INT_MAX;
+        }
+    }
+    if (!r->prompt || !r->prompt[0] || strlen(r->prompt) >= 1000 || strlen(r->prompt) > zz) {
+        reject(client, "400 Bad Request", "prompt has to be between 1 and SEQ_LEN bytes, and less than 1000");
+    } else if (!valid) {
+        reject(client, "400 Bad Request", "temperature has to be positive, max_tokens and seed at least 0");
+    } else {
+        const char* header = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                             "Connection: close\r\n\r\n";
+        send(client, header, strlen(header), MSG_NOSIGNAL);
+        r->arrived = get_wall_time();
+        push_request(&requests, r);
+        sem_post(&requests.ready);
+        return NULL;
+    }
+    free(r->prompt);
+    free(r);
+    return NULL;
+}
+
+// Accept connections on the port of --serve, each handed to a thread of its own
+void* accept_connections(void* arg) {
+    int listener = (int)(intptr_t)arg;
+    struct timeval timeout = {REQUEST_SECONDS, 0};
+    for (;;) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) continue;
+        if (atomic_fetch_add(&open_requests, 1) >= MAX_OPEN_REQUESTS) {
+            reject(client, "503 Service Unavailable", "Too many requests at once, try again later");
+            continue;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, read_request, (void*)(intptr_t)client)) {
+            reject(client, "503 Service Unavailable", "Too many requests at once, try again later");
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// --serve keeps the model loaded and answers requests until it is killed. Each
+// response is a stream of server-sent events, one per token as it is sampled, then
+// a done event with the timings. The requests are admitted by the same scheduler as
+// a file of prompts, so they are batched together as they come in. The port is only
+// opened on the loopback interface.
+void serve_http(int port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port)};
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) || listen(listener, 64)) {
+        perror("Error opening the port");
+        exit(EXIT_FAILURE);
     }
+
+    atomic_init(&requests.head, &requests.stub);
+    requests.tail = &requests.stub;
+    sem_init(&requests.ready, 0, 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, accept_connections, (void*)(intptr_t)listener);
+    printf("Serving on http://127.0.0.1:%d/generate?prompt=...\n", port);
+    fflush(stdout);
+    serve(NULL, 0);
 }
 
 // Now for the main function that does most of the useful work.
+// Send bytes down the input pipe of rank r + 1
+void share_input(int r, const void* bytes, size_t size) {
+    if (write(tp_inputs[r], bytes, size) != size) {
+        perror("Error forwarding input");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// With --tp a process is forked for every other GPU before anything touches CUDA,
+// which does not survive a fork. All of them then run the same program in lockstep
+// on the same input, only the first one prints, and the others read their input from
+// a pipe it writes to, starting with the id that NCCL connects them by.
+void start_ranks() {
+    LOOP(r, tp_ranks - 1) {
+        int fds[2];
+        if (pipe(fds)) {
+            perror("Error creating a pipe");
+            exit(EXIT_FAILURE);
+        }
+        if (fork() == 0) {
+            // If the first process goes away, so do the others
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            tp_rank = r + 1;
+            dup2(fds[0], STDIN_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            LOOP(q, r) {
+                close(tp_inputs[q]);
+            }
+            freopen("/dev/null", "w", stdout);
+            freopen("/dev/null", "w", stderr);
+            break;
+        }
+        close(fds[0]);
+        tp_inputs[r] = fds[1];
+    }
+
+    int devices = 0;
+    if (cudaGetDeviceCount(&devices) != cudaSuccess || devices < tp_ranks) {
+        fprintf(stderr, "--tp=%d needs as many GPUs, there are %d\n", tp_ranks, devices);
+        exit(EXIT_FAILURE);
+    }
+    cudaSetDevice(tp_rank);
+
+    char id[TP_ID_BYTES];
+    if (!tp_rank) {
+        if (!tensorParallelIdCUDA(id)) {
+            fprintf(stderr, "--tp needs a build with NCCL, make gpu NCCL=1\n");
+            exit(EXIT_FAILURE);
+        }
+        LOOP(r, tp_ranks - 1) {
+            share_input(r, id, TP_ID_BYTES);
+        }
+    } else {
+        // A short read means the first process is gone
+        for (size_t got = 0; got < TP_ID_BYTES;) {
+            ssize_t n = read(STDIN_FILENO, id + got, TP_ID_BYTES - got);
+            if (n <= 0) exit(EXIT_FAILURE);
+            got += n;
+        }
+    }
+    tensorParallelInitCUDA(id, tp_rank, tp_ranks);
+}
+
+// With --profile, what every op and range has taken so far
+void report_profile() {
+    if ((profile_flags & PROFILE_TIMES) && !tp_rank) profileReportCUDA();
+}
+
 int main(int tmp, char** argv) {
     double start, end;
     double cpu_time_used;
     start = get_wall_time();
+    tmp = parse_options(tmp, argv);
     bool is_set_prompt = false;
     char *set_prompt;
     int seed = time(NULL);
@@ -311,50 +2463,166 @@ int main(int tmp, char** argv) {
         }
     }
 
+    if (tp_ranks > 1) {
+        start_ranks();
+    }
+
     printf("Random seed %d\n", seed);
-    srand(seed);
+    sampler.seed = seed;
+    // Neither the events nor the checks can go into a graph, and the ops replayed
+    // from one would not be seen, so a profiled run launches everything itself
+    profileInitCUDA(profile_flags);
+    if (profile_flags) use_graphs = false;
 
     // Initially let's figure out the right hyperparameters for this model
     // argv[1] stores the name of the model we're loading
-    // tmp will map 124M -> 0, 355M -> 1, 775M -> 2, 1558M -> 3
-    // Note that if you change the name of the file then this will break.
-    tmp = argv[1][5] + 3 * argv[1][7] + 3 & 3;
-    // Now we just compute the layer sizes from tmp
-    NHEAD = 12 + 4 * tmp + (tmp > 2);
-    DIM = NHEAD * 64;
-    NLAYER = 12 * tmp + 12;
+    model_shape(&target_model, argv[1]);
+    if (draft_file) {
+        model_shape(&draft_model, draft_file);
+    } else {
+        speculate = 0;
+    }
 
-    // Allocate space
     zz = atoi(argv[3]);
+    if (zz > 1024) {
+        fprintf(stderr, "SEQ_LEN can be at most 1024, GPT-2 has no position embeddings past that\n");
+        exit(EXIT_FAILURE);
+    }
+    if (serve_port && (batch_file || tp_ranks > 1)) {
+        fprintf(stderr, "--serve does not work with --batch or --tp\n");
+        exit(EXIT_FAILURE);
+    }
+    if (benchmark && (batch_file || serve_port)) {
+        fprintf(stderr, "--bench does not work with --batch or --serve\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((n_best || beam_width) && (batch_file || serve_port || benchmark || speculate || tp_ranks > 1)) {
+        fprintf(stderr, "--n-best and --beam do not work with --batch, --serve, --bench, --draft or --tp\n");
+        exit(EXIT_FAILURE);
+    }
+    if (n_best && beam_width) {
+        fprintf(stderr, "--n-best and --beam do not work together\n");
+        exit(EXIT_FAILURE);
+    }
+    // Every candidate takes a place in the batch of its own
+    if (max_batch < n_best + beam_width) max_batch = n_best + beam_width;
+    if (speculate && prefill_chunk) {
+        fprintf(stderr, "--prefill-chunk does not work with --draft\n");
+        exit(EXIT_FAILURE);
+    }
+    if (speculate > zz / 2) {
+        fprintf(stderr, "--speculate can be at most half of SEQ_LEN\n");
+        exit(EXIT_FAILURE);
+    }
+    // A verifying step writes speculate positions ahead of what gets accepted, which
+    // with a ring lands on the oldest positions, so those are left out of the window
+    window = sliding ? zz - speculate : zz;
+
+    // Admission keeps a step within zz rows, and a prompt within zz - 1 of them plus
+    // its proposals. Once a history is purged though, every sequence in the step may
+    // be re-encoding the kept half of it on top of its new tokens, or with
+    // --prefill-chunk a chunk of it.
+    int purged = zz - zz / 2 + 1;
+    if (prefill_chunk && purged > prefill_chunk) purged = prefill_chunk;
+    max_rows = zz + speculate;
+    if (!sliding && max_batch * (purged + speculate) > max_rows) {
+        max_rows = max_batch * (purged + speculate);
+    }
+
+    // Allocate space. The steps of the two models never overlap, so they share the pool.
     cudaError_t cudaStatus;
-    size_t totalSize = 2LL * DIM * DIM * NLAYER * zz;
+    size_t totalSize = plan_activations(&target_model);
+    if (speculate && plan_activations(&draft_model) > totalSize) {
+        totalSize = plan_activations(&draft_model);
+    }
+    size_t scratch = gemm_input_size(&target_model);
+    if (speculate && gemm_input_size(&draft_model) > scratch) {
+        scratch = gemm_input_size(&draft_model);
+    }
+    gemmInitCUDA(gemm_backend, scratch);
+
+    // The KV cache lives for the whole run, outside of the activation pool. Unless
+    // --kv-cache sizes it, it has zz positions for every sequence, so that none is
+    // ever swapped out, and the prefix cache has its blocks on top. With --tp the
+    // blocks of a budget are counted as if the heads split evenly, so that every GPU
+    // has as many and they all schedule the same.
+    draft_model.kv_offset = 2 * KV_BLOCK * target_model.nlayer * target_model.local_dim;
+    block_floats = KV_BLOCK * position_bytes() / sizeof(float);
+    size_t even_block = 2 * sizeof(float) * KV_BLOCK * target_model.nlayer * target_model.dim / tp_ranks;
+    if (speculate) even_block += 2 * sizeof(float) * KV_BLOCK * draft_model.nlayer * draft_model.dim / tp_ranks;
+    int context_blocks = (zz + KV_BLOCK - 1) / KV_BLOCK;
+    num_blocks = kv_budget ? kv_budget / even_block : max_batch * context_blocks;
+    if (num_blocks < context_blocks) {
+        fprintf(stderr, "--kv-cache needs to hold SEQ_LEN positions, at least %zu MB\n",
+                (context_blocks * even_block >> 20) + 1);
+        exit(EXIT_FAILURE);
+    }
+    max_prefix_blocks = prefix_budget / even_block;
+    num_blocks += max_prefix_blocks;
+    size_t cacheSize = num_blocks * block_floats * sizeof(float);
+
     size_t freeMem, totalMem;
     cudaStatus = cudaMemGetInfo(&freeMem, &totalMem);
     printf("Available GPU device memory: %zu bytes\n", freeMem);
-    printf("Total GPU memory size required: %zu bytes\n", totalSize);
+    printf("Activation memory required: %zu bytes for steps of up to %d rows\n", totalSize, max_rows);
+    printf("KV cache memory required: %zu bytes for %d blocks of %d positions\n", cacheSize, num_blocks, KV_BLOCK);
+    printf("Total GPU memory size required: %zu bytes\n", totalSize + cacheSize);
     cudaStatus = cudaMalloc((void **)&memory_gpu, totalSize);
     if (cudaStatus != cudaSuccess) {
         // handle the failure, possibly by exiting the program or trying a different memory allocation strategy
         printf("Help!!! cudaMalloc failed: %s\n", cudaGetErrorString(cudaStatus));
     }
+    cudaStatus = cudaMalloc((void **)&kv_cache, cacheSize);
+    if (cudaStatus != cudaSuccess) {
+        printf("Help!!! cudaMalloc of the KV cache failed: %s\n", cudaGetErrorString(cudaStatus));
+    }
+    free_blocks = malloc(num_blocks * sizeof(int));
+    block_refs = calloc(num_blocks, sizeof(int));
+    LOOP(b, num_blocks) {
+        free_blocks[num_free_blocks++] = num_blocks - 1 - b;
+    }
+
+    size_t stepSize = sizeof(Batch) + (size_t)max_rows * sizeof(int);
+    cudaMalloc((void **)&d_batch, stepSize);
+    d_tokens = (int*)(d_batch + 1);
+    LOOP(i, 2) {
+        cudaMallocHost((void **)&staging[i].batch, stepSize);
+        cudaMallocHost((void **)&staging[i].next, MAX_BEAMS * max_batch * sizeof(int));
+        cudaMallocHost((void **)&staging[i].log_probs, MAX_BEAMS * max_batch * sizeof(float));
+        staging[i].tokens = (int*)(staging[i].batch + 1);
+        cudaEventCreateWithFlags(&staging[i].done, cudaEventDisableTiming);
+    }
+    samplerInitCUDA(max_batch, 5e4);
+    if (speculate) {
+        proposals = (Matrix){0, max_batch, 5e4};
+        cudaMalloc((void **)&proposals.dat, (size_t)speculate * max_batch * 5e4 * sizeof(float));
+    }
+
+    // The host only waits on the events of the steps, and a graph cannot be
+    // captured from the legacy default stream
+    cudaStreamCreate(&compute_stream);
+    setStreamCUDA(compute_stream);
 
     /////////////////////////////////////////////////////////////
     ////////////////LOAD BPE FUNCTION INLINED////////////////////
     /////////////////////////////////////////////////////////////
-    bpe = malloc(1e9);
-
     // load the bpe file from argv[2]
     fp = fopen(argv[2], "r");
 
+    // No token is longer than its line in the file, so the file size bounds the table
+    fseek(fp, 0, SEEK_END);
+    bpe = malloc(ftell(fp) + 1000);
+    rewind(fp);
+    int bpe_size = 0;
+
     // The BPE was not written in a c-friendly format.
     // So we need to do some ugly processing to load it.
     unsigned char a[tmp = 999], b[tmp];
     LOOP(i, 5e4) {  // Vansh loop
-        int k = i * tmp;
+        bpe_offset[i] = bpe_size;
         if (i < 93) {
             // The first 92 tokens are just the printable ascii characters
-            bpe[k] = i + 33;
-            bpe[k + 1] = 0;
+            bpe[bpe_size++] = i + 33;
         } else if (i > 254) {
             // Ones above 254 are from the BPE file. Load those
             int fscanf_result = fscanf(fp, "%s %s", a, b);
@@ -365,62 +2633,25 @@ int main(int tmp, char** argv) {
             }
 
             strcat((char*)a, (char*)b);
-            int j = 0;
             LOOP(i, a[i]) {
                 // UTF8 encoding makes life hard so handle that here
-                bpe[k + j++] = a[i] ^ 196 ? a[i] : a[++i] - 128;
+                bpe[bpe_size++] = a[i] ^ 196 ? a[i] : a[++i] - 128;
             }
-            bpe[k + j++] = 0;
         } else if (i > 187) {
             // Tokens above 187 are the nonprintable asii character from 0-32
-            bpe[k] = i - 188;
-            bpe[k + 1] = 0;
+            bpe[bpe_size++] = i - 188;
         }
+        // The tokens from 93 to 187 are left empty
+        bpe[bpe_size++] = 0;
+        trie_insert(bpe + bpe_offset[i], i);
     }
 
-    fp = fopen(argv[1], "r");
-
     /////////////////////////////////////////////////////////////
     //////////////READ MATRIX FUNCTION INLINED///////////////////
     /////////////////////////////////////////////////////////////
-    const int LENWEIGHTS = 999;
-    Matrix weights[LENWEIGHTS];
-    Matrix weights_gpu[LENWEIGHTS];
-    Matrix* out = weights;
-
-    LOOP(i, NLAYER){
-        LOOP(j, 12){
-                // These two nasty expressions compute the shapes of the matricies on disk
-                * out++ = read_matrix(DIM + DIM * (j ? j ^ 8 ? j ^ 11 ? 0 : 3 : 3 : 2), DIM * ((j % 8 == 3) + 3 * (j % 8 == 1) + (j == 9)));
-        }
-    }
-
-    *out++ = read_matrix(DIM, 1);  // ln_f.bias
-    *out++ = read_matrix(DIM, 1);  // ln_f.weight
-
-    Matrix wpe = read_matrix(1024, DIM),
-    wte = transpose_util(read_matrix(5e4, DIM));
-    
-    Matrix d_wpe;
-    Matrix d_wte;
-    cudaMalloc((void**)&d_wpe.dat, wpe.rows * wpe.cols * sizeof(float));
-    cudaMalloc((void**)&d_wte.dat, wte.rows * wte.cols * sizeof(float));
-    cudaMemcpy(d_wpe.dat, wpe.dat, wpe.rows * wpe.cols * sizeof(float), cudaMemcpyHostToDevice);
-    d_wpe.rows = wpe.rows;
-    d_wpe.cols = wpe.cols;
-    cudaMemcpy(d_wte.dat, wte.dat, wte.rows * wte.cols * sizeof(float), cudaMemcpyHostToDevice);
-    d_wte.rows = wte.rows;
-    d_wte.cols = wte.cols;
-    // Loop to copy each matrix from CPU to GPU
-    for (int i = 0; i < (NLAYER * 12 + 2); i++) {
-        // Allocate memory for the matrix data on GPU
-        int dataSize = weights[i].rows * weights[i].cols * sizeof(float);
-        cudaMalloc((void**)&weights_gpu[i].dat, dataSize);
-        // Copy matrix data from CPU to GPU
-        cudaMemcpy(weights_gpu[i].dat, weights[i].dat, dataSize, cudaMemcpyHostToDevice);
-        // Set rows, cols for the matrix
-        weights_gpu[i].rows = weights[i].rows;
-        weights_gpu[i].cols = weights[i].cols;
+    load_model(&target_model, argv[1]);
+    if (draft_file) {
+        load_model(&draft_model, draft_file);
     }
 
     end = get_wall_time();
@@ -431,32 +2662,34 @@ int main(int tmp, char** argv) {
     ///////////////INFERENCE FUNCTION INLINED////////////////////
     /////////////////////////////////////////////////////////////
 
-    if(is_set_prompt) {  // Run only one prompt
-        start = get_wall_time();
-
-        char buf[1000] = {0};
-        int T;
+    Sequence seq;
+    if (batch_file) {  // Run a file of prompts, batched
+        serve_file(batch_file);
+    } else if (serve_port) {  // Answer requests over HTTP for as long as we run
+        serve_http(serve_port);
+    } else if (benchmark) {  // Time a fixed prompt and report as JSON
+        run_benchmark(argv[1], cpu_time_used);
+    } else if(is_set_prompt) {  // Run only one prompt
         printf("\nHuman: ");
         printf("%s\n", set_prompt);
         fflush(stdout);
 
-        strcpy(buf, set_prompt);
-
-        // This is going to store our prompt
-        int output[2 * zz];
-        int *d_output;
-        cudaMalloc((void**)&d_output, 2 * zz * sizeof(int));
-        num_total_tokens = 0;
-
-        printf("AI: ");
-        strcat(buf, "\n\n");
-        do_inference(start, end, cpu_time_used, d_wpe, d_wte, weights_gpu, T, buf, output, d_output);
+        if (n_best || beam_width) {
+            serve_candidates(set_prompt);
+        } else {
+            new_sequence(&seq, set_prompt, true);
+            printf("AI: ");
+            serve(&seq, 1);
+            free_sequence(&seq);
+        }
     } else {  // Run conversation loop indefinitely
-        while (1) {  // Nika loop
-            start = get_wall_time();
-
+        // Every turn continues the conversation of the one before, with --prefix-cache
+        // it only has to run its own prompt through the network
+        Sequence turns[2];
+        for (int turn = 0;; turn++) {  // Nika loop
+            Sequence* current = turns + turn % 2;
+            Sequence* previous = turns + (turn + 1) % 2;
             char buf[1000] = {0};
-            int T;
             printf("\nHuman: ");
             fflush(stdout);
 
@@ -466,17 +2699,26 @@ int main(int tmp, char** argv) {
                 perror("Error reading input");
                 exit(EXIT_FAILURE);
             }
+            LOOP(r, tp_ranks - 1) {
+                share_input(r, buf, strlen(buf));
+            }
+            if (n_best || beam_width) {
+                serve_candidates(buf);
+                continue;
+            }
 
-            // This is going to store our prompt
-            int output[2 * zz];
-            int *d_output;
-            cudaMalloc((void**)&d_output, 2 * zz * sizeof(int));
-
-            num_total_tokens = 0;
-
+            new_sequence(current, buf, true);
+            if (turn) {
+                continue_conversation(current, previous);
+                free_sequence(previous);
+            }
             printf("AI: ");
-            strcat(buf, "\n\n");
-            do_inference(start, end, cpu_time_used, d_wpe, d_wte, weights_gpu, T, buf, output, d_output);
+            serve(current, 1);
+            report_profile();
         }
     }
+    report_profile();
+
+    // The first process returns once every other one is done as well
+    while (wait(NULL) > 0);
 }
@@ -0,0 +1,291 @@
+/* pack.c: convert a gpt-2 checkpoint into the file format the GPU demo maps directly
+ *
+ * Usage: pack gpt2-124M.ckpt [fp32|fp16|bf16|int8|int4] [group]
+ *
+ * The checkpoint is rewritten once, offline, into a single blob with a header and a
+ * table of tensors (see PackedHeader in cuda_utils.h). Each matrix is transposed into
+ * the layout our kernels use, the layers are put back into numeric order, and every
+ * tensor is aligned, so loading is a single upload with no work in between.
+ *
+ * The precision applies to the four big matrices of every layer (qkv, attention
+ * projection and both MLP layers). The 16 bit types also apply to the token embedding.
+ * int8 and int4 are weight-only and symmetric, with one fp32 scale per group of `group`
+ * consecutive inputs of an output channel, or per channel if group is 0.
+ *
+ * The result is written next to the input as gpt2-124M-fp16.pack and so on.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cuda_utils.h"
+
+#define LOOP(i, j) for (int i = 0; i < j; i++)
+
+int DIM, NLAYER, NHEAD;
+FILE *in, *out;
+
+// Offset of each tensor of a layer in the checkpoint, and the size of a whole layer, in floats
+long long tensor_start[12], layer_size;
+
+void read_floats(float* dat, long long offset, size_t n) {
+    fseek(in, offset * sizeof(float), SEEK_SET);
+    if (fread(dat, sizeof(float), n, in) != n) {
+        perror("Error reading checkpoint");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void write_bytes(const void* dat, long long offset, size_t n) {
+    fseek(out, offset, SEEK_SET);
+    if (fwrite(dat, 1, n, out) != n) {
+        perror("Error writing checkpoint");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// The layers on disk are stored by sorting alphabetically, because tensorflow makes
+// no sense. For 12 layers they are in order 0 1 10 11 2 3 4 5 6 7 8 9. This returns
+// where layer i is on disk.
+int disk_layer(int i) {
+    int permute = 0, tmp = 0;
+    LOOP(j, 10) {
+        if (j == i) {
+            permute = tmp;
+        }
+        tmp++;
+        LOOP(k, 10 * (j > 0)) {
+            if (j * 10 + k < NLAYER && tmp++ && i == j * 10 + k) {
+                permute = tmp;
+            }
+        }
+    }
+    return permute;
+}
+
+// Round to nearest even, the same as __float2half_rn and __float2bfloat16_rn on the GPU
+unsigned short to_half(float f) {
+    unsigned u;
+    memcpy(&u, &f, 4);
+    unsigned sign = u >> 16 & 0x8000, mant = u & 0x7fffff;
+    int exp = (u >> 23 & 255) - 112;
+    if ((u >> 23 & 255) == 255) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 31) return sign | 0x7c00;
+    int shift = 13;
+    if (exp <= 0) {
+        // Subnormal in fp16
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        shift = 14 - exp;
+        exp = 0;
+    }
+    unsigned half = exp << 10 | mant >> shift, rem = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+    // A carry out of the mantissa correctly rounds up into the exponent
+    if (rem > mid || (rem == mid && half & 1)) half++;
+    return sign | half;
+}
+
+unsigned short to_bf16(float f) {
+    unsigned u;
+    memcpy(&u, &f, 4);
+    if ((u & 0x7fffffff) > 0x7f800000) return u >> 16 | 64;
+    return (u + 0x7fff + (u >> 16 & 1)) >> 16;
+}
+
+// Bytes taken by the elements of a tensor, not counting any scales
+size_t tensor_bytes(PackedTensor* t) {
+    size_t n = (size_t)t->rows * t->cols;
+    return t->dtype == DTYPE_FP32 ? 4 * n : t->dtype == DTYPE_INT8 ? n : t->dtype == DTYPE_INT4 ? n / 2 : 2 * n;
+}
+
+// Convert rows x cols floats (in the kernels' layout) into dtype and write them at
+// t->offset, and for quantized types their scales at t->scales.
+// Returns the largest absolute quantization error, or 0 for the float types.
+float convert(float* w, PackedTensor* t) {
+    size_t n = (size_t)t->rows * t->cols;
+    size_t bytes = tensor_bytes(t);
+    unsigned char* dat = calloc(bytes, 1);
+    float max_error = 0;
+
+    if (t->dtype == DTYPE_FP32) {
+        memcpy(dat, w, bytes);
+    } else if (t->dtype == DTYPE_FP16 || t->dtype == DTYPE_BF16) {
+        unsigned short* h = (unsigned short*)dat;
+        for (size_t i = 0; i < n; i++) {
+            h[i] = t->dtype == DTYPE_FP16 ? to_half(w[i]) : to_bf16(w[i]);
+        }
+    } else {
+        int qmax = t->dtype == DTYPE_INT8 ? 127 : 7;
+        int ngroups = t->cols / t->group;
+        float* scales = malloc(sizeof(float) * t->rows * ngroups);
+        LOOP(r, t->rows) {
+            LOOP(g, ngroups) {
+                float* v = w + (size_t)r * t->cols + g * t->group;
+                float amax = 0;
+                LOOP(k, t->group) {
+                    amax = fmaxf(amax, fabsf(v[k]));
+                }
+                float scale = amax > 0 ? amax / qmax : 1;
+                scales[r * ngroups + g] = scale;
+
+                LOOP(k, t->group) {
+                    int value = (int)roundf(v[k] / scale);
+                    value = value > qmax ? qmax : value < -qmax ? -qmax : value;
+                    max_error = fmaxf(max_error, fabsf(value * scale - v[k]));
+
+                    size_t i = (size_t)r * t->cols + g * t->group + k;
+                    if (t->dtype == DTYPE_INT8) {
+                        dat[i] = value;
+                    } else {
+                        dat[i / 2] |= (value & 15) << (i % 2 * 4);
+                    }
+                }
+            }
+        }
+        write_bytes(scales, t->scales, sizeof(float) * t->rows * ngroups);
+        free(scales);
+    }
+
+    write_bytes(dat, t->offset, bytes);
+    free(dat);
+    return max_error;
+}
+
+// Read a rows x cols matrix from the checkpoint and transpose it into w if asked to
+void read_tensor(float* w, long long offset, int rows, int cols, int transpose) {
+    float* disk = malloc(sizeof(float) * rows * cols);
+    read_floats(disk, offset, (size_t)rows * cols);
+    if (transpose) {
+        LOOP(r, rows) {
+            LOOP(c, cols) {
+                w[(size_t)c * rows + r] = disk[(size_t)r * cols + c];
+            }
+        }
+    } else {
+        memcpy(w, disk, sizeof(float) * rows * cols);
+    }
+    free(disk);
+}
+
+int main(int argc, char** argv) {
+    const char* names[] = {"fp32", "fp16", "bf16", "int8", "int4"};
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s gpt2-124M.ckpt [fp32|fp16|bf16|int8|int4] [group]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int dtype = DTYPE_FP32;
+    LOOP(i, 5) {
+        if (argc > 2 && !strcmp(argv[2], names[i])) dtype = i;
+    }
+    int group = argc > 3 ? atoi(argv[3]) : 0;
+
+    // Same model size detection as the demos, so the file name has to be kept
+    int tmp = argv[1][5] + 3 * argv[1][7] + 3 & 3;
+    NHEAD = 12 + 4 * tmp + (tmp > 2);
+    DIM = NHEAD * 64;
+    NLAYER = 12 * tmp + 12;
+
+    // Every matrix has DIM or 4 * DIM inputs, so a group that divides DIM fits all of them.
+    // The kernels unpack eight weights at a time and need groups in multiples of eight.
+    if ((argc > 2 && strcmp(argv[2], names[dtype])) || group < 0 || (group && (DIM % group || group % 8))) {
+        fprintf(stderr, "The type must be one of fp32, fp16, bf16, int8 or int4, "
+                        "and the group 0 or a multiple of 8 dividing %d\n", DIM);
+        return EXIT_FAILURE;
+    }
+
+    char name[1000];
+    char* ext = strstr(argv[1], ".ckpt");
+    int stem = ext ? ext - argv[1] : strlen(argv[1]);
+    snprintf(name, sizeof(name), "%.*s-%s.pack", stem, argv[1], names[dtype]);
+
+    in = fopen(argv[1], "rb");
+    out = fopen(name, "wb");
+    if (!in || !out) {
+        perror("Error opening checkpoint");
+        return EXIT_FAILURE;
+    }
+
+    // Shapes of the tensors of one layer on disk. The kernels want every matrix
+    // transposed, and the biases and gains become single rows.
+    int disk_rows[12], disk_cols[12];
+    LOOP(j, 12) {
+        // The same two nasty expressions as the demos' loader
+        disk_rows[j] = DIM + DIM * (j ? j ^ 8 ? j ^ 11 ? 0 : 3 : 3 : 2);
+        disk_cols[j] = DIM * ((j % 8 == 3) + 3 * (j % 8 == 1) + (j == 9));
+        tensor_start[j] = layer_size;
+        layer_size += (long long)disk_rows[j] * (disk_cols[j] + !disk_cols[j]);
+    }
+
+    // Lay out the table first: every tensor and every set of scales starts aligned
+    PackedHeader header = {PACK_MAGIC, DIM, NLAYER, NLAYER * 12 + 4};
+    PackedTensor* tensors = calloc(header.ntensors, sizeof(PackedTensor));
+    long long offset = sizeof(header) + sizeof(PackedTensor) * header.ntensors;
+    LOOP(i, header.ntensors) {
+        PackedTensor* t = tensors + i;
+        int j = i % 12;
+        t->dtype = DTYPE_FP32;
+        if (i < NLAYER * 12) {
+            t->rows = disk_cols[j] ? disk_cols[j] : 1;
+            t->cols = disk_rows[j];
+            if (disk_cols[j]) t->dtype = dtype;
+        } else if (i < NLAYER * 12 + 2) {
+            t->rows = 1;  // ln_f.bias, ln_f.weight
+            t->cols = DIM;
+        } else if (i == NLAYER * 12 + 2) {
+            t->rows = 1024;  // wpe
+            t->cols = DIM;
+        } else {
+            t->rows = 5e4;  // wte
+            t->cols = DIM;
+            if (dtype == DTYPE_FP16 || dtype == DTYPE_BF16) t->dtype = dtype;
+        }
+        t->group = t->dtype >= DTYPE_INT8 ? group ? group : t->cols : 0;
+
+        offset = (offset + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+        t->offset = offset;
+        offset += tensor_bytes(t);
+        if (t->group) {
+            offset = (offset + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+            t->scales = offset;
+            offset += sizeof(float) * t->rows * (t->cols / t->group);
+        }
+    }
+    write_bytes(&header, 0, sizeof(header));
+    write_bytes(tensors, sizeof(header), sizeof(PackedTensor) * header.ntensors);
+
+    // Then fill it in, in the order of the table
+    float max_error = 0;
+    float* w = malloc(sizeof(float) * 5e4 * DIM);
+    long long globals = layer_size * NLAYER;
+    LOOP(i, header.ntensors) {
+        PackedTensor* t = tensors + i;
+        int j = i % 12;
+        if (i < NLAYER * 12) {
+            long long start = disk_layer(i / 12) * layer_size + tensor_start[j];
+            read_tensor(w, start, disk_rows[j], disk_cols[j] + !disk_cols[j], disk_cols[j] > 0);
+        } else if (i < NLAYER * 12 + 2) {
+            read_tensor(w, globals + (i - NLAYER * 12) * DIM, DIM, 1, 0);
+        } else if (i == NLAYER * 12 + 2) {
+            read_tensor(w, globals + 2 * DIM, 1024, DIM, 0);
+        } else {
+            read_tensor(w, globals + 2 * DIM + 1024 * DIM, 5e4, DIM, 0);
+        }
+        max_error = fmaxf(max_error, convert(w, t));
+    }
+    free(w);
+
+    // Pad the last tensor out so the file can be uploaded in whole aligned chunks
+    write_bytes("", (offset + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN - 1, 1);
+
+    fseek(in, 0, SEEK_END);
+    fseek(out, 0, SEEK_END);
+    printf("Wrote %s: %ld -> %ld bytes\n", name, ftell(in), ftell(out));
+    if (dtype >= DTYPE_INT8) {
+        printf("Largest quantization error of a weight: %g\n", max_error);
+    }
+    fclose(in);
+    fclose(out);
+    free(tensors);
+    return 0;
+}
@@ -2,6 +2,9 @@
 #include <cmath>
 #include <cstdlib>
 #include <cstdio> 
+#include <cstring>
+#include <vector>
+#include <algorithm>
 #include "cuda_utils.h"
 #include <time.h>
 #include <cuda_runtime.h>
@@ -127,6 +130,11 @@ void printMatrix(float* m, int mRows, int mCols) {
     printf("---\n");
 }
 
+// Throughput of an (m x k) by transpose(n x k) product
+double gflops(int m, int n, int k, float milliseconds) {
+    return 2.0 * m * n * k / (milliseconds * 1e6);
+}
+
 void matMulCUDATest() {
     std::cout << "------------------------------------------" << std::endl;
     std::cout << "Test CUDA matmul RUNNING." << std::endl;
@@ -177,7 +185,8 @@ void matMulCUDATest() {
 
     std::cout << std::endl;
     std::cout << "CPU time: " << cpu_time_milliseconds << " milliseconds" << std::endl;
-    std::cout << "GPU time: " << gpu_time_milliseconds << " milliseconds" << std::endl;
+    std::cout << "GPU time: " << gpu_time_milliseconds << " milliseconds, " <<
+        gflops(aRows, bRows, aCols, gpu_time_milliseconds) << " GFLOP/s" << std::endl;
     std::cout << std::endl << "Speedup factor: " <<
         cpu_time_milliseconds / gpu_time_milliseconds << std::endl << std::endl;
 
@@ -243,7 +252,8 @@ void matMulCUDATest2() {
 
     std::cout << std::endl;
     std::cout << "Naive Cuda time: " << gpu_time_milliseconds << " milliseconds" << std::endl;
-    std::cout << "Optimized CUDA time: " << cpu_time_milliseconds << " milliseconds" << std::endl;
+    std::cout << "Optimized CUDA time: " << cpu_time_milliseconds << " milliseconds, " <<
+        gflops(aRows, bRows, aCols, cpu_time_milliseconds) << " GFLOP/s" << std::endl;
     std::cout << std::endl << "Speedup factor: " <<
         gpu_time_milliseconds / cpu_time_milliseconds << std::endl << std::endl;
 
@@ -265,6 +275,166 @@ void matMulCUDATest2() {
     cudaFree(gpu_c_output_cpu);
 }
 
+// Decode shapes: a handful of rows against a wide weight, which takes the skinny kernel
+void matMulSkinnyTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test CUDA skinny matmul RUNNING." << std::endl;
+
+    const int aRows = 7;
+    const int aCols = 768;
+
+    const int bRows = 2304;
+    const int bCols = 768;
+
+    float *a_input = generateRandomMatrix(aRows, aCols);
+    float *b_input = generateRandomMatrix(bRows, bCols);
+    // Centered so the long dot products stay within compareMatrices' tolerance
+    LOOP(i, aRows * aCols) a_input[i] = a_input[i] / 10 - .5;
+    LOOP(i, bRows * bCols) b_input[i] = b_input[i] / 10 - .5;
+    float *gpu_a_input = cuda_convert(a_input, aRows * aCols * sizeof(float));
+    float *gpu_b_input = cuda_convert(b_input, bRows * bCols * sizeof(float));
+
+    float *c_output_gpu = (float*) malloc(aRows * bRows * sizeof(float));
+    float *c_output_cpu = (float*) calloc(aRows * bRows, sizeof(float));
+    float *gpu_c_output_gpu = cuda_convert(c_output_gpu, aRows * bRows * sizeof(float));
+
+    matMulCPU(a_input, aRows, aCols, b_input, bRows, bCols, c_output_cpu);
+
+    cudaEvent_t start_gpu, stop_gpu;
+    cudaEventCreate(&start_gpu);
+    cudaEventCreate(&stop_gpu);
+    cudaEventRecord(start_gpu);
+
+    matMulCUDA(gpu_a_input, aRows, aCols, gpu_b_input, bRows, bCols, gpu_c_output_gpu);
+
+    cudaEventRecord(stop_gpu);
+    cudaEventSynchronize(stop_gpu);
+    float gpu_time_milliseconds;
+    cudaEventElapsedTime(&gpu_time_milliseconds, start_gpu, stop_gpu);
+
+    cpu_convert(c_output_gpu, gpu_c_output_gpu, aRows * bRows * sizeof(float));
+
+    std::cout << std::endl;
+    std::cout << "GPU time: " << gpu_time_milliseconds << " milliseconds, " <<
+        gflops(aRows, bRows, aCols, gpu_time_milliseconds) << " GFLOP/s" << std::endl << std::endl;
+
+    if (compareMatrices(c_output_gpu, c_output_cpu, aRows, bRows)) {
+        std::cout << "Test CUDA skinny matmul PASSED." << std::endl;
+    } else {
+        std::cout << "Test CUDA skinny matmul FAILED." << std::endl;
+    }
+
+    free(a_input);
+    free(b_input);
+    free(c_output_gpu);
+    free(c_output_cpu);
+    cudaFree(gpu_a_input);
+    cudaFree(gpu_b_input);
+    cudaFree(gpu_c_output_gpu);
+}
+
+// Quantize w (rows x cols, one output channel per row) the way gpu/pack.c does,
+// and overwrite w with the dequantized values the kernels should reproduce
+void quantizeCPU(float *w, int rows, int cols, int bits, int group, signed char *q, float *scales) {
+    int qmax = (1 << (bits - 1)) - 1;
+    memset(q, 0, (size_t)rows * cols * bits / 8);
+    LOOP(n, rows) LOOP(g, cols / group) {
+        float amax = 0;
+        LOOP(k, group) amax = fmaxf(amax, fabsf(w[n * cols + g * group + k]));
+        float scale = amax > 0 ? amax / qmax : 1;
+        scales[n * (cols / group) + g] = scale;
+        LOOP(k, group) {
+            size_t i = (size_t)n * cols + g * group + k;
+            int value = (int)roundf(w[i] / scale);
+            value = value > qmax ? qmax : value < -qmax ? -qmax : value;
+            w[i] = value * scale;
+            if (bits == 8) {
+                q[i] = value;
+            } else {
+                q[i / 2] |= (value & 15) << (i % 2 * 4);
+            }
+        }
+    }
+}
+
+void matMulQuantTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test CUDA quantized matmul RUNNING." << std::endl;
+
+    const int aCols = 768;
+    const int bRows = 512;
+    const int bCols = 768;
+
+    // Decode and prefill shapes, int8 per channel and int4 in groups of 64
+    const int shapes[] = {7, 100};
+    const int bits[] = {8, 4};
+    const int groups[] = {bCols, 64};
+
+    signed char *q = (signed char*) malloc(bRows * bCols);
+    float *scales = (float*) malloc(bRows * bCols / 8 * sizeof(float));
+    signed char *gpu_q;
+    float *gpu_scales;
+    cudaMalloc((void**)&gpu_q, bRows * bCols);
+    cudaMalloc((void**)&gpu_scales, bRows * bCols / 8 * sizeof(float));
+
+    std::cout << std::endl;
+    LOOP(s, 2) LOOP(b, 2) {
+        int aRows = shapes[s];
+        float *a_input = generateRandomMatrix(aRows, aCols);
+        float *b_input = generateRandomMatrix(bRows, bCols);
+        // Centered so the long dot products stay within compareMatrices' tolerance
+        LOOP(i, aRows * aCols) a_input[i] = a_input[i] / 10 - .5;
+        LOOP(i, bRows * bCols) b_input[i] = b_input[i] / 10 - .5;
+        quantizeCPU(b_input, bRows, bCols, bits[b], groups[b], q, scales);
+        cudaMemcpy(gpu_q, q, bRows * bCols * bits[b] / 8, cudaMemcpyHostToDevice);
+        cudaMemcpy(gpu_scales, scales, bRows * (bCols / groups[b]) * sizeof(float), cudaMemcpyHostToDevice);
+        float *gpu_a_input = cuda_convert(a_input, aRows * aCols * sizeof(float));
+
+        float *c_output_gpu = (float*) malloc(aRows * bRows * sizeof(float));
+        float *c_output_cpu = (float*) calloc(aRows * bRows, sizeof(float));
+        float *gpu_c_output_gpu = cuda_convert(c_output_gpu, aRows * bRows * sizeof(float));
+        matMulCPU(a_input, aRows, aCols, b_input, bRows, bCols, c_output_cpu);
+
+        Matrix mat_a = {gpu_a_input, aRows, aCols};
+        Matrix mat_w = {(float*)gpu_q, bRows, bCols, bits[b] == 8 ? DTYPE_INT8 : DTYPE_INT4, gpu_scales, groups[b]};
+        Matrix mat_out = {gpu_c_output_gpu, aRows, bRows};
+        Matrix no_bias = {0};
+
+        cudaEvent_t start_gpu, stop_gpu;
+        cudaEventCreate(&start_gpu);
+        cudaEventCreate(&stop_gpu);
+        cudaEventRecord(start_gpu);
+
+        gemmCUDA(mat_a, mat_w, no_bias, EPILOGUE_NONE, mat_out);
+
+        cudaEventRecord(stop_gpu);
+        cudaEventSynchronize(stop_gpu);
+        float gpu_time_milliseconds;
+        cudaEventElapsedTime(&gpu_time_milliseconds, start_gpu, stop_gpu);
+
+        cpu_convert(c_output_gpu, gpu_c_output_gpu, aRows * bRows * sizeof(float));
+        std::cout << "int" << bits[b] << " " << aRows << " rows time: " << gpu_time_milliseconds << " milliseconds, " <<
+            gflops(aRows, bRows, aCols, gpu_time_milliseconds) << " GFLOP/s, ";
+        if (compareMatrices(c_output_gpu, c_output_cpu, aRows, bRows)) {
+            std::cout << "Test CUDA quantized matmul int" << bits[b] << " PASSED." << std::endl;
+        } else {
+            std::cout << "Test CUDA quantized matmul int" << bits[b] << " FAILED." << std::endl;
+        }
+
+        free(a_input);
+        free(b_input);
+        free(c_output_gpu);
+        free(c_output_cpu);
+        cudaFree(gpu_a_input);
+        cudaFree(gpu_c_output_gpu);
+    }
+
+    free(q);
+    free(scales);
+    cudaFree(gpu_q);
+    cudaFree(gpu_scales);
+}
+
 void matMulCublasTest() {
     std::cout << "------------------------------------------" << std::endl;
     std::cout << "Test Cublas matmul RUNNING." << std::endl;
@@ -311,8 +481,10 @@ void matMulCublasTest() {
     cpu_convert(c_output_gpu, gpu_c_output_gpu, aRows * bRows * sizeof(float));
 
     std::cout << std::endl;
-    std::cout << "CUBLAS time: " << cpu_time_milliseconds << " milliseconds" << std::endl;
-    std::cout << "CUDA time: " << gpu_time_milliseconds << " milliseconds" << std::endl;
+    std::cout << "CUBLAS time: " << cpu_time_milliseconds << " milliseconds, " <<
+        gflops(aRows, bRows, aCols, cpu_time_milliseconds) << " GFLOP/s" << std::endl;
+    std::cout << "CUDA time: " << gpu_time_milliseconds << " milliseconds, " <<
+        gflops(aRows, bRows, aCols, gpu_time_milliseconds) << " GFLOP/s" << std::endl;
     std::cout << std::endl << "Speedup factor: " <<
         cpu_time_milliseconds / gpu_time_milliseconds << std::endl << std::endl;
 
@@ -334,6 +506,164 @@ void matMulCublasTest() {
     cudaFree(gpu_c_output_gpu);
 }
 
+// Every GEMM backend with the fused bias + GELU epilogue and each weight precision, against the CPU
+void gemmBackendsTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test GEMM backends RUNNING." << std::endl;
+
+    const int aRows = 500;
+    const int aCols = 300;
+
+    const int bRows = 400;
+    const int bCols = 300;
+
+    const char *names[] = {"custom", "cublas", "cublaslt"};
+    const char *precisions[] = {"fp32", "fp16", "bf16"};
+
+    float *a_input = generateRandomMatrix(aRows, aCols);
+    float *b_input = generateRandomMatrix(bRows, bCols);
+    float *bias_input = generateRandomMatrix(1, bRows);
+    float *gpu_a_input = cuda_convert(a_input, aRows * aCols * sizeof(float));
+    float *gpu_b_input = cuda_convert(b_input, bRows * bCols * sizeof(float));
+    float *gpu_bias_input = cuda_convert(bias_input, bRows * sizeof(float));
+
+    // Keep the pre-activations small enough that GELU is not just the identity
+    Matrix cpu_out = {(float*) calloc(aRows * bRows, sizeof(float)), aRows, bRows};
+    Matrix bias = {bias_input, 1, bRows};
+    matMulCPU(a_input, aRows, aCols, b_input, bRows, bCols, cpu_out.dat);
+    divide_const(cpu_out, -1e4);
+    GELU(add_tile(cpu_out, bias), 0);
+
+    float *c_output_gpu = (float*) malloc(aRows * bRows * sizeof(float));
+    float *gpu_c_output_gpu = cuda_convert(c_output_gpu, aRows * bRows * sizeof(float));
+    Matrix mat_a = {gpu_a_input, aRows, aCols};
+    Matrix mat_b = {gpu_b_input, bRows, bCols};
+    Matrix mat_bias = {gpu_bias_input, 1, bRows};
+    Matrix mat_out = {gpu_c_output_gpu, aRows, bRows};
+    LOOP(i, aRows * aCols) a_input[i] /= -1e4;
+    cudaMemcpy(gpu_a_input, a_input, aRows * aCols * sizeof(float), cudaMemcpyHostToDevice);
+
+    // The weights rounded to 16 bits, as the demo does at load with --precision
+    float *gpu_b_half;
+    cudaMalloc((void**)&gpu_b_half, bRows * bCols * 2);
+
+    std::cout << std::endl;
+    LOOP(dtype, 3) LOOP(backend, 3) {
+        Matrix mat_w = {gpu_b_half, bRows, bCols, dtype};
+        if (dtype == DTYPE_FP32) {
+            mat_w = mat_b;
+        } else if (backend == 0) {
+            castCUDA(mat_b, mat_w);
+        }
+        gemmInitCUDA(backend, (size_t)aRows * aCols);
+        // Warm up so plan creation is not part of the timing
+        gemmCUDA(mat_a, mat_w, mat_bias, EPILOGUE_BIAS_GELU, mat_out);
+
+        cudaEvent_t start_gpu, stop_gpu;
+        cudaEventCreate(&start_gpu);
+        cudaEventCreate(&stop_gpu);
+        cudaEventRecord(start_gpu);
+
+        gemmCUDA(mat_a, mat_w, mat_bias, EPILOGUE_BIAS_GELU, mat_out);
+
+        cudaEventRecord(stop_gpu);
+        cudaEventSynchronize(stop_gpu);
+        float gpu_time_milliseconds;
+        cudaEventElapsedTime(&gpu_time_milliseconds, start_gpu, stop_gpu);
+
+        cpu_convert(c_output_gpu, gpu_c_output_gpu, aRows * bRows * sizeof(float));
+        std::cout << names[backend] << " " << precisions[dtype] << " time: " << gpu_time_milliseconds << " milliseconds, " <<
+            gflops(aRows, bRows, aCols, gpu_time_milliseconds) << " GFLOP/s, ";
+        if (compareMatrices(cpu_out.dat, c_output_gpu, aRows, bRows)) {
+            std::cout << "Test GEMM backend " << names[backend] << " " << precisions[dtype] << " PASSED." << std::endl;
+        } else {
+            std::cout << "Test GEMM backend " << names[backend] << " " << precisions[dtype] << " FAILED." << std::endl;
+        }
+    }
+    gemmInitCUDA(GEMM_CUSTOM, 0);
+
+    free(a_input);
+    free(b_input);
+    free(bias_input);
+    free(cpu_out.dat);
+    free(c_output_gpu);
+    cudaFree(gpu_a_input);
+    cudaFree(gpu_b_input);
+    cudaFree(gpu_bias_input);
+    cudaFree(gpu_b_half);
+    cudaFree(gpu_c_output_gpu);
+}
+
+// The residual epilogue adds the biased product to what the output already holds, on every
+// backend and precision, for decode steps (the skinny kernels) as well as prompts (the tiled ones)
+void gemmResidualTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test GEMM residual epilogue RUNNING." << std::endl;
+
+    const int rowCounts[] = {5, 300};
+    const int aCols = 256;
+    const int bRows = 192;
+
+    const char *names[] = {"custom", "cublas", "cublaslt"};
+    const char *precisions[] = {"fp32", "fp16", "bf16"};
+
+    for (int aRows : rowCounts) {
+        // Small inputs, so that rounding the weights to 16 bits stays within the tolerance
+        float *a_input = generateRandomMatrix(aRows, aCols);
+        float *b_input = generateRandomMatrix(bRows, aCols);
+        float *bias_input = generateRandomMatrix(1, bRows);
+        float *residual_input = generateRandomMatrix(aRows, bRows);
+        LOOP(i, aRows * aCols) a_input[i] /= -1e4;
+
+        float *cpu_out = (float*) calloc(aRows * bRows, sizeof(float));
+        matMulCPU(a_input, aRows, aCols, b_input, bRows, aCols, cpu_out);
+        LOOP(i, aRows * bRows) cpu_out[i] += bias_input[i % bRows] + residual_input[i];
+
+        float *gpu_a_input = cuda_convert(a_input, aRows * aCols * sizeof(float));
+        float *gpu_b_input = cuda_convert(b_input, bRows * aCols * sizeof(float));
+        float *gpu_bias_input = cuda_convert(bias_input, bRows * sizeof(float));
+        float *gpu_out = cuda_convert(residual_input, aRows * bRows * sizeof(float));
+        float *gpu_b_half;
+        cudaMalloc((void**)&gpu_b_half, bRows * aCols * 2);
+        float *c_output_gpu = (float*) malloc(aRows * bRows * sizeof(float));
+
+        Matrix mat_a = {gpu_a_input, aRows, aCols};
+        Matrix mat_bias = {gpu_bias_input, 1, bRows};
+        Matrix mat_out = {gpu_out, aRows, bRows};
+        LOOP(dtype, 3) LOOP(backend, 3) {
+            Matrix mat_w = {gpu_b_input, bRows, aCols};
+            if (dtype != DTYPE_FP32) {
+                mat_w = (Matrix){gpu_b_half, bRows, aCols, dtype};
+                castCUDA((Matrix){gpu_b_input, bRows, aCols}, mat_w);
+            }
+            gemmInitCUDA(backend, (size_t)aRows * aCols);
+            cudaMemcpy(gpu_out, residual_input, aRows * bRows * sizeof(float), cudaMemcpyHostToDevice);
+            gemmCUDA(mat_a, mat_w, mat_bias, EPILOGUE_BIAS_RESIDUAL, mat_out);
+
+            cpu_convert(c_output_gpu, gpu_out, aRows * bRows * sizeof(float));
+            std::cout << aRows << " rows, " << names[backend] << " " << precisions[dtype] << ": ";
+            if (compareMatrices(cpu_out, c_output_gpu, aRows, bRows)) {
+                std::cout << "Test GEMM residual epilogue PASSED." << std::endl;
+            } else {
+                std::cout << "Test GEMM residual epilogue FAILED." << std::endl;
+            }
+        }
+        gemmInitCUDA(GEMM_CUSTOM, 0);
+
+        free(a_input);
+        free(b_input);
+        free(bias_input);
+        free(residual_input);
+        free(cpu_out);
+        free(c_output_gpu);
+        cudaFree(gpu_a_input);
+        cudaFree(gpu_b_input);
+        cudaFree(gpu_bias_input);
+        cudaFree(gpu_out);
+        cudaFree(gpu_b_half);
+    }
+}
+
 void sumCPU(float *input, float *output, int rows, int cols) {
     for (size_t i = 0; i < rows * cols; i++) {
         output[(i/cols)*cols] += input[i];
@@ -384,7 +714,6 @@ void cudaSumTest() {
     cudaEventRecord(start_gpu);
 
     sumCUDA(mat_in, mat_out);
-    broadcastCUDA(mat_out, 0);
 
     cudaEventRecord(stop_gpu);
     cudaEventSynchronize(stop_gpu);
@@ -416,6 +745,69 @@ void cudaSumTest() {
     cudaFree(gpu_output_gpu);
 }
 
+// Every reduction of rowReduceCUDA against the same one in double on the CPU, over
+// rows as long as a token's hidden state and as long as its logits, with negative
+// values so the max is not simply the last one to come up
+void rowReduceTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test RowReduce RUNNING." << std::endl;
+    const char *names[] = {"sum", "max", "sum of squares", "logsumexp"};
+    const int shapes[][2] = {{3200, 768}, {8, 50000}};
+    bool passed = true;
+
+    for (auto shape : shapes) {
+        int rows = shape[0], cols = shape[1];
+        float *input = generateRandomMatrix(rows, cols);
+        for (int i = 0; i < rows * cols; i++) {
+            input[i] -= 5;
+        }
+        float *output = (float *) malloc(sizeof(float) * rows * cols);
+        Matrix gpu_in = {cuda_convert(input, rows * cols * sizeof(float)), rows, cols};
+        Matrix gpu_out = {cuda_convert(input, rows * cols * sizeof(float)), rows, cols};
+
+        for (int reduce = REDUCE_SUM; reduce <= REDUCE_LOGSUMEXP; reduce++) {
+            rowReduceCUDA(gpu_in, reduce, gpu_out);
+            cpu_convert(output, gpu_out.dat, rows * cols * sizeof(float));
+
+            double worst = 0;
+            for (int r = 0; r < rows; r++) {
+                double expected = reduce == REDUCE_MAX ? -INFINITY : 0, max = -INFINITY;
+                for (int c = 0; c < cols; c++) {
+                    double x = input[r * cols + c];
+                    if (reduce == REDUCE_SUM) expected += x;
+                    if (reduce == REDUCE_MAX) expected = std::max(expected, x);
+                    if (reduce == REDUCE_SUM_SQUARES) expected += x * x;
+                    max = std::max(max, x);
+                }
+                if (reduce == REDUCE_LOGSUMEXP) {
+                    for (int c = 0; c < cols; c++) {
+                        expected += exp(input[r * cols + c] - max);
+                    }
+                    expected = max + log(expected);
+                }
+                // The same result in every column, within the rounding of a float sum
+                for (int c = 0; c < cols; c++) {
+                    worst = std::max(worst, fabs(output[r * cols + c] - expected) / std::max(1.0, fabs(expected)));
+                }
+            }
+            std::cout << names[reduce] << " of " << rows << " x " << cols << ": largest relative error " << worst
+                      << std::endl;
+            passed &= worst < 1e-4;
+        }
+
+        free(input);
+        free(output);
+        cudaFree(gpu_in.dat);
+        cudaFree(gpu_out.dat);
+    }
+
+    if (passed) {
+        std::cout << "Test RowReduce PASSED." << std::endl;
+    } else {
+        std::cout << "Test RowReduce FAILED." << std::endl;
+    }
+}
+
 void transposeCPU(float *input, float *output, int rows, int cols) {
     for (int i = 0; i < rows * cols; i++) {
         output[i % cols * rows + i / cols] = input[i];
@@ -484,6 +876,798 @@ void cudaTransposeTest() {
     cudaFree(gpu_h_input);
 }
 
+// Mirrors LayerNorm in cpu/c_chat_gpt_2.c, with calloc and cloneMatrix standing in for its arena
+Matrix LayerNormCPU(Matrix a, Matrix weight, Matrix bias) {
+    Matrix mean = {(float *) calloc(a.rows * a.cols, sizeof(float)), a.rows, a.cols};
+    sumCPU(a.dat, mean.dat, a.rows, a.cols);
+    Matrix b = add(a, divide_const(mean, -a.cols));
+
+    Matrix square = multiply(cloneMatrix(b), b);
+    Matrix k = {(float *) calloc(a.rows * a.cols, sizeof(float)), a.rows, a.cols};
+    sumCPU(square.dat, k.dat, a.rows, a.cols);
+    divide_const(k, b.cols - 1);
+
+    Matrix out = add_tile(multiply_tile(multiply(cloneMatrix(b), mat_isqrt(add_const(k, 1e-5), 0)), weight), bias);
+
+    free(mean.dat);
+    free(square.dat);
+    free(k.dat);
+    return out;
+}
+
+void cudaLayerNormTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test LayerNorm RUNNING." << std::endl;
+    const int rows = 3200;
+    const int cols = 768;
+
+    Matrix cpu_in = {generateRandomMatrix(rows, cols), rows, cols};
+    Matrix weight = {generateRandomMatrix(1, cols), 1, cols};
+    Matrix bias = {generateRandomMatrix(1, cols), 1, cols};
+    // Use a different bias than weight so a swapped argument would be caught
+    for (int i = 0; i < cols; i++) {
+        bias.dat[i] -= 5;
+    }
+
+    Matrix gpu_in = {cuda_convert(cpu_in.dat, rows * cols * sizeof(float)), rows, cols};
+    Matrix gpu_out = {cuda_convert(cpu_in.dat, rows * cols * sizeof(float)), rows, cols};
+    Matrix gpu_weight = {cuda_convert(weight.dat, cols * sizeof(float)), 1, cols};
+    Matrix gpu_bias = {cuda_convert(bias.dat, cols * sizeof(float)), 1, cols};
+    float *output_gpu = (float *) malloc(sizeof(float) * rows * cols);
+
+    cudaEvent_t start_cpu, stop_cpu;
+    cudaEventCreate(&start_cpu);
+    cudaEventCreate(&stop_cpu);
+    cudaEventRecord(start_cpu);
+
+    Matrix cpu_out = LayerNormCPU(cpu_in, weight, bias);
+
+    cudaEventRecord(stop_cpu);
+    cudaEventSynchronize(stop_cpu);
+    float cpu_time_milliseconds;
+    cudaEventElapsedTime(&cpu_time_milliseconds, start_cpu, stop_cpu);
+
+    cudaEvent_t start_gpu, stop_gpu;
+    cudaEventCreate(&start_gpu);
+    cudaEventCreate(&stop_gpu);
+    cudaEventRecord(start_gpu);
+
+    layerNormCUDA(gpu_in, gpu_out, gpu_weight, gpu_bias);
+
+    cudaEventRecord(stop_gpu);
+    cudaEventSynchronize(stop_gpu);
+    float gpu_time_milliseconds;
+    cudaEventElapsedTime(&gpu_time_milliseconds, start_gpu, stop_gpu);
+
+    cpu_convert(output_gpu, gpu_out.dat, rows * cols * sizeof(float));
+
+    std::cout << std::endl;
+    std::cout << "CPU time: " << cpu_time_milliseconds << " milliseconds" << std::endl;
+    std::cout << "GPU time: " << gpu_time_milliseconds << " milliseconds" << std::endl;
+    std::cout << std::endl << "Speedup factor: " <<
+        cpu_time_milliseconds / gpu_time_milliseconds << std::endl << std::endl;
+
+    if (compareMatrices(cpu_out.dat, output_gpu, rows, cols)) {
+        std::cout << "Test LayerNorm PASSED." << std::endl;
+    } else {
+        std::cout << "Test LayerNorm FAILED." << std::endl;
+    }
+
+    free(cpu_in.dat);
+    free(cpu_out.dat);
+    free(weight.dat);
+    free(bias.dat);
+    free(output_gpu);
+    cudaFree(gpu_in.dat);
+    cudaFree(gpu_out.dat);
+    cudaFree(gpu_weight.dat);
+    cudaFree(gpu_bias.dat);
+}
+
+// Reference causal attention: row r of qkv is the query at position pos + r and
+// attends to the last window cached positions up to pos + r, with the cache laid
+// out [head][position][64] as a ring of cache_len positions
+void attentionCPU(float *qkv, float *k_cache, float *v_cache, int rows, int dim, int pos, int cache_len, int window,
+                  float *out) {
+    float *scores = (float *) malloc((pos + rows) * sizeof(float));
+    for (int head = 0; head < dim / 64; head++) {
+        float *keys = k_cache + head * cache_len * 64;
+        float *values = v_cache + head * cache_len * 64;
+        for (int r = 0; r < rows; r++) {
+            float *q = qkv + r * 3 * dim + head * 64;
+            float total = 0;
+            int first = pos + r - window + 1 > 0 ? pos + r - window + 1 : 0;
+            for (int key = first; key <= pos + r; key++) {
+                float dot = 0;
+                LOOP(d, 64) dot += q[d] * keys[key % cache_len * 64 + d];
+                scores[key] = exp(dot / 8);
+                total += scores[key];
+            }
+            LOOP(d, 64) {
+                float value = 0;
+                for (int key = first; key <= pos + r; key++) {
+                    value += scores[key] * values[key % cache_len * 64 + d];
+                }
+                out[r * dim + head * 64 + d] = value / total;
+            }
+        }
+    }
+    free(scores);
+}
+
+void cudaAttentionTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test Attention RUNNING." << std::endl;
+    // 37 new rows on top of 100 cached positions, so both the mask and
+    // the partial last key tile are exercised
+    const int rows = 37;
+    const int dim = 768;
+    const int pos = 100;
+    const int cache_len = 256;
+
+    float *qkv = generateRandomMatrix(rows, 3 * dim);
+    float *k_cache = generateRandomMatrix(dim / 64 * cache_len, 64);
+    float *v_cache = generateRandomMatrix(dim / 64 * cache_len, 64);
+    LOOP(i, rows * 3 * dim) qkv[i] = qkv[i] / 10 - .5;
+    LOOP(i, dim * cache_len) k_cache[i] = k_cache[i] / 10 - .5;
+
+    float *gpu_qkv = cuda_convert(qkv, rows * 3 * dim * sizeof(float));
+    float *gpu_k_cache = cuda_convert(k_cache, dim * cache_len * sizeof(float));
+    float *gpu_v_cache = cuda_convert(v_cache, dim * cache_len * sizeof(float));
+    float *output_cpu = (float *) malloc(rows * dim * sizeof(float));
+    float *output_gpu = (float *) malloc(rows * dim * sizeof(float));
+    float *gpu_output_gpu = cuda_convert(output_gpu, rows * dim * sizeof(float));
+
+    // The new rows have to be in the cache before they can be attended to
+    LOOP(head, dim / 64) LOOP(r, rows) LOOP(d, 64) {
+        k_cache[(head * cache_len + pos + r) * 64 + d] = qkv[r * 3 * dim + dim + head * 64 + d];
+        v_cache[(head * cache_len + pos + r) * 64 + d] = qkv[r * 3 * dim + 2 * dim + head * 64 + d];
+    }
+    Matrix mat_qkv = {gpu_qkv, rows, 3 * dim};
+    Matrix mat_out = {gpu_output_gpu, rows, dim};
+    kvCacheCUDA(mat_qkv, gpu_k_cache, gpu_v_cache, pos, cache_len);
+
+    cudaEvent_t start_cpu, stop_cpu;
+    cudaEventCreate(&start_cpu);
+    cudaEventCreate(&stop_cpu);
+    cudaEventRecord(start_cpu);
+
+    attentionCPU(qkv, k_cache, v_cache, rows, dim, pos, cache_len, cache_len, output_cpu);
+
+    cudaEventRecord(stop_cpu);
+    cudaEventSynchronize(stop_cpu);
+    float cpu_time_milliseconds;
+    cudaEventElapsedTime(&cpu_time_milliseconds, start_cpu, stop_cpu);
+
+    cudaEvent_t start_gpu, stop_gpu;
+    cudaEventCreate(&start_gpu);
+    cudaEventCreate(&stop_gpu);
+    cudaEventRecord(start_gpu);
+
+    attentionCUDA(mat_qkv, gpu_k_cache, gpu_v_cache, pos, cache_len, mat_out);
+
+    cudaEventRecord(stop_gpu);
+    cudaEventSynchronize(stop_gpu);
+    float gpu_time_milliseconds;
+    cudaEventElapsedTime(&gpu_time_milliseconds, start_gpu, stop_gpu);
+
+    cpu_convert(output_gpu, gpu_output_gpu, rows * dim * sizeof(float));
+
+    std::cout << std::endl;
+    std::cout << "CPU time: " << cpu_time_milliseconds << " milliseconds" << std::endl;
+    std::cout << "GPU time: " << gpu_time_milliseconds << " milliseconds" << std::endl;
+    std::cout << std::endl << "Speedup factor: " <<
+        cpu_time_milliseconds / gpu_time_milliseconds << std::endl << std::endl;
+
+    if (compareMatrices(output_cpu, output_gpu, rows, dim)) {
+        std::cout << "Test Attention PASSED." << std::endl;
+    } else {
+        std::cout << "Test Attention FAILED." << std::endl;
+    }
+
+    free(qkv);
+    free(k_cache);
+    free(v_cache);
+    free(output_cpu);
+    free(output_gpu);
+    cudaFree(gpu_qkv);
+    cudaFree(gpu_k_cache);
+    cudaFree(gpu_v_cache);
+    cudaFree(gpu_output_gpu);
+}
+void cudaAttentionBatchTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test Attention Batch RUNNING." << std::endl;
+    // Four sequences stacked into one batch, each at its own position and with
+    // its own blocks, scattered over the cache: a prefill, a partial prefill on top
+    // of a history, a single decode row, so blocks of different sequences share the
+    // launch, and two rows past the end of the cache, which wrap around its ring
+    // and only see the last window positions
+    const int dim = 768;
+    const int cache_len = 64;
+    const int block_len = 16;
+    const int window = 48;
+    const int count = 4;
+    const int seq_blocks = cache_len / block_len;
+    const int num_blocks = count * seq_blocks;
+    const int seq_rows[count] = {7, 3, 1, 2};
+    const int seq_pos[count] = {0, 5, 40, 100};
+    const size_t block_size = (size_t)dim * block_len;
+    const size_t cache_size = num_blocks * block_size;
+
+    Batch batch = {count};
+    int rows = 0;
+    LOOP(s, count) {
+        batch.first_row[s] = rows;
+        batch.pos[s] = seq_pos[s];
+        LOOP(i, seq_blocks) batch.blocks[s][i] = (5 * (s * seq_blocks + i) + 3) % num_blocks;
+        rows += seq_rows[s];
+    }
+    batch.first_row[count] = rows;
+
+    float *qkv = generateRandomMatrix(rows, 3 * dim);
+    float *k_cache = generateRandomMatrix(num_blocks * dim / 64 * block_len, 64);
+    float *v_cache = generateRandomMatrix(num_blocks * dim / 64 * block_len, 64);
+    LOOP(i, rows * 3 * dim) qkv[i] = qkv[i] / 10 - .5;
+    LOOP(i, cache_size) k_cache[i] = k_cache[i] / 10 - .5;
+
+    float *gpu_qkv = cuda_convert(qkv, rows * 3 * dim * sizeof(float));
+    float *gpu_k_cache = cuda_convert(k_cache, cache_size * sizeof(float));
+    float *gpu_v_cache = cuda_convert(v_cache, cache_size * sizeof(float));
+    float *output_cpu = (float *) malloc(rows * dim * sizeof(float));
+    float *output_gpu = (float *) malloc(rows * dim * sizeof(float));
+    float *cache_gpu = (float *) malloc(cache_size * sizeof(float));
+    float *seq_k = (float *) malloc((size_t)dim * cache_len * sizeof(float));
+    float *seq_v = (float *) malloc((size_t)dim * cache_len * sizeof(float));
+    float *gpu_output_gpu = cuda_convert(output_gpu, rows * dim * sizeof(float));
+    Batch *gpu_batch;
+    cudaMalloc(&gpu_batch, sizeof(Batch));
+    cudaMemcpy(gpu_batch, &batch, sizeof(Batch), cudaMemcpyHostToDevice);
+
+    // Each sequence on its own, against its blocks gathered into one cache
+    LOOP(s, count) {
+        float *seq_qkv = qkv + (size_t)batch.first_row[s] * 3 * dim;
+        LOOP(r, seq_rows[s]) LOOP(head, dim / 64) LOOP(d, 64) {
+            int p = (seq_pos[s] + r) % cache_len;
+            size_t paged = batch.blocks[s][p / block_len] * block_size + (head * block_len + p % block_len) * 64 + d;
+            k_cache[paged] = seq_qkv[r * 3 * dim + dim + head * 64 + d];
+            v_cache[paged] = seq_qkv[r * 3 * dim + 2 * dim + head * 64 + d];
+        }
+        LOOP(head, dim / 64) LOOP(p, cache_len) LOOP(d, 64) {
+            size_t paged = batch.blocks[s][p / block_len] * block_size + (head * block_len + p % block_len) * 64 + d;
+            seq_k[(head * cache_len + p) * 64 + d] = k_cache[paged];
+            seq_v[(head * cache_len + p) * 64 + d] = v_cache[paged];
+        }
+        attentionCPU(seq_qkv, seq_k, seq_v, seq_rows[s], dim, seq_pos[s], cache_len, window,
+                     output_cpu + (size_t)batch.first_row[s] * dim);
+    }
+
+    Matrix mat_qkv = {gpu_qkv, rows, 3 * dim};
+    Matrix mat_out = {gpu_output_gpu, rows, dim};
+    kvCacheBatchCUDA(mat_qkv, gpu_k_cache, gpu_v_cache, gpu_batch, cache_len, block_len, block_size);
+    attentionBatchCUDA(mat_qkv, gpu_k_cache, gpu_v_cache, gpu_batch, count, cache_len, block_len, block_size, window,
+                       mat_out);
+
+    cpu_convert(output_gpu, gpu_output_gpu, rows * dim * sizeof(float));
+    bool passed = compareMatrices(output_cpu, output_gpu, rows, dim);
+    cpu_convert(cache_gpu, gpu_k_cache, cache_size * sizeof(float));
+    passed = passed && compareMatrices(k_cache, cache_gpu, num_blocks * dim / 64 * block_len, 64);
+    cpu_convert(cache_gpu, gpu_v_cache, cache_size * sizeof(float));
+    passed = passed && compareMatrices(v_cache, cache_gpu, num_blocks * dim / 64 * block_len, 64);
+
+    if (passed) {
+        std::cout << "Test Attention Batch PASSED." << std::endl;
+    } else {
+        std::cout << "Test Attention Batch FAILED." << std::endl;
+    }
+
+    free(qkv);
+    free(k_cache);
+    free(v_cache);
+    free(output_cpu);
+    free(output_gpu);
+    free(cache_gpu);
+    free(seq_k);
+    free(seq_v);
+    cudaFree(gpu_qkv);
+    cudaFree(gpu_k_cache);
+    cudaFree(gpu_v_cache);
+    cudaFree(gpu_output_gpu);
+    cudaFree(gpu_batch);
+}
+
+// A fork the way the demo makes one: the child starts out with the block table of its
+// parent, sharing every block, and before its first step gets its own copy of the
+// partly filled last one, while the full one before it stays shared. Both then write
+// their own rows at the same positions in one launch. Each has to see the shared
+// history and its own rows only, the shared block has to stay as it was, and the copy
+// has to keep what the parent had in it.
+void cudaAttentionSharedBlocksTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test Attention Shared Blocks RUNNING." << std::endl;
+    const int dim = 768;
+    const int cache_len = 64;
+    const int block_len = 16;
+    const int num_blocks = 8;
+    const int count = 2;
+    const int history = 20;
+    const int seq_rows[count] = {1, 3};
+    const int shared = 2, parent_last = 5, child_last = 7;
+    const size_t block_size = (size_t)dim * block_len;
+    const size_t cache_size = num_blocks * block_size;
+
+    Batch batch = {count};
+    int rows = 0;
+    LOOP(s, count) {
+        batch.first_row[s] = rows;
+        batch.pos[s] = history;
+        LOOP(i, MAX_BLOCKS) batch.blocks[s][i] = -1;
+        batch.blocks[s][0] = shared;
+        rows += seq_rows[s];
+    }
+    batch.first_row[count] = rows;
+    batch.blocks[0][1] = parent_last;
+    batch.blocks[1][1] = child_last;
+
+    float *qkv = generateRandomMatrix(rows, 3 * dim);
+    float *k_cache = generateRandomMatrix(num_blocks * dim / 64 * block_len, 64);
+    float *v_cache = generateRandomMatrix(num_blocks * dim / 64 * block_len, 64);
+    LOOP(i, rows * 3 * dim) qkv[i] = qkv[i] / 10 - .5;
+    LOOP(i, cache_size) k_cache[i] = k_cache[i] / 10 - .5;
+
+    float *gpu_qkv = cuda_convert(qkv, rows * 3 * dim * sizeof(float));
+    float *gpu_k_cache = cuda_convert(k_cache, cache_size * sizeof(float));
+    float *gpu_v_cache = cuda_convert(v_cache, cache_size * sizeof(float));
+    float *output_cpu = (float *) malloc(rows * dim * sizeof(float));
+    float *output_gpu = (float *) malloc(rows * dim * sizeof(float));
+    float *cache_gpu = (float *) malloc(cache_size * sizeof(float));
+    float *seq_k = (float *) calloc((size_t)dim * cache_len, sizeof(float));
+    float *seq_v = (float *) calloc((size_t)dim * cache_len, sizeof(float));
+    float *gpu_output_gpu = cuda_convert(output_gpu, rows * dim * sizeof(float));
+    Batch *gpu_batch;
+    cudaMalloc(&gpu_batch, sizeof(Batch));
+    cudaMemcpy(gpu_batch, &batch, sizeof(Batch), cudaMemcpyHostToDevice);
+
+    // The copy on write, a whole block of keys and one of values, as copy_block does it
+    memcpy(k_cache + child_last * block_size, k_cache + parent_last * block_size, block_size * sizeof(float));
+    memcpy(v_cache + child_last * block_size, v_cache + parent_last * block_size, block_size * sizeof(float));
+    cudaMemcpy(gpu_k_cache + child_last * block_size, gpu_k_cache + parent_last * block_size,
+               block_size * sizeof(float), cudaMemcpyDeviceToDevice);
+    cudaMemcpy(gpu_v_cache + child_last * block_size, gpu_v_cache + parent_last * block_size,
+               block_size * sizeof(float), cudaMemcpyDeviceToDevice);
+
+    LOOP(s, count) {
+        float *seq_qkv = qkv + (size_t)batch.first_row[s] * 3 * dim;
+        LOOP(r, seq_rows[s]) LOOP(head, dim / 64) LOOP(d, 64) {
+            int p = history + r;
+            size_t paged = batch.blocks[s][p / block_len] * block_size + (head * block_len + p % block_len) * 64 + d;
+            k_cache[paged] = seq_qkv[r * 3 * dim + dim + head * 64 + d];
+            v_cache[paged] = seq_qkv[r * 3 * dim + 2 * dim + head * 64 + d];
+        }
+        LOOP(head, dim / 64) LOOP(p, history + seq_rows[s]) LOOP(d, 64) {
+            size_t paged = batch.blocks[s][p / block_len] * block_size + (head * block_len + p % block_len) * 64 + d;
+            seq_k[(head * cache_len + p) * 64 + d] = k_cache[paged];
+            seq_v[(head * cache_len + p) * 64 + d] = v_cache[paged];
+        }
+        attentionCPU(seq_qkv, seq_k, seq_v, seq_rows[s], dim, history, cache_len, cache_len,
+                     output_cpu + (size_t)batch.first_row[s] * dim);
+    }
+
+    Matrix mat_qkv = {gpu_qkv, rows, 3 * dim};
+    Matrix mat_out = {gpu_output_gpu, rows, dim};
+    kvCacheBatchCUDA(mat_qkv, gpu_k_cache, gpu_v_cache, gpu_batch, cache_len, block_len, block_size);
+    attentionBatchCUDA(mat_qkv, gpu_k_cache, gpu_v_cache, gpu_batch, count, cache_len, block_len, block_size,
+                       cache_len, mat_out);
+
+    // Every block compared, so the shared one and the parent's last have to be untouched
+    // by the child's rows, and its copy has to hold the parent's positions before them
+    cpu_convert(output_gpu, gpu_output_gpu, rows * dim * sizeof(float));
+    bool passed = compareMatrices(output_cpu, output_gpu, rows, dim);
+    cpu_convert(cache_gpu, gpu_k_cache, cache_size * sizeof(float));
+    passed = passed && compareMatrices(k_cache, cache_gpu, num_blocks * dim / 64 * block_len, 64);
+    cpu_convert(cache_gpu, gpu_v_cache, cache_size * sizeof(float));
+    passed = passed && compareMatrices(v_cache, cache_gpu, num_blocks * dim / 64 * block_len, 64);
+
+    if (passed) {
+        std::cout << "Test Attention Shared Blocks PASSED." << std::endl;
+    } else {
+        std::cout << "Test Attention Shared Blocks FAILED." << std::endl;
+    }
+
+    free(qkv);
+    free(k_cache);
+    free(v_cache);
+    free(output_cpu);
+    free(output_gpu);
+    free(cache_gpu);
+    free(seq_k);
+    free(seq_v);
+    cudaFree(gpu_qkv);
+    cudaFree(gpu_k_cache);
+    cudaFree(gpu_v_cache);
+    cudaFree(gpu_output_gpu);
+    cudaFree(gpu_batch);
+}
+// The sampler the way the CPU demo does it, with sorting instead of radix select
+#define SAMPLE_ONE (1ull << 40)
+
+// The fixed point probabilities of row into weights, returning their sum
+unsigned long long distributionCPU(float *row, int cols, Sampler sampler, std::vector<unsigned long long> &weights) {
+    float inv_temperature = 1 / sampler.temperature;
+    std::vector<float> logits(cols);
+    weights.resize(cols);
+    float max = -INFINITY, cutoff = -INFINITY;
+    LOOP(i, cols) {
+        logits[i] = row[i] * inv_temperature;
+        max = fmaxf(max, logits[i]);
+    }
+    if (sampler.top_k > 0 && sampler.top_k < cols) {
+        std::vector<float> sorted = logits;
+        std::sort(sorted.rbegin(), sorted.rend());
+        cutoff = sorted[sampler.top_k - 1];
+    }
+    unsigned long long total = 0;
+    LOOP(i, cols) {
+        weights[i] = logits[i] >= cutoff ? (unsigned long long)(expf(logits[i] - max) * SAMPLE_ONE) : 0;
+        total += weights[i];
+    }
+    if (sampler.top_p < 1) {
+        unsigned long long target = sampler.top_p * (double)total, sum = 0;
+        target += !target;
+        std::vector<unsigned long long> sorted = weights;
+        std::sort(sorted.rbegin(), sorted.rend());
+        int j = 0;
+        while (sum + sorted[j] < target) sum += sorted[j++];
+        total = 0;
+        LOOP(i, cols) {
+            weights[i] *= weights[i] >= sorted[j];
+            total += weights[i];
+        }
+    }
+    return total;
+}
+
+int pickCPU(std::vector<unsigned long long> &weights, unsigned long long total, double u) {
+    unsigned long long target = u * (double)total, sum = 0;
+    target = target < total ? target : total - 1;
+    LOOP(i, weights.size()) {
+        sum += weights[i];
+        if (sum > target) return i;
+    }
+    return weights.size() - 1;
+}
+
+int sampleCPU(float *row, int cols, Sampler sampler, int sequence, int draw) {
+    std::vector<unsigned long long> weights;
+    unsigned long long total = distributionCPU(row, cols, sampler, weights);
+    return pickCPU(weights, total, philoxUniform(sampler.seed, sequence, draw));
+}
+
+// The acceptance tests of speculative decoding, one proposal after the other.
+// Returns how many were accepted and sets next to the token after them.
+int speculateCPU(float *logits, float *draft, int rows, int cols, int *proposed, int k, Sampler sampler,
+                 int sequence, int draw, int *next) {
+    std::vector<unsigned long long> p, q;
+    unsigned long long p_total, q_total;
+    int n = 0;
+    for (;; n++) {
+        p_total = distributionCPU(logits + (size_t)n * cols, cols, sampler, p);
+        if (n == k) break;
+        q_total = distributionCPU(draft + (size_t)n * rows * cols, cols, sampler, q);
+        double u = philoxUniform(sampler.seed, sequence, DRAW_ACCEPT | (draw + n));
+        int x = proposed[n];
+        if (!(u * (double)q[x] * (double)p_total < (double)p[x] * (double)q_total)) break;
+    }
+    double u = philoxUniform(sampler.seed, sequence, draw + n);
+    unsigned long long residual = 0;
+    if (n < k) {
+        LOOP(i, cols) {
+            double r = (double)p[i] / (double)p_total - (double)q[i] / (double)q_total;
+            q[i] = r > 0 ? (unsigned long long)(r * SAMPLE_ONE) : 0;
+            residual += q[i];
+        }
+    }
+    *next = residual ? pickCPU(q, residual, u) : pickCPU(p, p_total, u);
+    return n;
+}
+
+void sampleTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test Sample RUNNING." << std::endl;
+    // Three sequences with their own random streams, each drawing a few tokens,
+    // with and without top-k and top-p. top_k = 1 has to be the argmax. The second
+    // one has a temperature of its own.
+    const int rows = 3;
+    const int cols = 50000;
+    const int draws = 4;
+    const Sampler samplers[] = {{0.7, 0, 1, 123}, {1.0, 40, 1, 5}, {0.8, 0, 0.9, 7}, {1.0, 50, 0.5, 9}, {1.0, 1, 1, 11}};
+
+    float *logits = generateRandomMatrix(rows, cols);
+    float *gpu_logits = cuda_convert(logits, rows * cols * sizeof(float));
+    Matrix mat_logits = {gpu_logits, rows, cols};
+    Batch batch = {rows};
+    batch.temperature[1] = 1.5;
+    Batch *gpu_batch;
+    cudaMalloc(&gpu_batch, sizeof(Batch));
+    int *tokens;
+    cudaMallocHost(&tokens, rows * sizeof(int));
+    samplerInitCUDA(rows, cols);
+
+    bool passed = true;
+    for (Sampler sampler : samplers) {
+        LOOP(d, draws) {
+            LOOP(s, rows) {
+                batch.sequence[s] = s + 1;
+                batch.draw[s] = d;
+            }
+            cudaMemcpy(gpu_batch, &batch, sizeof(Batch), cudaMemcpyHostToDevice);
+            sampleCUDA(mat_logits, gpu_batch, sampler, tokens);
+            cudaDeviceSynchronize();
+            LOOP(s, rows) {
+                Sampler own = sampler;
+                if (batch.temperature[s] > 0) own.temperature = batch.temperature[s];
+                int expected = sampleCPU(logits + s * cols, cols, own, s + 1, d);
+                if (tokens[s] != expected) {
+                    std::cout << "top_k " << sampler.top_k << " top_p " << sampler.top_p << " row " << s
+                              << ": GPU sampled " << tokens[s] << ", CPU " << expected << std::endl;
+                    passed = false;
+                }
+            }
+        }
+    }
+
+    if (passed) {
+        std::cout << "Test Sample PASSED." << std::endl;
+    } else {
+        std::cout << "Test Sample FAILED." << std::endl;
+    }
+
+    free(logits);
+    cudaFree(gpu_logits);
+    cudaFree(gpu_batch);
+    cudaFreeHost(tokens);
+}
+
+void lmHeadTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test LM Head RUNNING." << std::endl;
+    // The logits of a few rows against the embedding table, and then the tokens drawn
+    // from the candidates the head kept, which have to be those drawn from the logits
+    const int rows = 5;
+    const int dim = 64;
+    const int vocab = 50000;
+    const int draws = 4;
+    const Sampler samplers[] = {{1.0, 40, 1, 5}, {0.8, 64, 0.9, 7}, {1.0, 1, 1, 11}};
+
+    float *a = generateRandomMatrix(rows, dim);
+    LOOP(i, rows * dim) a[i] *= 0.01f;
+    float *wte = generateRandomMatrix(vocab, dim);
+    float *expected = (float *)calloc((size_t)rows * vocab, sizeof(float));
+    float *logits = (float *)malloc((size_t)rows * vocab * sizeof(float));
+    matMulCPU(a, rows, dim, wte, vocab, dim, expected);
+
+    float *gpu_a = cuda_convert(a, rows * dim * sizeof(float));
+    float *gpu_wte = cuda_convert(wte, (size_t)vocab * dim * sizeof(float));
+    float *gpu_logits;
+    cudaMalloc(&gpu_logits, (size_t)rows * vocab * sizeof(float));
+    Matrix mat_a = {gpu_a, rows, dim}, mat_wte = {gpu_wte, vocab, dim}, mat_logits = {gpu_logits, rows, vocab};
+    Batch batch = {rows};
+    batch.temperature[2] = 1.5;
+    Batch *gpu_batch;
+    cudaMalloc(&gpu_batch, sizeof(Batch));
+    cudaMemcpy(gpu_batch, &batch, sizeof(Batch), cudaMemcpyHostToDevice);
+    int *tokens;
+    cudaMallocHost(&tokens, rows * sizeof(int));
+    samplerInitCUDA(rows, vocab);
+
+    bool passed = true;
+    for (Sampler sampler : samplers) {
+        lmHeadCUDA(mat_a, mat_wte, gpu_batch, &sampler, mat_logits);
+        cudaMemcpy(logits, gpu_logits, (size_t)rows * vocab * sizeof(float), cudaMemcpyDeviceToHost);
+        if (!compareMatrices(logits, expected, rows, vocab)) {
+            std::cout << "top_k " << sampler.top_k << ": logits differ" << std::endl;
+            passed = false;
+        }
+        LOOP(d, draws) {
+            LOOP(s, rows) {
+                batch.sequence[s] = s + 1;
+                batch.draw[s] = d;
+            }
+            cudaMemcpy(gpu_batch, &batch, sizeof(Batch), cudaMemcpyHostToDevice);
+            sampleTopCUDA(rows, gpu_batch, sampler, tokens);
+            cudaDeviceSynchronize();
+            LOOP(s, rows) {
+                Sampler own = sampler;
+                if (batch.temperature[s] > 0) own.temperature = batch.temperature[s];
+                int expected_token = sampleCPU(logits + (size_t)s * vocab, vocab, own, s + 1, d);
+                if (tokens[s] != expected_token) {
+                    std::cout << "top_k " << sampler.top_k << " top_p " << sampler.top_p << " row " << s
+                              << ": GPU sampled " << tokens[s] << ", CPU " << expected_token << std::endl;
+                    passed = false;
+                }
+            }
+        }
+    }
+
+    if (passed) {
+        std::cout << "Test LM Head PASSED." << std::endl;
+    } else {
+        std::cout << "Test LM Head FAILED." << std::endl;
+    }
+
+    free(a);
+    free(wte);
+    free(expected);
+    free(logits);
+    cudaFree(gpu_a);
+    cudaFree(gpu_wte);
+    cudaFree(gpu_logits);
+    cudaFree(gpu_batch);
+    cudaFreeHost(tokens);
+}
+
+void speculateTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test Speculate RUNNING." << std::endl;
+    // Three sequences with k proposals each, drawn from the draft logits. The draft
+    // of sequence 0 is close to the target, that of sequence 1 equal to it, so all
+    // of its proposals have to be accepted, and that of sequence 2 unrelated.
+    const int rows = 3;
+    const int cols = 50000;
+    const int k = 3;
+    const int draws = 4;
+    const Sampler samplers[] = {{0.7, 0, 1, 123}, {1.0, 40, 0.9, 5}};
+
+    float *logits = generateRandomMatrix(rows * (k + 1), cols);
+    float *draft = generateRandomMatrix(k * rows, cols);
+    LOOP(j, k) {
+        LOOP(i, cols) {
+            float *target = logits + (size_t)j * cols;
+            draft[((size_t)j * rows + 0) * cols + i] = target[i] + 0.1f * draft[((size_t)j * rows + 0) * cols + i];
+            draft[((size_t)j * rows + 1) * cols + i] = target[(size_t)(k + 1) * cols + i];
+        }
+    }
+    float *gpu_logits = cuda_convert(logits, rows * (k + 1) * cols * sizeof(float));
+    float *gpu_draft = cuda_convert(draft, k * rows * cols * sizeof(float));
+    Matrix mat_logits = {gpu_logits, rows * (k + 1), cols};
+    Matrix mat_draft = {gpu_draft, rows, cols};
+
+    // Sequence s has s more rows in front of its proposals
+    Batch batch = {rows};
+    int num_rows = 0;
+    LOOP(s, rows) {
+        batch.first_row[s] = num_rows;
+        batch.sequence[s] = s + 1;
+        num_rows += s + k;
+    }
+    batch.first_row[rows] = num_rows;
+    std::vector<int> row_tokens(num_rows);
+    Batch *gpu_batch;
+    int *gpu_tokens;
+    cudaMalloc(&gpu_batch, sizeof(Batch));
+    cudaMalloc(&gpu_tokens, num_rows * sizeof(int));
+    int *out;
+    cudaMallocHost(&out, 2 * rows * sizeof(int));
+    samplerInitCUDA(rows, cols);
+
+    bool passed = true;
+    int accepted = 0;
+    for (Sampler sampler : samplers) {
+        LOOP(d, draws) {
+            LOOP(s, rows) {
+                batch.draw[s] = d;
+                LOOP(j, k) {
+                    row_tokens[batch.first_row[s + 1] - k + j] =
+                        sampleCPU(draft + ((size_t)j * rows + s) * cols, cols, sampler, s + 1, DRAW_DRAFT | (d + j));
+                }
+            }
+            cudaMemcpy(gpu_batch, &batch, sizeof(Batch), cudaMemcpyHostToDevice);
+            cudaMemcpy(gpu_tokens, row_tokens.data(), num_rows * sizeof(int), cudaMemcpyHostToDevice);
+            speculateCUDA(mat_logits, mat_draft, gpu_tokens, gpu_batch, sampler, k, out);
+            cudaDeviceSynchronize();
+            LOOP(s, rows) {
+                int next;
+                int n = speculateCPU(logits + (size_t)s * (k + 1) * cols, draft + (size_t)s * cols, rows, cols,
+                                     &row_tokens[batch.first_row[s + 1] - k], k, sampler, s + 1, d, &next);
+                accepted += n;
+                if (out[2 * s] != n || out[2 * s + 1] != next || (s == 1 && n != k)) {
+                    std::cout << "top_k " << sampler.top_k << " row " << s << ": GPU accepted " << out[2 * s]
+                              << " then " << out[2 * s + 1] << ", CPU " << n << " then " << next << std::endl;
+                    passed = false;
+                }
+            }
+        }
+    }
+
+    if (passed) {
+        std::cout << "Test Speculate PASSED (" << accepted << " of " << 2 * draws * rows * k << " accepted)." << std::endl;
+    } else {
+        std::cout << "Test Speculate FAILED." << std::endl;
+    }
+
+    free(logits);
+    free(draft);
+    cudaFree(gpu_logits);
+    cudaFree(gpu_draft);
+    cudaFree(gpu_batch);
+    cudaFree(gpu_tokens);
+    cudaFreeHost(out);
+}
+
+void beamTest() {
+    std::cout << "------------------------------------------" << std::endl;
+    std::cout << "Test Beam RUNNING." << std::endl;
+    // The best k tokens of every row against a sort on the CPU. Row 1 has ties, which
+    // go to the lower token id.
+    const int rows = 3;
+    const int cols = 50000;
+    const int k = MAX_BEAMS;
+
+    float *logits = generateRandomMatrix(rows, cols);
+    LOOP(i, 2 * k) logits[cols + 1000 * i + 7] = 4.0f;
+    float *gpu_logits = cuda_convert(logits, rows * cols * sizeof(float));
+    Matrix mat_logits = {gpu_logits, rows, cols};
+    int *tokens;
+    float *log_probs;
+    cudaMallocHost(&tokens, k * rows * sizeof(int));
+    cudaMallocHost(&log_probs, k * rows * sizeof(float));
+    samplerInitCUDA(rows, cols);
+
+    beamCandidatesCUDA(mat_logits, k);
+    sampledCUDA(tokens, k * rows);
+    sampledLogProbsCUDA(log_probs, k * rows);
+    cudaDeviceSynchronize();
+
+    bool passed = true;
+    std::vector<int> order(cols);
+    std::vector<double> log_sum(rows);
+    LOOP(r, rows) {
+        const float *row = logits + (size_t)r * cols;
+        double max = row[0], sum = 0;
+        LOOP(i, cols) max = fmax(max, row[i]);
+        LOOP(i, cols) sum += exp(row[i] - max);
+        log_sum[r] = max + log(sum);
+        LOOP(i, cols) order[i] = i;
+        std::partial_sort(order.begin(), order.begin() + k, order.end(),
+                          [row](int a, int b) { return row[a] > row[b] || (row[a] == row[b] && a < b); });
+        LOOP(j, k) {
+            int t = tokens[r * k + j];
+            double expected = row[order[j]] - log_sum[r];
+            if (t != order[j] || fabs(log_probs[r * k + j] - expected) > 1e-3) {
+                std::cout << "row " << r << " beam " << j << ": GPU " << t << " at " << log_probs[r * k + j]
+                          << ", CPU " << order[j] << " at " << expected << std::endl;
+                passed = false;
+            }
+        }
+    }
+
+    // The log-probability of the best token of every row, as a drawn token
+    beamCandidatesCUDA(mat_logits, 1);
+    logProbCUDA(mat_logits);
+    sampledCUDA(tokens, rows);
+    sampledLogProbsCUDA(log_probs, rows);
+    cudaDeviceSynchronize();
+    LOOP(r, rows) {
+        double expected = logits[(size_t)r * cols + tokens[r]] - log_sum[r];
+        if (fabs(log_probs[r] - expected) > 1e-3) {
+            std::cout << "row " << r << ": GPU log-probability " << log_probs[r] << ", CPU " << expected << std::endl;
+            passed = false;
+        }
+    }
+
+    if (passed) {
+        std::cout << "Test Beam PASSED." << std::endl;
+    } else {
+        std::cout << "Test Beam FAILED." << std::endl;
+    }
+
+    free(logits);
+    cudaFree(gpu_logits);
+    cudaFreeHost(tokens);
+    cudaFreeHost(log_probs);
+}
+
+
 #define UNARYtest(fn)                                                           \
     void cuda##fn##Test() {                                                     \
         std::cout << "------------------------------------------" << std::endl; \
@@ -635,10 +1819,23 @@ BINARYtest(multiply_tile)
 int main() {
 
     cudaSumTest();
+    rowReduceTest();
     matMulCUDATest();
     matMulCUDATest2();
+    matMulSkinnyTest();
+    matMulQuantTest();
     matMulCublasTest();
+    gemmBackendsTest();
+    gemmResidualTest();
     cudaTransposeTest();
+    cudaLayerNormTest();
+    cudaAttentionTest();
+    cudaAttentionBatchTest();
+    cudaAttentionSharedBlocksTest();
+    sampleTest();
+    lmHeadTest();
+    speculateTest();
+    beamTest();
     cudadivide_constTest();
     cudaadd_constTest();   
     cudamat_isqrtTest(); 
@@ -0,0 +1,325 @@
+// Tests of the host side of the GPU demo, the bookkeeping around the kernels that
+// test.cpp covers. The demo is compiled in whole, with its main out of the way.
+#define main demo_main
+#include "optimized_chat_gpt_2.c"
+#undef main
+
+// A small KV cache of n blocks, all of them free, for a model of one layer of one head
+void reset_cache(int n) {
+    zz = 64;
+    speculate = 0;
+    target_model.nlayer = 1;
+    target_model.local_dim = 64;
+    block_floats = KV_BLOCK * position_bytes() / sizeof(float);
+    num_blocks = n;
+    num_free_blocks = 0;
+    cudaMalloc((void**)&kv_cache, num_blocks * block_floats * sizeof(float));
+    free_blocks = malloc(num_blocks * sizeof(int));
+    block_refs = calloc(num_blocks, sizeof(int));
+    LOOP(b, num_blocks) {
+        free_blocks[num_free_blocks++] = num_blocks - 1 - b;
+    }
+    if (!compute_stream) cudaStreamCreate(&compute_stream);
+}
+
+void free_cache() {
+    cudaFree(kv_cache);
+    free(free_blocks);
+    free(block_refs);
+}
+
+// A sequence with history tokens, the way new_sequence sets one up
+Sequence test_sequence(const int* tokens, int n) {
+    Sequence seq = {0};
+    seq.tokens = malloc((2 * zz + MAX_DRAFT + 1) * sizeof(int));
+    memcpy(seq.tokens, tokens, n * sizeof(int));
+    seq.num_tokens = n;
+    seq.client = -1;
+    memset(seq.blocks, -1, sizeof(seq.blocks));
+    return seq;
+}
+
+// Write value + i % 7 into every float i of block b, and check that it is still there
+void fill_block(int b, float value) {
+    float* block = malloc(block_floats * sizeof(float));
+    LOOP(i, block_floats) {
+        block[i] = value + i % 7;
+    }
+    cudaMemcpy(kv_cache + b * block_floats, block, block_floats * sizeof(float), cudaMemcpyHostToDevice);
+    free(block);
+}
+
+bool block_holds(int b, float value) {
+    float* block = malloc(block_floats * sizeof(float));
+    cudaMemcpy(block, kv_cache + b * block_floats, block_floats * sizeof(float), cudaMemcpyDeviceToHost);
+    bool same = true;
+    LOOP(i, block_floats) {
+        same &= block[i] == value + i % 7;
+    }
+    free(block);
+    return same;
+}
+
+// Whether no block is in use any more, and all of them are on the free list
+bool all_free() {
+    bool unused = num_free_blocks == num_blocks;
+    LOOP(b, num_blocks) {
+        unused &= !block_refs[b];
+    }
+    return unused;
+}
+
+void kvBlocksTest() {
+    printf("------------------------------------------\n");
+    printf("Test KV Blocks RUNNING.\n");
+    reset_cache(8);
+    int tokens[40];
+    LOOP(i, 40) {
+        tokens[i] = i + 1;
+    }
+    bool passed = true;
+
+    // The parent caches 40 positions, in 3 blocks of its own
+    Sequence parent = test_sequence(tokens, 40);
+    passed &= own_blocks(&parent, 0, 40, true) == 3 && num_free_blocks == 8;
+    passed &= own_blocks(&parent, 0, 40, false) == 3 && num_free_blocks == 5;
+    LOOP(i, 3) {
+        passed &= block_refs[parent.blocks[i]] == 1;
+        fill_block(parent.blocks[i], 100 * (i + 1));
+    }
+    parent.processed[0] = 40;
+
+    // The fork shares all of them, and gets a copy of the last one before it writes
+    // its positions 39 and 40 there
+    Sequence child = test_sequence(tokens, 40);
+    child.parent = &parent;
+    child.processed[0] = 39;
+    passed &= forkable(&child);
+    fork_sequence(&child);
+    child.parent = NULL;
+    LOOP(i, 3) {
+        passed &= child.blocks[i] == parent.blocks[i] && block_refs[parent.blocks[i]] == 2;
+    }
+    passed &= own_blocks(&child, 39, 41, true) == 1 && num_free_blocks == 5;
+    passed &= own_blocks(&child, 39, 41, false) == 1 && num_free_blocks == 4;
+    passed &= own_blocks(&child, 39, 41, true) == 0;
+    passed &= child.blocks[2] != parent.blocks[2];
+    passed &= block_refs[child.blocks[2]] == 1 && block_refs[parent.blocks[2]] == 1;
+    passed &= block_refs[parent.blocks[0]] == 2 && block_refs[parent.blocks[1]] == 2;
+    cudaStreamSynchronize(compute_stream);
+    passed &= block_holds(child.blocks[2], 300);
+    fill_block(child.blocks[2], 400);
+    passed &= block_holds(parent.blocks[2], 300);
+
+    // Swapped out, the child gives back the block only it had and its shares of the others
+    swap_out(&child);
+    passed &= child.swapped && child.num_swapped == 3 && num_free_blocks == 5;
+    LOOP(i, 3) {
+        passed &= child.blocks[i] == SWAPPED && block_refs[parent.blocks[i]] == 1;
+    }
+    passed &= own_blocks(&child, 39, 41, true) == 0;
+    cudaStreamSynchronize(compute_stream);
+    LOOP(i, num_free_blocks) {
+        fill_block(free_blocks[i], -1);
+    }
+
+    // It is only let back in once there are blocks for all of it, and then it has
+    // its contents back in blocks of its own
+    int num_free = num_free_blocks;
+    num_free_blocks = 2;
+    passed &= !admit(&child) && child.swapped && child.blocks[0] == SWAPPED;
+    num_free_blocks = num_free;
+    passed &= admit(&child) && !child.swapped && !child.num_swapped && num_free_blocks == 2;
+    LOOP(i, 3) {
+        passed &= child.blocks[i] >= 0 && child.blocks[i] != parent.blocks[i] && block_refs[child.blocks[i]] == 1;
+    }
+    passed &= num_swap_copies == 1;
+    free_swap_copies(true);
+    passed &= num_swap_copies == 0;
+    passed &= block_holds(child.blocks[0], 100) && block_holds(child.blocks[1], 200);
+    passed &= block_holds(child.blocks[2], 400);
+
+    // The prefix cache holds on to the parent's blocks once it is done, until they are
+    // needed
+    max_prefix_blocks = 8;
+    store_prefix(&parent);
+    passed &= num_prefixes == 1 && prefix_blocks == 3;
+    LOOP(i, 3) {
+        passed &= block_refs[parent.blocks[i]] == 2;
+    }
+    free_sequence(&parent);
+    free_sequence(&child);
+    passed &= num_free_blocks == 5;
+    passed &= make_room(num_blocks) && !num_prefixes && !prefix_blocks && all_free();
+
+    if (passed) {
+        printf("Test KV Blocks PASSED.\n");
+    } else {
+        printf("Test KV Blocks FAILED.\n");
+    }
+    free_cache();
+}
+
+// Cache the rest of the history of seq, as a step would, then retire it into the prefix cache
+void finish_sequence(Sequence* seq) {
+    own_blocks(seq, seq->processed[0], seq->num_tokens, false);
+    seq->processed[0] = seq->num_tokens;
+    store_prefix(seq);
+    free_sequence(seq);
+}
+
+// The tokens from first on, n of them
+Sequence counted_sequence(int first, int n) {
+    int tokens[64];
+    LOOP(i, n) {
+        tokens[i] = first + i;
+    }
+    return test_sequence(tokens, n);
+}
+
+void prefixCacheTest() {
+    printf("------------------------------------------\n");
+    printf("Test Prefix Cache RUNNING.\n");
+    reset_cache(16);
+    max_prefix_blocks = 4;
+    bool passed = true;
+
+    Sequence a = counted_sequence(1, 20);
+    finish_sequence(&a);
+    passed &= num_prefixes == 1 && prefix_blocks == 2;
+    int* cached = prefixes[0].blocks;
+    passed &= block_refs[cached[0]] == 1 && block_refs[cached[1]] == 1;
+
+    // The same history again still has its last token run, for its logits
+    Sequence b = counted_sequence(1, 20);
+    reuse_prefix(&b);
+    passed &= b.processed[0] == 19 && b.blocks[0] == cached[0] && b.blocks[1] == cached[1];
+    passed &= block_refs[cached[0]] == 2 && block_refs[cached[1]] == 2;
+
+    // Once it goes on past the entry, the longer history takes the place of the entry
+    b.num_tokens = 30;
+    LOOP(i, 30) {
+        b.tokens[i] = i + 1;
+    }
+    finish_sequence(&b);
+    passed &= num_prefixes == 1 && prefixes[0].len == 30 && prefix_blocks == 2;
+    passed &= block_refs[prefixes[0].blocks[0]] == 1 && block_refs[prefixes[0].blocks[1]] == 1;
+
+    // and a shorter history that an entry already has adds nothing
+    Sequence c = counted_sequence(1, 10);
+    reuse_prefix(&c);
+    passed &= c.processed[0] == 9;
+    finish_sequence(&c);
+    passed &= num_prefixes == 1 && prefixes[0].len == 30 && prefix_blocks == 2;
+
+    // Past max_prefix_blocks the least recently used entry goes
+    Sequence d = counted_sequence(100, 16);
+    finish_sequence(&d);
+    passed &= num_prefixes == 2 && prefix_blocks == 3;
+    Sequence e = counted_sequence(1, 31);
+    reuse_prefix(&e);
+    passed &= e.processed[0] == 30;
+    free_sequence(&e);
+    Sequence f = counted_sequence(200, 32);
+    finish_sequence(&f);
+    passed &= num_prefixes == 2 && prefix_blocks == 4 && prefix_blocks <= max_prefix_blocks;
+    Sequence g = counted_sequence(100, 16);
+    reuse_prefix(&g);
+    passed &= g.processed[0] == 0 && g.blocks[0] == -1;
+    free_sequence(&g);
+    passed &= num_free_blocks == num_blocks - prefix_blocks;
+
+    // Blocks a sequence needs come before the entries
+    passed &= make_room(num_blocks - 2) && num_prefixes == 1 && prefix_blocks == 2;
+    passed &= make_room(num_blocks) && !num_prefixes && !prefix_blocks && all_free();
+    passed &= !make_room(num_blocks + 1);
+
+    // The next turn of a conversation starts with the history of the last, as long as
+    // both fit into half the context
+    Sequence previous = counted_sequence(1, 20);
+    Sequence next = counted_sequence(100, 5);
+    continue_conversation(&next, &previous);
+    passed &= next.num_tokens == 25 && next.tokens[0] == 1 && next.tokens[19] == 20 && next.tokens[20] == 100;
+    free_sequence(&next);
+    previous.num_tokens = 40;
+    LOOP(i, 40) {
+        previous.tokens[i] = i + 1;
+    }
+    next = counted_sequence(100, 5);
+    continue_conversation(&next, &previous);
+    passed &= next.num_tokens == zz / 2 && next.tokens[0] == 14 && next.tokens[26] == 40 && next.tokens[27] == 100;
+    free_sequence(&next);
+    next = counted_sequence(100, 40);
+    continue_conversation(&next, &previous);
+    passed &= next.num_tokens == 40 && next.tokens[0] == 100;
+    free_sequence(&next);
+    free_sequence(&previous);
+
+    if (passed) {
+        printf("Test Prefix Cache PASSED.\n");
+    } else {
+        printf("Test Prefix Cache FAILED.\n");
+    }
+    free_cache();
+}
+
+// A packed file of three tensors, an fp32 one, an int8 one with a scale per row and
+// an int4 one, that take up all of its size bytes after the table
+long long test_pack(char* file, PackedTensor** tensors) {
+    PackedHeader* header = (PackedHeader*)file;
+    *header = (PackedHeader){PACK_MAGIC, 64, 1, 3};
+    *tensors = (PackedTensor*)(header + 1);
+    (*tensors)[0] = (PackedTensor){2, 4, DTYPE_FP32, 0, 128, 0};
+    (*tensors)[1] = (PackedTensor){4, 8, DTYPE_INT8, 8, 160, 192};
+    (*tensors)[2] = (PackedTensor){2, 8, DTYPE_INT4, 0, 208, 0};
+    return 216;
+}
+
+void packedTableTest() {
+    printf("------------------------------------------\n");
+    printf("Test Packed Table RUNNING.\n");
+    char file[256] = {0};
+    PackedTensor* tensors;
+    long long size = test_pack(file, &tensors);
+    bool passed = packed_intact(file, size);
+
+    // Cut off anywhere, in the table or in a tensor, the file is no longer intact
+    passed &= !packed_intact(file, size - 1) && !packed_intact(file, 100);
+
+    // and neither is it with a tensor, or its scales, past the end or in the table
+    test_pack(file, &tensors);
+    tensors[2].offset = 212;
+    passed &= !packed_intact(file, size);
+    test_pack(file, &tensors);
+    tensors[1].scales = 208;
+    passed &= !packed_intact(file, size);
+    test_pack(file, &tensors);
+    tensors[0].offset = 64;
+    passed &= !packed_intact(file, size);
+
+    // or with a table that makes no sense
+    test_pack(file, &tensors);
+    tensors[2].dtype = DTYPE_INT4 + 1;
+    passed &= !packed_intact(file, size);
+    test_pack(file, &tensors);
+    tensors[1].group = 0;
+    passed &= !packed_intact(file, size);
+    test_pack(file, &tensors);
+    ((PackedHeader*)file)->ntensors = 8;
+    passed &= !packed_intact(file, size);
+
+    if (passed) {
+        printf("Test Packed Table PASSED.\n");
+    } else {
+        printf("Test Packed Table FAILED.\n");
+    }
+}
+
+int main() {
+
+    kvBlocksTest();
+    prefixCacheTest();
+    packedTableTest();
+
+    return 0;
+}
@@ -4,14 +4,23 @@
 
 const size_t seed = 123;
 
-float time(const char *prompt, char *type) {
+// Half precision runs of the GPU demo, compared against its fp32 output
+const size_t num_precisions = 2;
+const char *precisions[] = {"fp16", "bf16"};
+
+// Run one demo on prompt and return its time to respond. The response is copied
+// into response, flags are passed through to the demo as FLAGS.
+float time(const char *prompt, char *type, const char *flags, char *response) {
     FILE *fp;
     char output[1024]; // Buffer to store the output
-    char response[1024]; // AI response
+    char label[64];
     double timing;
 
+    snprintf(label, sizeof(label), "%s%s%s", type, *flags ? " " : "", flags);
+    response[0] = 0;
+
     // Assemble the prompt
-    size_t length = snprintf(NULL, 0, "make %s_seed seed=%zu prompt=\"%s\"", type, seed, prompt) + 1; 
+    size_t length = snprintf(NULL, 0, "make %s_seed seed=%zu prompt=\"%s\" FLAGS=\"%s\"", type, seed, prompt, flags) + 1; 
     char* command = (char*)malloc(length);
     if (command == NULL) {
         perror("Memory allocation failed");
@@ -19,7 +28,7 @@ float time(const char *prompt, char *type) {
     }
 
     // Format the string
-    snprintf(command, length, "make %s_seed seed=%zu prompt=\"%s\"", type, seed, prompt);
+    snprintf(command, length, "make %s_seed seed=%zu prompt=\"%s\" FLAGS=\"%s\"", type, seed, prompt, flags);
 
     // Run the command and open a pipe to read its output
     fp = popen(command, "r");
@@ -36,7 +45,7 @@ float time(const char *prompt, char *type) {
         char *ai_response = strstr(output, "AI: ");
         if (ai_response != NULL) {
             strcpy(response, ai_response + 4); // Copy the AI response, skipping "AI: "
-            printf("%s response: %s", type, response);
+            printf("%s response: %s", label, response);
         }
         // Check if the line contains the timing information
         if (strstr(output, "----Seconds to respond:") != NULL) {
@@ -49,13 +58,25 @@ float time(const char *prompt, char *type) {
     pclose(fp);
 
     // Print the extracted timing number
-    printf("%s timing: %.6lf\n", type, timing);
+    printf("%s timing: %.6lf\n", label, timing);
 
     free(command);
 
     return timing;
 }
 
+// How far a response agrees with the reference, as the length of the common prefix.
+// Sampling is seeded identically, so this only drops below 100% once rounding
+// has changed which token got sampled.
+double agreement(const char *response, const char *reference) {
+    size_t same = 0;
+    size_t length = strlen(reference);
+    while (same < length && response[same] == reference[same]) {
+        same++;
+    }
+    return length ? 100.0 * same / length : 100.0;
+}
+
 int main() {
     // Array of prompt strings
     const size_t num_prompts = 3; // You can add more prompts
@@ -64,6 +85,14 @@ int main() {
     // Variables to store total times for CPU and GPU
     float total_cpu_time = 0.0f;
     float total_gpu_time = 0.0f;
+    float total_half_time[num_precisions];
+    double total_agreement[num_precisions];
+    char cpu_response[1024], gpu_response[1024], half_response[1024];
+    char flags[64];
+    for (int j = 0; j < num_precisions; j++) {
+        total_half_time[j] = 0.0f;
+        total_agreement[j] = 0.0;
+    }
 
     printf("\ntimer program is running. this may take a few minutes...\n\n");
 
@@ -73,18 +102,31 @@ int main() {
         printf("prompt: %s\n", prompt);
         
         // Call time_cpu() and time_gpu() functions with the current prompt
-        float cpu_time = time(prompt, "cpu");
-        float gpu_time = time(prompt, "gpu");
+        float cpu_time = time(prompt, "cpu", "", cpu_response);
+        float gpu_time = time(prompt, "gpu", "", gpu_response);
 
         // Accumulate total times for CPU and GPU
         total_cpu_time += cpu_time;
         total_gpu_time += gpu_time;
+
+        // The same prompt with 16 bit weights, and how far it drifts from fp32
+        for (int j = 0; j < num_precisions; j++) {
+            snprintf(flags, sizeof(flags), "--precision=%s", precisions[j]);
+            total_half_time[j] += time(prompt, "gpu", flags, half_response);
+            double same = agreement(half_response, gpu_response);
+            total_agreement[j] += same;
+            printf("%s drift: %.1f%% of the fp32 response matches\n", precisions[j], same);
+        }
     }
 
     // Print the total times for CPU and GPU
     printf("\n");
     printf("total cpu time: %.6f\n", total_cpu_time);
     printf("total gpu time: %.6f\n", total_gpu_time);
+    for (int j = 0; j < num_precisions; j++) {
+        printf("total gpu %s time: %.6f, mean agreement with fp32: %.1f%%\n",
+               precisions[j], total_half_time[j], total_agreement[j] / num_prompts);
+    }
 
     return 0;
 }
\ No newline at end of file